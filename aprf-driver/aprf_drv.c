@@ -1,6 +1,7 @@
 #include "include/aprf_drv.h"
 #include "include/bp-genetlink.h"
 
+/* default watermarks of the frames pending TX status, see tx_queue_high */
 #define WARN_QUEUE 100
 #define MAX_QUEUE 200
 
@@ -20,6 +21,26 @@ static bool paged_rx = false;
 module_param(paged_rx, bool, 0644);
 MODULE_PARM_DESC(paged_rx, "Use paged SKBs for RX instead of linear ones");
 
+static bool radio_mon = false;
+module_param(radio_mon, bool, 0444);
+MODULE_PARM_DESC(radio_mon, "Create a monitor netdev (wmon%d) capturing the frames of each radio");
+
+static bool shared_rx = false;
+module_param(shared_rx, bool, 0644);
+MODULE_PARM_DESC(shared_rx, "Share one paged copy of a frame between all its receivers");
+
+static unsigned int tx_batch_frames = 32;
+module_param(tx_batch_frames, uint, 0644);
+MODULE_PARM_DESC(tx_batch_frames, "Frames coalesced into one message to a batching wmediumd");
+
+static unsigned int tx_batch_delay_us = 100;
+module_param(tx_batch_delay_us, uint, 0644);
+MODULE_PARM_DESC(tx_batch_delay_us, "Longest time a frame waits for its batch to be sent, in usecs");
+
+static bool medium_dev = false;
+module_param(medium_dev, bool, 0444);
+MODULE_PARM_DESC(medium_dev, "Offer /dev/aprf_medium, a shared memory transport for the medium simulator");
+
 static bool rctbl = true;
 module_param(rctbl, bool, 0444);
 MODULE_PARM_DESC(rctbl, "Handle rate control table");
@@ -139,6 +160,11 @@ static inline void hwsim_clear_sta_magic(struct ieee80211_sta *sta)
 
 struct hwsim_chanctx_priv {
     u32 magic;
+    /* channel this context is registered with in the receiver index */
+    struct ieee80211_channel *rx_chan;
+    /* vifs assigned and the channel they are accounted on in active_chans */
+    int n_vifs;
+    struct ieee80211_channel *active_chan;
 };
 
 #define HWSIM_CHANCTX_MAGIC 0x6d53774a
@@ -165,9 +191,21 @@ static unsigned int hwsim_net_id;
 
 static DEFINE_IDA(hwsim_netgroup_ida);
 
+/* a wmediumd in charge of some of the radios of a network namespace */
+struct hwsim_medium_shard {
+    u32 portid;
+    u32 flags;
+};
+
 struct hwsim_net {
     int netgroup;
-    u32 wmediumd;
+    /* registered wmediumds, radio idx % nr_shards picks the one in charge;
+     * under hwsim_radio_lock
+     */
+    u32 nr_shards;
+    struct hwsim_medium_shard shards[HWSIM_MAX_SHARDS];
+    /* registered shared memory medium, under hwsim_radio_lock */
+    struct hwsim_ring *medium_ring;
 };
 
 static inline int hwsim_net_get_netgroup(struct net *net)
@@ -186,24 +224,60 @@ static inline int hwsim_net_set_netgroup(struct net *net)
     return hwsim_net->netgroup >= 0 ? 0 : -ENOMEM;
 }
 
-static inline u32 hwsim_net_get_wmediumd(struct net *net)
+static inline bool hwsim_net_has_wmediumd(struct net *net)
+{
+    struct hwsim_net *hwsim_net = net_generic(net, hwsim_net_id);
+
+    return READ_ONCE(hwsim_net->nr_shards);
+}
+
+/* the wmediumd in charge of radio @idx, if any */
+static inline struct hwsim_medium_shard *hwsim_net_get_shard(struct net *net,
+                                                             int idx)
+{
+    struct hwsim_net *hwsim_net = net_generic(net, hwsim_net_id);
+    u32 nr_shards = READ_ONCE(hwsim_net->nr_shards);
+
+    if (!nr_shards)
+        return NULL;
+
+    return &hwsim_net->shards[idx % nr_shards];
+}
+
+/* whether @portid is one of the wmediumds registered in @net */
+static bool hwsim_net_is_wmediumd(struct net *net, u32 portid)
+{
+    struct hwsim_net *hwsim_net = net_generic(net, hwsim_net_id);
+    u32 i, nr_shards = READ_ONCE(hwsim_net->nr_shards);
+
+    for (i = 0; i < nr_shards; i++)
+        if (READ_ONCE(hwsim_net->shards[i].portid) == portid)
+            return true;
+
+    return false;
+}
+
+static inline struct hwsim_ring *hwsim_net_get_medium_ring(struct net *net)
 {
     struct hwsim_net *hwsim_net = net_generic(net, hwsim_net_id);
 
-    return hwsim_net->wmediumd;
+    return hwsim_net->medium_ring;
 }
 
-static inline void hwsim_net_set_wmediumd(struct net *net, u32 portid)
+static inline void hwsim_net_set_medium_ring(struct net *net,
+                                             struct hwsim_ring *ring)
 {
     struct hwsim_net *hwsim_net = net_generic(net, hwsim_net_id);
 
-    hwsim_net->wmediumd = portid;
+    hwsim_net->medium_ring = ring;
 }
 
 static struct class *hwsim_class;
 
 static struct net_device *hwsim_mon; /* global monitor netdev */
 
+static void hwsim_mon_setup(struct net_device *dev);
+
 
 #define CHAN2G(_freq)  { \
 	.band = NL80211_BAND_2GHZ, \
@@ -354,12 +428,6 @@ static struct rhashtable hwsim_radios_rht;
 static int hwsim_radio_idx;
 static int hwsim_radios_generation = 1;
 
-static struct platform_driver wifi_hwsim_driver = {
-        .driver = {
-                .name = "aprf_drv",
-        },
-};
-
 static const struct rhashtable_params hwsim_rht_params = {
         .nelem_hint = 2,
         .automatic_shrinking = true,
@@ -368,6 +436,182 @@ static const struct rhashtable_params hwsim_rht_params = {
         .head_offset = offsetof(struct wifi_hwsim_data, rht),
 };
 
+/*
+ * Receiver index of the in-kernel medium: radios keyed by (netgroup, center
+ * frequency) so a transmitter only visits radios it can actually reach. A
+ * radio may listen on the same frequency for several reasons at once (its
+ * operating channel, a channel context, a scan or ROC), hence the refcount.
+ * Writers hold hwsim_radio_lock, the fanout walks the buckets under RCU.
+ */
+struct hwsim_rx_index_entry {
+    struct rcu_head rcu;
+    struct hlist_node node;
+    struct list_head list;
+    struct wifi_hwsim_data *data;
+    int netgroup;
+    u32 freq;
+    int refs;
+};
+
+#define HWSIM_RX_INDEX_BITS 8
+static DEFINE_HASHTABLE(hwsim_rx_index, HWSIM_RX_INDEX_BITS);
+
+static inline u32 hwsim_rx_index_key(int netgroup, u32 freq)
+{
+    return ((u32)netgroup << 16) ^ freq;
+}
+
+static struct hwsim_rx_index_entry *
+hwsim_rx_index_find(struct wifi_hwsim_data *data, u32 freq)
+{
+    struct hwsim_rx_index_entry *entry;
+
+    list_for_each_entry(entry, &data->rx_index, list)
+        if (entry->freq == freq)
+            return entry;
+
+    return NULL;
+}
+
+/*
+ * Callers may sleep, so the entry is allocated up front and only dropped if
+ * the radio is indexed on @chan already. A radio left out of the index would
+ * silently stop receiving in-kernel frames there, hence the warning.
+ */
+static int hwsim_rx_index_add(struct wifi_hwsim_data *data,
+                              struct ieee80211_channel *chan)
+{
+    struct hwsim_rx_index_entry *entry, *new;
+
+    if (!chan)
+        return 0;
+
+    new = kzalloc(sizeof(*new), GFP_KERNEL);
+    if (!new) {
+        wiphy_warn(data->hw->wiphy,
+                   "cannot index the radio on %u MHz, it will not receive there\n",
+                   chan->center_freq);
+        return -ENOMEM;
+    }
+
+    spin_lock_bh(&hwsim_radio_lock);
+    if (data->unlinked)
+        goto out;
+
+    entry = hwsim_rx_index_find(data, chan->center_freq);
+    if (entry) {
+        entry->refs++;
+        goto out;
+    }
+
+    new->data = data;
+    new->netgroup = data->netgroup;
+    new->freq = chan->center_freq;
+    new->refs = 1;
+    list_add(&new->list, &data->rx_index);
+    hash_add_rcu(hwsim_rx_index, &new->node,
+             hwsim_rx_index_key(new->netgroup, new->freq));
+    new = NULL;
+out:
+    spin_unlock_bh(&hwsim_radio_lock);
+    kfree(new);
+    return 0;
+}
+
+static void hwsim_rx_index_del(struct wifi_hwsim_data *data,
+                               struct ieee80211_channel *chan)
+{
+    struct hwsim_rx_index_entry *entry;
+
+    if (!chan)
+        return;
+
+    spin_lock_bh(&hwsim_radio_lock);
+    entry = hwsim_rx_index_find(data, chan->center_freq);
+    if (entry && --entry->refs == 0) {
+        hash_del_rcu(&entry->node);
+        list_del(&entry->list);
+        kfree_rcu(entry, rcu);
+    }
+    spin_unlock_bh(&hwsim_radio_lock);
+}
+
+/* drop every index entry of a radio, hwsim_radio_lock must be held */
+static void hwsim_rx_index_flush(struct wifi_hwsim_data *data)
+{
+    struct hwsim_rx_index_entry *entry, *tmp;
+
+    list_for_each_entry_safe(entry, tmp, &data->rx_index, list) {
+        hash_del_rcu(&entry->node);
+        list_del(&entry->list);
+        kfree_rcu(entry, rcu);
+    }
+}
+
+/*
+ * Take a radio off the radio list, the address hash and the receiver index
+ * and stop it from being indexed again. Called with hwsim_radio_lock held;
+ * datapath readers may still see the radio until an RCU grace period has
+ * elapsed, so the caller has to synchronize_rcu() before destroying it.
+ */
+static void hwsim_radio_unlink(struct wifi_hwsim_data *data)
+{
+    list_del_rcu(&data->list);
+    rhashtable_remove_fast(&hwsim_radios_rht, &data->rht,
+                           hwsim_rht_params);
+    hwsim_rx_index_flush(data);
+    data->unlinked = true;
+    hwsim_radios_generation++;
+}
+
+static void hwsim_stats_add(struct wifi_hwsim_data *data,
+                            enum hwsim_stat stat, u64 val)
+{
+    struct hwsim_pcpu_stats *stats;
+    unsigned long flags;
+
+    stats = get_cpu_ptr(data->stats);
+    flags = u64_stats_update_begin_irqsave(&stats->syncp);
+    u64_stats_add(&stats->cnt[stat], val);
+    u64_stats_update_end_irqrestore(&stats->syncp, flags);
+    put_cpu_ptr(data->stats);
+}
+
+static inline void hwsim_stats_inc(struct wifi_hwsim_data *data,
+                                   enum hwsim_stat stat)
+{
+    hwsim_stats_add(data, stat, 1);
+}
+
+static void hwsim_stats_fetch(struct wifi_hwsim_data *data, u64 *sum)
+{
+    int cpu, i;
+
+    memset(sum, 0, sizeof(*sum) * HWSIM_STAT_NUM);
+
+    for_each_possible_cpu(cpu) {
+        const struct hwsim_pcpu_stats *stats =
+                per_cpu_ptr(data->stats, cpu);
+        u64 cnt[HWSIM_STAT_NUM];
+        unsigned int start;
+
+        do {
+            start = u64_stats_fetch_begin_irq(&stats->syncp);
+            for (i = 0; i < HWSIM_STAT_NUM; i++)
+                cnt[i] = u64_stats_read(&stats->cnt[i]);
+        } while (u64_stats_fetch_retry_irq(&stats->syncp, start));
+
+        for (i = 0; i < HWSIM_STAT_NUM; i++)
+            sum[i] += cnt[i];
+    }
+}
+
+static struct platform_driver wifi_hwsim_driver = {
+        .driver = {
+                .name = "aprf_drv",
+        },
+};
+
 struct hwsim_radiotap_hdr {
     struct ieee80211_radiotap_header hdr;
     __le64 rt_tsft;
@@ -526,42 +770,143 @@ static const struct nla_policy hwsim_genl_policy[HWSIM_ATTR_MAX + 1] = {
 	[HWSIM_ATTR_MLO_SUPPORT] = { .type = NLA_FLAG },
 	[HWSIM_ATTR_PMSR_SUPPORT] = NLA_POLICY_NESTED(hwsim_pmsr_capa_policy),
 	[HWSIM_ATTR_PMSR_RESULT] = NLA_POLICY_NESTED(hwsim_pmsr_peers_result_policy),
+        [HWSIM_ATTR_USE_TXQ] = { .type = NLA_FLAG },
+        [HWSIM_ATTR_REGISTER_FLAGS] = { .type = NLA_U32 },
+        [HWSIM_ATTR_FRAMES] = { .type = NLA_NESTED_ARRAY },
+        [HWSIM_ATTR_TX_INFO_BATCH] = { .type = NLA_BINARY },
+        [HWSIM_ATTR_TX_QUEUE_HIGH] = { .type = NLA_U32 },
+        [HWSIM_ATTR_TX_QUEUE_LOW] = { .type = NLA_U32 },
+        [HWSIM_ATTR_TX_BACKPRESSURE] = { .type = NLA_FLAG },
+        [HWSIM_ATTR_SHARD_ID] = { .type = NLA_U32 },
+        [HWSIM_ATTR_SHARD_COUNT] = { .type = NLA_U32 },
+        [HWSIM_ATTR_CHANNEL_WIDTH] = { .type = NLA_U32 },
+        [HWSIM_ATTR_CENTER_FREQ1] = { .type = NLA_U32 },
+        [HWSIM_ATTR_CENTER_FREQ2] = { .type = NLA_U32 },
+        [HWSIM_ATTR_TX_DESC] = { .type = NLA_BINARY },
+        [HWSIM_ATTR_GROUP] = { .type = NLA_U64 },
+        [HWSIM_ATTR_RADIO_COUNT] = { .type = NLA_U32 },
+        [HWSIM_ATTR_RADIOS] = { .type = NLA_NESTED_ARRAY },
 };
 
 #if IS_REACHABLE(CONFIG_VIRTIO)
 
-/* WIFI_HWSIM virtio queues */
-static struct virtqueue *hwsim_vqs[HWSIM_NUM_VQS];
+/* one pair of WIFI_HWSIM virtio queues, see VIRTIO_HWSIM_F_MQ */
+struct hwsim_virtio_queue {
+    struct virtqueue *vqs[HWSIM_NUM_VQS];
+    /* each protects its queue and, when taken, the enabled state */
+    spinlock_t tx_lock;
+    spinlock_t rx_lock;
+    struct work_struct rx_work;
+    /* backs the RX buffers, HWSIM_VIRTIO_RX_BUF_LEN fragments of its pages */
+    struct page_pool *rx_pool;
+    /* buffers added since the device was last notified, under tx_lock */
+    unsigned int tx_unkicked;
+    /* notifies the device of them once the current burst is over */
+    struct tasklet_struct tx_kick;
+    char names[HWSIM_NUM_VQS][8];
+};
+
+static struct hwsim_virtio_queue hwsim_virtio_queues[HWSIM_VIRTIO_MAX_QUEUE_PAIRS];
+static unsigned int hwsim_virtio_nqueues;
 static bool hwsim_virtio_enabled;
-static DEFINE_SPINLOCK(hwsim_virtio_lock);
 
-static void hwsim_virtio_rx_work(struct work_struct *work);
-static DECLARE_WORK(hwsim_virtio_rx, hwsim_virtio_rx_work);
+/* TX buffers after which the device is notified without waiting any longer */
+#define HWSIM_VIRTIO_TX_KICK_BATCH 32
+
+/* TX messages longer than this go out as header and attributes separately */
+#define HWSIM_VIRTIO_TX_SPLIT_LEN 256
+
+/* free the TX buffers the device is done with; tx_lock held */
+static void hwsim_virtio_tx_free(struct virtqueue *vq)
+{
+    unsigned int len;
+    struct sk_buff *skb;
+
+    while ((skb = virtqueue_get_buf(vq, &len)))
+        nlmsg_free(skb);
+}
+
+/*
+ * Free them from the TX completion callback and ask to be called back only
+ * once most of those still in flight are done as well. The transmit path
+ * only frees and leaves the callback as set here. Called with tx_lock held.
+ */
+static void hwsim_virtio_tx_reclaim(struct virtqueue *vq)
+{
+    do {
+        virtqueue_disable_cb(vq);
+        hwsim_virtio_tx_free(vq);
+    } while (!virtqueue_enable_cb_delayed(vq));
+}
+
+/* notify once per burst, virtqueue_kick_prepare() skips needless notifies */
+static void hwsim_virtio_tx_kick(struct tasklet_struct *t)
+{
+    struct hwsim_virtio_queue *q = from_tasklet(q, t, tx_kick);
+    unsigned long flags;
+
+    spin_lock_irqsave(&q->tx_lock, flags);
+    if (q->tx_unkicked && q->vqs[HWSIM_VQ_TX]) {
+        q->tx_unkicked = 0;
+        if (virtqueue_kick_prepare(q->vqs[HWSIM_VQ_TX]))
+            virtqueue_notify(q->vqs[HWSIM_VQ_TX]);
+    }
+    spin_unlock_irqrestore(&q->tx_lock, flags);
+}
 
 static int hwsim_tx_virtio(struct wifi_hwsim_data *data,
                            struct sk_buff *skb)
 {
-    struct scatterlist sg[1];
+    struct hwsim_virtio_queue *q;
+    struct scatterlist sg[2];
+    unsigned int nsg = 1;
+    struct virtqueue *vq;
     unsigned long flags;
-    int err;
+    int err = -ENODEV;
 
-    spin_lock_irqsave(&hwsim_virtio_lock, flags);
-    if (!hwsim_virtio_enabled) {
-        err = -ENODEV;
+    /* nqueues is set before the device is enabled */
+    if (!smp_load_acquire(&hwsim_virtio_enabled))
+        goto out_free;
+
+    q = &hwsim_virtio_queues[data->idx % hwsim_virtio_nqueues];
+
+    /* the queues of a removed device are cleared under the same lock */
+    spin_lock_irqsave(&q->tx_lock, flags);
+    if (!hwsim_virtio_enabled || !q->vqs[HWSIM_VQ_TX]) {
+        spin_unlock_irqrestore(&q->tx_lock, flags);
         goto out_free;
     }
 
-    sg_init_one(sg, skb->head, skb_end_offset(skb));
-    err = virtqueue_add_outbuf(hwsim_vqs[HWSIM_VQ_TX], sg, 1, skb,
-                               GFP_ATOMIC);
-    if (err)
+    vq = q->vqs[HWSIM_VQ_TX];
+    hwsim_virtio_tx_free(vq);
+
+    /* genetlink messages are linear, describe only the bytes put */
+    if (skb->len > HWSIM_VIRTIO_TX_SPLIT_LEN) {
+        sg_init_table(sg, 2);
+        sg_set_buf(&sg[0], skb->data, NLMSG_HDRLEN + GENL_HDRLEN);
+        sg_set_buf(&sg[1], skb->data + NLMSG_HDRLEN + GENL_HDRLEN,
+                   skb->len - NLMSG_HDRLEN - GENL_HDRLEN);
+        nsg = 2;
+    } else {
+        sg_init_one(sg, skb->data, skb->len);
+    }
+    err = virtqueue_add_outbuf(vq, sg, nsg, skb, GFP_ATOMIC);
+    if (err) {
+        spin_unlock_irqrestore(&q->tx_lock, flags);
         goto out_free;
-    virtqueue_kick(hwsim_vqs[HWSIM_VQ_TX]);
-    spin_unlock_irqrestore(&hwsim_virtio_lock, flags);
+    }
+
+    if (++q->tx_unkicked >= HWSIM_VIRTIO_TX_KICK_BATCH) {
+        q->tx_unkicked = 0;
+        if (virtqueue_kick_prepare(vq))
+            virtqueue_notify(vq);
+    } else {
+        tasklet_schedule(&q->tx_kick);
+    }
+    spin_unlock_irqrestore(&q->tx_lock, flags);
     return 0;
 
     out_free:
-    spin_unlock_irqrestore(&hwsim_virtio_lock, flags);
     nlmsg_free(skb);
     return err;
 }
@@ -721,8 +1066,11 @@ static int hwsim_fops_ps_write(void *dat, u64 val)
         local_bh_enable();
         return 0;
     }
+    mutex_lock(&data->mutex);
     old_ps = data->ps;
     data->ps = val;
+    hwsim_rf_state_update(data);
+    mutex_unlock(&data->mutex);
 
     local_bh_disable();
     if (old_ps == PS_DISABLED && val != PS_DISABLED) {
@@ -764,7 +1112,11 @@ static int hwsim_fops_group_read(void *dat, u64 *val)
 static int hwsim_fops_group_write(void *dat, u64 val)
 {
     struct wifi_hwsim_data *data = dat;
+
+    mutex_lock(&data->mutex);
     data->group = val;
+    hwsim_rf_state_update(data);
+    mutex_unlock(&data->mutex);
     return 0;
 }
 
@@ -772,6 +1124,59 @@ DEFINE_DEBUGFS_ATTRIBUTE(hwsim_fops_group,
                          hwsim_fops_group_read, hwsim_fops_group_write,
                          "%llx\n");
 
+/* the watermarks keep low < high and high > 0, as HWSIM_CMD_NEW_RADIO demands */
+static int hwsim_fops_tx_queue_high_read(void *dat, u64 *val)
+{
+    struct wifi_hwsim_data *data = dat;
+
+    *val = READ_ONCE(data->tx_queue_high);
+    return 0;
+}
+
+static int hwsim_fops_tx_queue_high_write(void *dat, u64 val)
+{
+    struct wifi_hwsim_data *data = dat;
+    int err = 0;
+
+    mutex_lock(&data->mutex);
+    if (!val || val > U32_MAX || val <= data->tx_queue_low)
+        err = -EINVAL;
+    else
+        WRITE_ONCE(data->tx_queue_high, val);
+    mutex_unlock(&data->mutex);
+    return err;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(hwsim_fops_tx_queue_high,
+                         hwsim_fops_tx_queue_high_read,
+                         hwsim_fops_tx_queue_high_write, "%llu\n");
+
+static int hwsim_fops_tx_queue_low_read(void *dat, u64 *val)
+{
+    struct wifi_hwsim_data *data = dat;
+
+    *val = READ_ONCE(data->tx_queue_low);
+    return 0;
+}
+
+static int hwsim_fops_tx_queue_low_write(void *dat, u64 val)
+{
+    struct wifi_hwsim_data *data = dat;
+    int err = 0;
+
+    mutex_lock(&data->mutex);
+    if (val >= data->tx_queue_high)
+        err = -EINVAL;
+    else
+        WRITE_ONCE(data->tx_queue_low, val);
+    mutex_unlock(&data->mutex);
+    return err;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(hwsim_fops_tx_queue_low,
+                         hwsim_fops_tx_queue_low_read,
+                         hwsim_fops_tx_queue_low_write, "%llu\n");
+
 static int hwsim_fops_rx_rssi_read(void *dat, u64 *val)
 {
 	struct wifi_hwsim_data *data = dat;
@@ -839,49 +1244,129 @@ static void wifi_hwsim_set_tsf(struct ieee80211_hw *hw,
     }
 }
 
-static void wifi_hwsim_monitor_rx(struct ieee80211_hw *hw,
-                                      struct sk_buff *tx_skb,
-                                      struct ieee80211_channel *chan)
+/* TSFT, flags, rate, channel, signal and either MCS or VHT, with padding */
+#define HWSIM_RADIOTAP_TX_LEN 40
+
+static u16 hwsim_radiotap_band_flags(struct ieee80211_channel *chan)
 {
-    struct wifi_hwsim_data *data = hw->priv;
-    struct sk_buff *skb;
-    struct hwsim_radiotap_hdr *hdr;
-    u16 flags, bitrate;
+    switch (chan->band) {
+        case NL80211_BAND_2GHZ:
+            return IEEE80211_CHAN_2GHZ;
+        case NL80211_BAND_5GHZ:
+        case NL80211_BAND_6GHZ:
+            return IEEE80211_CHAN_5GHZ | IEEE80211_CHAN_OFDM;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Write the radiotap header describing a transmitted frame to @buf, which
+ * must have room for HWSIM_RADIOTAP_TX_LEN bytes. Returns the header length.
+ */
+static unsigned int hwsim_put_radiotap_tx(struct wifi_hwsim_data *data,
+                                          struct sk_buff *tx_skb,
+                                          struct ieee80211_channel *chan,
+                                          u8 *buf)
+{
+    struct ieee80211_radiotap_header *rthdr = (void *)buf;
     struct ieee80211_tx_info *info = IEEE80211_SKB_CB(tx_skb);
-    struct ieee80211_rate *txrate = ieee80211_get_tx_rate(hw, info);
+    struct ieee80211_tx_rate *rate = &info->control.rates[0];
+    u32 present = BIT(IEEE80211_RADIOTAP_TSFT) |
+                  BIT(IEEE80211_RADIOTAP_FLAGS) |
+                  BIT(IEEE80211_RADIOTAP_CHANNEL) |
+                  BIT(IEEE80211_RADIOTAP_DBM_ANTSIGNAL);
+    u16 chflags = hwsim_radiotap_band_flags(chan);
+    u8 *pos = buf + sizeof(*rthdr);
+    int signal = -50;
+
+    /* same signal the perfect medium reports to the receivers */
+    if (info->control.vif)
+        signal += info->control.vif->bss_conf.txpower;
 
-    if (!txrate)
-        bitrate = 0;
-    else
-        bitrate = txrate->bitrate;
+    put_unaligned(__wifi_hwsim_get_tsf(data), (__le64 *)pos);
+    pos += 8;
 
-    if (!netif_running(hwsim_mon))
-        return;
+    *pos++ = 0;
 
-    skb = skb_copy_expand(tx_skb, sizeof(*hdr), 0, GFP_ATOMIC);
-    if (skb == NULL)
-        return;
+    if (!(rate->flags & (IEEE80211_TX_RC_MCS | IEEE80211_TX_RC_VHT_MCS))) {
+        struct ieee80211_rate *txrate = NULL;
 
-    hdr = skb_push(skb, sizeof(*hdr));
-    hdr->hdr.it_version = PKTHDR_RADIOTAP_VERSION;
-    hdr->hdr.it_pad = 0;
-    hdr->hdr.it_len = cpu_to_le16(sizeof(*hdr));
-    hdr->hdr.it_present = cpu_to_le32((1 << IEEE80211_RADIOTAP_FLAGS) |
-                                      (1 << IEEE80211_RADIOTAP_RATE) |
-                                      (1 << IEEE80211_RADIOTAP_TSFT) |
-                                      (1 << IEEE80211_RADIOTAP_CHANNEL));
-    hdr->rt_tsft = __wifi_hwsim_get_tsf(data);
-    hdr->rt_flags = 0;
-    hdr->rt_rate = bitrate / 5;
-    hdr->rt_channel = cpu_to_le16(chan->center_freq);
-    flags = IEEE80211_CHAN_2GHZ;
-    if (txrate && txrate->flags & IEEE80211_RATE_ERP_G)
-        flags |= IEEE80211_CHAN_OFDM;
-    else
-        flags |= IEEE80211_CHAN_CCK;
-    hdr->rt_chbitmask = cpu_to_le16(flags);
+        if (rate->idx >= 0)
+            txrate = &data->hw->wiphy->bands[chan->band]->bitrates[rate->idx];
+        present |= BIT(IEEE80211_RADIOTAP_RATE);
+        *pos++ = txrate ? txrate->bitrate / 5 : 0;
+        if (chan->band == NL80211_BAND_2GHZ) {
+            if (txrate && txrate->flags & IEEE80211_RATE_ERP_G)
+                chflags |= IEEE80211_CHAN_OFDM;
+            else
+                chflags |= IEEE80211_CHAN_CCK;
+        }
+    } else if (chan->band == NL80211_BAND_2GHZ) {
+        chflags |= IEEE80211_CHAN_DYN;
+    }
+
+    if ((pos - buf) & 1)
+        *pos++ = 0;
+    put_unaligned_le16(chan->center_freq, pos);
+    pos += 2;
+    put_unaligned_le16(chflags, pos);
+    pos += 2;
+
+    *pos++ = clamp(signal, -128, 127);
+
+    if (rate->flags & IEEE80211_TX_RC_MCS) {
+        u8 flags = 0;
+
+        present |= BIT(IEEE80211_RADIOTAP_MCS);
+        if (rate->flags & IEEE80211_TX_RC_40_MHZ_WIDTH)
+            flags |= IEEE80211_RADIOTAP_MCS_BW_40;
+        if (rate->flags & IEEE80211_TX_RC_SHORT_GI)
+            flags |= IEEE80211_RADIOTAP_MCS_SGI;
+        *pos++ = IEEE80211_RADIOTAP_MCS_HAVE_BW |
+                 IEEE80211_RADIOTAP_MCS_HAVE_MCS |
+                 IEEE80211_RADIOTAP_MCS_HAVE_GI;
+        *pos++ = flags;
+        *pos++ = rate->idx;
+    } else if (rate->flags & IEEE80211_TX_RC_VHT_MCS) {
+        u8 bw = 0;
+
+        present |= BIT(IEEE80211_RADIOTAP_VHT);
+        if (rate->flags & IEEE80211_TX_RC_40_MHZ_WIDTH)
+            bw = 1;
+        else if (rate->flags & IEEE80211_TX_RC_80_MHZ_WIDTH)
+            bw = 4;
+        else if (rate->flags & IEEE80211_TX_RC_160_MHZ_WIDTH)
+            bw = 11;
+
+        if ((pos - buf) & 1)
+            *pos++ = 0;
+        put_unaligned_le16(IEEE80211_RADIOTAP_VHT_KNOWN_GI |
+                           IEEE80211_RADIOTAP_VHT_KNOWN_BANDWIDTH, pos);
+        pos += 2;
+        *pos++ = rate->flags & IEEE80211_TX_RC_SHORT_GI ?
+                 IEEE80211_RADIOTAP_VHT_FLAG_SGI : 0;
+        *pos++ = bw;
+        *pos++ = (ieee80211_rate_get_vht_mcs(rate) << 4) |
+                 ieee80211_rate_get_vht_nss(rate);
+        memset(pos, 0, 3);
+        pos += 3;
+        /* coding, group_id, partial_aid */
+        memset(pos, 0, 4);
+        pos += 4;
+    }
 
-    skb->dev = hwsim_mon;
+    rthdr->it_version = PKTHDR_RADIOTAP_VERSION;
+    rthdr->it_pad = 0;
+    rthdr->it_len = cpu_to_le16(pos - buf);
+    rthdr->it_present = cpu_to_le32(present);
+
+    return pos - buf;
+}
+
+static void hwsim_monitor_deliver(struct sk_buff *skb, struct net_device *dev)
+{
+    skb->dev = dev;
     skb_reset_mac_header(skb);
     skb->ip_summed = CHECKSUM_UNNECESSARY;
     skb->pkt_type = PACKET_OTHERHOST;
@@ -890,16 +1375,65 @@ static void wifi_hwsim_monitor_rx(struct ieee80211_hw *hw,
     netif_rx(skb);
 }
 
+static void wifi_hwsim_monitor_rx(struct ieee80211_hw *hw,
+                                      struct sk_buff *tx_skb,
+                                      struct ieee80211_channel *chan)
+{
+    struct wifi_hwsim_data *data = hw->priv;
+    bool global = hwsim_mon && netif_running(hwsim_mon);
+    bool local = data->mon && netif_running(data->mon);
+    struct sk_buff *skb, *frame, *skb2;
+
+    if (!global && !local)
+        return;
+
+    /*
+     * The frame itself is not copied: a small skb carries the radiotap
+     * header and a clone of the frame hangs off its frag_list. Pushing the
+     * header into the frame's headroom instead would write to a buffer that
+     * is still shared with the transmit path.
+     */
+    skb = dev_alloc_skb(HWSIM_RADIOTAP_TX_LEN);
+    if (!skb)
+        return;
+
+    frame = skb_clone(tx_skb, GFP_ATOMIC);
+    if (!frame) {
+        kfree_skb(skb);
+        return;
+    }
+
+    skb_put(skb, hwsim_put_radiotap_tx(data, tx_skb, chan, skb->data));
+    skb_shinfo(skb)->frag_list = frame;
+    skb->len += frame->len;
+    skb->data_len += frame->len;
+    skb->truesize += frame->truesize;
+
+    if (global && local) {
+        skb2 = skb_clone(skb, GFP_ATOMIC);
+        if (skb2)
+            hwsim_monitor_deliver(skb2, data->mon);
+    } else if (local) {
+        hwsim_monitor_deliver(skb, data->mon);
+        return;
+    }
+
+    hwsim_monitor_deliver(skb, hwsim_mon);
+}
+
 
-static void wifi_hwsim_monitor_ack(struct ieee80211_channel *chan,
+static void wifi_hwsim_monitor_ack(struct wifi_hwsim_data *data,
+                                       struct ieee80211_channel *chan,
                                        const u8 *addr)
 {
-    struct sk_buff *skb;
+    bool global = hwsim_mon && netif_running(hwsim_mon);
+    bool local = data->mon && netif_running(data->mon);
+    struct sk_buff *skb, *skb2;
     struct hwsim_radiotap_ack_hdr *hdr;
     u16 flags;
     struct ieee80211_hdr *hdr11;
 
-    if (!netif_running(hwsim_mon))
+    if (!global && !local)
         return;
 
     skb = dev_alloc_skb(100);
@@ -915,7 +1449,7 @@ static void wifi_hwsim_monitor_ack(struct ieee80211_channel *chan,
     hdr->rt_flags = 0;
     hdr->pad = 0;
     hdr->rt_channel = cpu_to_le16(chan->center_freq);
-    flags = IEEE80211_CHAN_2GHZ;
+    flags = hwsim_radiotap_band_flags(chan);
     hdr->rt_chbitmask = cpu_to_le16(flags);
 
     hdr11 = skb_put(skb, 10);
@@ -924,53 +1458,129 @@ static void wifi_hwsim_monitor_ack(struct ieee80211_channel *chan,
     hdr11->duration_id = cpu_to_le16(0);
     memcpy(hdr11->addr1, addr, ETH_ALEN);
 
-    skb->dev = hwsim_mon;
-    skb_reset_mac_header(skb);
-    skb->ip_summed = CHECKSUM_UNNECESSARY;
-    skb->pkt_type = PACKET_OTHERHOST;
-    skb->protocol = htons(ETH_P_802_2);
-    memset(skb->cb, 0, sizeof(skb->cb));
-    netif_rx(skb);
+    if (global && local) {
+        skb2 = skb_clone(skb, GFP_ATOMIC);
+        if (skb2)
+            hwsim_monitor_deliver(skb2, data->mon);
+    } else if (local) {
+        hwsim_monitor_deliver(skb, data->mon);
+        return;
+    }
+
+    hwsim_monitor_deliver(skb, hwsim_mon);
 }
 
-struct wifi_hwsim_addr_match_data {
-    u8 addr[ETH_ALEN];
-    bool ret;
-};
+/*
+ * Publish a copy of the radio's address set with one instance of @addr added
+ * or removed. The same address may be present more than once, e.g. the sw
+ * scan address is usually the address of the scanning interface. Called with
+ * data->mutex held.
+ */
+static void hwsim_vif_addrs_update(struct wifi_hwsim_data *data,
+                                   const u8 *addr, bool add)
+{
+    struct hwsim_vif_addrs *old, *new;
+    unsigned int i, n = 0;
+    bool removed = false;
 
-static void wifi_hwsim_addr_iter(void *data, u8 *mac,
-                                     struct ieee80211_vif *vif)
+    old = rcu_dereference_protected(data->vif_addrs,
+                                    lockdep_is_held(&data->mutex));
+
+    new = kmalloc(struct_size(new, addrs, (old ? old->n : 0) + 1),
+                  GFP_KERNEL);
+    if (WARN_ON_ONCE(!new))
+        return;
+
+    for (i = 0; old && i < old->n; i++) {
+        if (!add && !removed &&
+            ether_addr_equal(old->addrs[i].addr, addr)) {
+            removed = true;
+            continue;
+        }
+        new->addrs[n++] = old->addrs[i];
+    }
+
+    if (add)
+        memcpy(new->addrs[n++].addr, addr, ETH_ALEN);
+
+    new->n = n;
+    rcu_assign_pointer(data->vif_addrs, new);
+    if (old)
+        kfree_rcu(old, rcu);
+}
+
+/*
+ * Publish the radio's current channels, idle/started, PS mode and group for
+ * the datapath. Called with data->mutex held after any of them changed.
+ *
+ * The snapshot published is the spare one, and a new spare is set aside
+ * right away; if that allocation fails, the replaced snapshot becomes the
+ * spare once no reader can see it anymore. Only the first call, at radio
+ * creation, can thus fail.
+ */
+static int hwsim_rf_state_update(struct wifi_hwsim_data *data)
 {
-    struct wifi_hwsim_addr_match_data *md = data;
+    struct hwsim_rf_state *old, *new;
 
-    if (memcmp(mac, md->addr, ETH_ALEN) == 0)
-        md->ret = true;
+    old = rcu_dereference_protected(data->rf, lockdep_is_held(&data->mutex));
+
+    new = data->rf_spare;
+    if (!new) {
+        new = kmalloc(sizeof(*new), GFP_KERNEL);
+        if (!new)
+            return -ENOMEM;
+    }
+    data->rf_spare = NULL;
+
+    new->channel = data->channel;
+    new->tmp_chan = data->tmp_chan;
+    new->chanctx_chan = data->chanctx ? data->chanctx->def.chan : NULL;
+    bitmap_copy(new->active_chans, data->active_chans, HWSIM_NUM_CHANNELS);
+    new->idle = data->idle;
+    new->started = data->started;
+    new->ps = data->ps;
+    new->group = data->group;
+
+    rcu_assign_pointer(data->rf, new);
+
+    data->rf_spare = kmalloc(sizeof(*new), GFP_KERNEL | __GFP_NOWARN);
+    if (!data->rf_spare) {
+        if (!old)
+            return -ENOMEM;
+        synchronize_rcu();
+        data->rf_spare = old;
+    } else if (old) {
+        kfree_rcu(old, rcu);
+    }
+
+    return 0;
 }
 
 static bool wifi_hwsim_addr_match(struct wifi_hwsim_data *data,
                                       const u8 *addr)
 {
-    struct wifi_hwsim_addr_match_data md = {
-            .ret = false,
-    };
+    struct hwsim_vif_addrs *addrs;
+    bool ret = false;
+    unsigned int i;
 
-    if (data->scanning && memcmp(addr, data->scan_addr, ETH_ALEN) == 0)
-        return true;
-
-    memcpy(md.addr, addr, ETH_ALEN);
-
-    ieee80211_iterate_active_interfaces_atomic(data->hw,
-                                               IEEE80211_IFACE_ITER_NORMAL,
-                                               wifi_hwsim_addr_iter,
-                                               &md);
+    rcu_read_lock();
+    addrs = rcu_dereference(data->vif_addrs);
+    for (i = 0; addrs && i < addrs->n; i++) {
+        if (ether_addr_equal_unaligned(addrs->addrs[i].addr, addr)) {
+            ret = true;
+            break;
+        }
+    }
+    rcu_read_unlock();
 
-    return md.ret;
+    return ret;
 }
 
 static bool hwsim_ps_rx_ok(struct wifi_hwsim_data *data,
+                           const struct hwsim_rf_state *rf,
                            struct sk_buff *skb)
 {
-    switch (data->ps) {
+    switch (rf->ps) {
         case PS_DISABLED:
             return true;
         case PS_ENABLED:
@@ -1087,54 +1697,124 @@ static inline u16 trans_tx_rate_flags_ieee2hwsim(struct ieee80211_tx_rate *rate)
     return result;
 }
 
-static void wifi_hwsim_tx_frame_nl(struct ieee80211_hw *hw,
-                                       struct sk_buff *my_skb,
-                                       int dst_portid,
-                                       struct ieee80211_channel *channel)
+/*
+ * In backpressure mode, stop the queues once tx_queue_high frames are
+ * pending and wake them once no more than tx_queue_low are left.
+ */
+static void hwsim_tx_queue_update(struct wifi_hwsim_data *data)
+{
+    u32 len = skb_queue_len(&data->pending);
+
+    lockdep_assert_held(&data->pending.lock);
+
+    if (!data->tx_stopped) {
+        if (!data->tx_backpressure || len < READ_ONCE(data->tx_queue_high))
+            return;
+
+        data->tx_stopped = true;
+        ieee80211_stop_queues(data->hw);
+        hwsim_stats_inc(data, HWSIM_STAT_TX_QUEUE_STOPS);
+    } else if (len <= READ_ONCE(data->tx_queue_low)) {
+        data->tx_stopped = false;
+        ieee80211_wake_queues(data->hw);
+        hwsim_stats_inc(data, HWSIM_STAT_TX_QUEUE_WAKES);
+    }
+}
+
+/*
+ * Frames handed to the medium wait on data->pending until their TX status
+ * comes back. The queue keeps them in age order for eviction while
+ * pending_cookies finds them by cookie, so that neither completion nor
+ * eviction has to walk the queue. Both are only changed under pending.lock.
+ */
+static int hwsim_pending_add(struct wifi_hwsim_data *data,
+                             struct sk_buff *skb, uintptr_t cookie)
+{
+    unsigned long flags;
+    int err;
+
+    /*
+     * Once the cookie counter wrapped, a frame still pending under the
+     * same cookie wins: the new one fails with -EBUSY instead of leaking it.
+     */
+    spin_lock_irqsave(&data->pending.lock, flags);
+    err = xa_insert(&data->pending_cookies, cookie, skb, GFP_ATOMIC);
+    if (!err) {
+        __skb_queue_tail(&data->pending, skb);
+        hwsim_tx_queue_update(data);
+    }
+    spin_unlock_irqrestore(&data->pending.lock, flags);
+
+    return err;
+}
+
+static struct sk_buff *__hwsim_pending_take(struct wifi_hwsim_data *data,
+                                            uintptr_t cookie)
 {
     struct sk_buff *skb;
-    struct wifi_hwsim_data *data = hw->priv;
-    struct ieee80211_hdr *hdr = (struct ieee80211_hdr *) my_skb->data;
-    struct ieee80211_tx_info *info = IEEE80211_SKB_CB(my_skb);
-    void *msg_head;
-    unsigned int hwsim_flags = 0;
-    int i;
-    struct hwsim_tx_rate tx_attempts[IEEE80211_TX_MAX_RATES];
-    struct hwsim_tx_rate_flag tx_attempts_flags[IEEE80211_TX_MAX_RATES];
-    uintptr_t cookie;
 
-    if (data->ps != PS_DISABLED)
-        hdr->frame_control |= cpu_to_le16(IEEE80211_FCTL_PM);
-    /* If the queue contains MAX_QUEUE skb's drop some */
-    if (skb_queue_len(&data->pending) >= MAX_QUEUE) {
-        /* Droping until WARN_QUEUE level */
-        while (skb_queue_len(&data->pending) >= WARN_QUEUE) {
-            ieee80211_free_txskb(hw, skb_dequeue(&data->pending));
-            data->tx_dropped++;
-        }
+    lockdep_assert_held(&data->pending.lock);
+
+    skb = xa_erase(&data->pending_cookies, cookie);
+    if (skb) {
+        __skb_unlink(skb, &data->pending);
+        hwsim_tx_queue_update(data);
     }
 
-    skb = genlmsg_new(GENLMSG_DEFAULT_SIZE, GFP_ATOMIC);
-    if (skb == NULL)
-        goto nla_put_failure;
+    return skb;
+}
 
-    msg_head = genlmsg_put(skb, 0, 0, &hwsim_genl_family, 0,
-                           HWSIM_CMD_FRAME);
-    if (msg_head == NULL) {
-        pr_debug("aprf_drv: problem with msg_head\n");
-        goto nla_put_failure;
+static struct sk_buff *hwsim_pending_take(struct wifi_hwsim_data *data,
+                                          uintptr_t cookie)
+{
+    struct sk_buff *skb;
+    unsigned long flags;
+
+    spin_lock_irqsave(&data->pending.lock, flags);
+    skb = __hwsim_pending_take(data, cookie);
+    spin_unlock_irqrestore(&data->pending.lock, flags);
+
+    return skb;
+}
+
+/* remove and return the oldest pending frame */
+static struct sk_buff *hwsim_pending_dequeue(struct wifi_hwsim_data *data)
+{
+    struct ieee80211_tx_info *info;
+    struct sk_buff *skb;
+    unsigned long flags;
+
+    spin_lock_irqsave(&data->pending.lock, flags);
+    skb = __skb_dequeue(&data->pending);
+    if (skb) {
+        info = IEEE80211_SKB_CB(skb);
+        xa_erase(&data->pending_cookies,
+                 (uintptr_t)info->rate_driver_data[0]);
     }
+    spin_unlock_irqrestore(&data->pending.lock, flags);
 
-    if (nla_put(skb, HWSIM_ATTR_ADDR_TRANSMITTER,
-                ETH_ALEN, data->addresses[1].addr))
-        goto nla_put_failure;
+    return skb;
+}
 
-    /* We get the skb->data */
-    if (nla_put(skb, HWSIM_ATTR_FRAME, my_skb->len, my_skb->data))
-        goto nla_put_failure;
+/* drop all pending frames, e.g. when no TX status can come back any more */
+static void hwsim_pending_purge(struct wifi_hwsim_data *data)
+{
+    struct sk_buff *skb;
+    unsigned long flags;
+
+    while ((skb = hwsim_pending_dequeue(data)))
+        ieee80211_free_txskb(data->hw, skb);
 
-    /* We get the flags for this transmission, and we translate them to
-	   wmediumd flags  */
+    spin_lock_irqsave(&data->pending.lock, flags);
+    hwsim_tx_queue_update(data);
+    spin_unlock_irqrestore(&data->pending.lock, flags);
+}
+
+/* We get the flags for this transmission, and we translate them to
+   wmediumd flags  */
+static unsigned int hwsim_tx_flags(struct ieee80211_tx_info *info)
+{
+    unsigned int hwsim_flags = 0;
 
     if (info->flags & IEEE80211_TX_CTL_REQ_TX_STATUS)
         hwsim_flags |= HWSIM_TX_CTL_REQ_TX_STATUS;
@@ -1142,13 +1822,19 @@ static void wifi_hwsim_tx_frame_nl(struct ieee80211_hw *hw,
     if (info->flags & IEEE80211_TX_CTL_NO_ACK)
         hwsim_flags |= HWSIM_TX_CTL_NO_ACK;
 
-    if (nla_put_u32(skb, HWSIM_ATTR_FLAGS, hwsim_flags))
-        goto nla_put_failure;
-
-    if (nla_put_u32(skb, HWSIM_ATTR_FREQ, channel->center_freq))
-        goto nla_put_failure;
+    return hwsim_flags;
+}
 
-    /* We get the tx control (rate and retries) info*/
+/*
+ * We get the tx control (rate and retries) info. This reads the rates from
+ * the tx info, so it has to be done before the cookie is stored in
+ * rate_driver_data, which overlaps them.
+ */
+static void hwsim_tx_attempts(struct ieee80211_tx_info *info,
+                              struct hwsim_tx_rate *tx_attempts,
+                              struct hwsim_tx_rate_flag *tx_attempts_flags)
+{
+    int i;
 
     for (i = 0; i < IEEE80211_TX_MAX_RATES; i++) {
         tx_attempts[i].idx = info->status.rates[i].idx;
@@ -1158,113 +1844,584 @@ static void wifi_hwsim_tx_frame_nl(struct ieee80211_hw *hw,
                 trans_tx_rate_flags_ieee2hwsim(
                         &info->status.rates[i]);
     }
+}
+
+struct hwsim_chandef_iter_data {
+    struct ieee80211_channel *chan;
+    struct cfg80211_chan_def *def;
+};
+
+static void hwsim_chandef_iter(struct ieee80211_hw *hw,
+                               struct ieee80211_chanctx_conf *ctx,
+                               void *_data)
+{
+    struct hwsim_chandef_iter_data *data = _data;
+
+    if (ctx->def.chan == data->chan)
+        *data->def = ctx->def;
+}
+
+/* the channel definition of @data whose control channel is @chan */
+static void hwsim_tx_chandef(struct wifi_hwsim_data *data,
+                             struct ieee80211_channel *chan,
+                             struct cfg80211_chan_def *def)
+{
+    struct hwsim_chandef_iter_data iter_data = {
+        .chan = chan,
+        .def = def,
+    };
+    bool tmp;
+
+    /* scanning, off-channel and unknown channels are 20 MHz wide */
+    cfg80211_chandef_create(def, chan, NL80211_CHAN_NO_HT);
+
+    if (!data->use_chanctx) {
+        if (data->hw->conf.chandef.chan == chan)
+            *def = data->hw->conf.chandef;
+        return;
+    }
+
+    rcu_read_lock();
+    tmp = chan == rcu_dereference(data->rf)->tmp_chan;
+    rcu_read_unlock();
+
+    if (!tmp)
+        ieee80211_iter_chan_contexts_atomic(data->hw, hwsim_chandef_iter,
+                                            &iter_data);
+}
+
+/* HWSIM_ATTR_TX_DESC variant of hwsim_put_tx_frame(), filled in place */
+static int hwsim_put_tx_desc(struct sk_buff *skb,
+                             struct wifi_hwsim_data *data,
+                             struct sk_buff *my_skb,
+                             struct ieee80211_channel *channel,
+                             uintptr_t cookie, u32 medium_flags)
+{
+    struct ieee80211_tx_info *info = IEEE80211_SKB_CB(my_skb);
+    struct hwsim_tx_desc *desc;
+    struct nlattr *nla;
+
+    nla = nla_reserve_64bit(skb, HWSIM_ATTR_TX_DESC, sizeof(*desc),
+                            HWSIM_ATTR_PAD);
+    if (!nla)
+        return -EMSGSIZE;
+
+    desc = nla_data(nla);
+    memset(desc, 0, sizeof(*desc));
+    ether_addr_copy(desc->transmitter, data->addresses[1].addr);
+    desc->cookie = cookie;
+    desc->flags = hwsim_tx_flags(info);
+    desc->freq = channel->center_freq;
+    if (medium_flags & HWSIM_REGISTER_F_MULTI_CHANNEL) {
+        struct cfg80211_chan_def def;
+
+        hwsim_tx_chandef(data, channel, &def);
+        desc->flags |= HWSIM_TX_DESC_CHANDEF;
+        desc->width = def.width;
+        desc->center_freq1 = def.center_freq1;
+        desc->center_freq2 = def.center_freq2;
+    }
+    hwsim_tx_attempts(info, desc->tx_attempts, desc->tx_attempts_flags);
+
+    if (nla_put(skb, HWSIM_ATTR_FRAME, my_skb->len, my_skb->data))
+        return -EMSGSIZE;
+
+    return 0;
+}
+
+/*
+ * Put the attributes describing @my_skb, as carried by HWSIM_CMD_FRAME, into
+ * @skb. Like hwsim_tx_attempts() it must run before the cookie is stored.
+ */
+static int hwsim_put_tx_frame(struct sk_buff *skb,
+                              struct wifi_hwsim_data *data,
+                              struct sk_buff *my_skb,
+                              struct ieee80211_channel *channel,
+                              uintptr_t cookie)
+{
+    struct ieee80211_tx_info *info = IEEE80211_SKB_CB(my_skb);
+    struct hwsim_tx_rate tx_attempts[IEEE80211_TX_MAX_RATES];
+    struct hwsim_tx_rate_flag tx_attempts_flags[IEEE80211_TX_MAX_RATES];
+    u32 medium_flags = READ_ONCE(data->wmediumd_flags);
+
+    if (medium_flags & HWSIM_REGISTER_F_TX_DESC)
+        return hwsim_put_tx_desc(skb, data, my_skb, channel, cookie,
+                                 medium_flags);
+
+    if (nla_put(skb, HWSIM_ATTR_ADDR_TRANSMITTER,
+                ETH_ALEN, data->addresses[1].addr))
+        return -EMSGSIZE;
+
+    /* We get the skb->data */
+    if (nla_put(skb, HWSIM_ATTR_FRAME, my_skb->len, my_skb->data))
+        return -EMSGSIZE;
+
+    if (nla_put_u32(skb, HWSIM_ATTR_FLAGS, hwsim_tx_flags(info)))
+        return -EMSGSIZE;
+
+    if (nla_put_u32(skb, HWSIM_ATTR_FREQ, channel->center_freq))
+        return -EMSGSIZE;
+
+    if (medium_flags & HWSIM_REGISTER_F_MULTI_CHANNEL) {
+        struct cfg80211_chan_def def;
+
+        hwsim_tx_chandef(data, channel, &def);
+        if (nla_put_u32(skb, HWSIM_ATTR_CHANNEL_WIDTH, def.width) ||
+            nla_put_u32(skb, HWSIM_ATTR_CENTER_FREQ1, def.center_freq1) ||
+            nla_put_u32(skb, HWSIM_ATTR_CENTER_FREQ2, def.center_freq2))
+            return -EMSGSIZE;
+    }
+
+    hwsim_tx_attempts(info, tx_attempts, tx_attempts_flags);
 
     if (nla_put(skb, HWSIM_ATTR_TX_INFO,
                 sizeof(struct hwsim_tx_rate)*IEEE80211_TX_MAX_RATES,
                 tx_attempts))
-        goto nla_put_failure;
+        return -EMSGSIZE;
 
     if (nla_put(skb, HWSIM_ATTR_TX_INFO_FLAGS,
                 sizeof(struct hwsim_tx_rate_flag) * IEEE80211_TX_MAX_RATES,
                 tx_attempts_flags))
-        goto nla_put_failure;
+        return -EMSGSIZE;
 
-    /* We create a cookie to identify this skb */
-    cookie = atomic_inc_return(&data->pending_cookie);
-    info->rate_driver_data[0] = (void *)cookie;
     if (nla_put_u64_64bit(skb, HWSIM_ATTR_COOKIE, cookie, HWSIM_ATTR_PAD))
-        goto nla_put_failure;
-
-    genlmsg_end(skb, msg_head);
-
-    if (hwsim_virtio_enabled) {
-        if (hwsim_tx_virtio(data, skb))
-            goto err_free_txskb;
-    } else {
-        if (hwsim_unicast_netgroup(data, skb, dst_portid))
-            goto err_free_txskb;
-    }
-
-    /* Enqueue the packet */
-    skb_queue_tail(&data->pending, my_skb);
-    data->tx_pkts++;
-    data->tx_bytes += my_skb->len;
-    return;
+        return -EMSGSIZE;
 
-    nla_put_failure:
-    nlmsg_free(skb);
-    err_free_txskb:
-    pr_debug("aprf_drv error occurred in %s\n", __func__);
-    ieee80211_free_txskb(hw, my_skb);
-    data->tx_failed++;
+    return 0;
 }
 
-static bool hwsim_chans_compat(struct ieee80211_channel *c1,
-                               struct ieee80211_channel *c2)
+/*
+ * Payload of a HWSIM_CMD_FRAME_BATCH message. The skb fits an order-0 page,
+ * as atomic higher order allocations in the TX path fail under fragmentation.
+ * That takes a full sized frame or a good number of short ones.
+ */
+#define HWSIM_TX_BATCH_SIZE GENLMSG_DEFAULT_SIZE
+
+/* detach the batch being filled, ready to be sent; tx_batch_lock held */
+static struct sk_buff *hwsim_tx_batch_take(struct wifi_hwsim_data *data)
 {
-    if (!c1 || !c2)
-        return false;
+    struct sk_buff *skb = data->tx_batch;
 
-    return c1->center_freq == c2->center_freq;
-}
+    if (skb) {
+        nla_nest_end(skb, data->tx_batch_nest);
+        genlmsg_end(skb, data->tx_batch_hdr);
+    }
+    data->tx_batch = NULL;
+    data->tx_batch_count = 0;
 
-struct tx_iter_data {
-    struct ieee80211_channel *channel;
-    bool receive;
-};
+    return skb;
+}
 
-static void wifi_hwsim_tx_iter(void *_data, u8 *addr,
-                                   struct ieee80211_vif *vif)
+static void hwsim_tx_batch_send(struct wifi_hwsim_data *data,
+                                struct sk_buff *skb)
 {
-    struct tx_iter_data *data = _data;
-#if LINUX_VERSION_PATCHLEVEL == 15
-    if (!vif->chanctx_conf)
-        return;
-#elif LINUX_VERSION_PATCHLEVEL == 19
-    if (!vif->bss_conf.chanctx_conf)
+    u32 _portid = READ_ONCE(data->wmediumd);
+
+    if (!skb)
         return;
-#endif
-    if (!hwsim_chans_compat(data->channel,
-#if LINUX_VERSION_PATCHLEVEL == 15
-                            rcu_dereference(vif->chanctx_conf)->def.chan)
-#elif LINUX_VERSION_PATCHLEVEL == 19
-                            rcu_dereference(vif->bss_conf.chanctx_conf)->def.chan)
-#endif
-                            )
+
+    /*
+     * Frames of a batch that cannot be sent stay pending and are evicted
+     * like those the wmediumd never answers.
+     */
+    if (!_portid) {
+        nlmsg_free(skb);
         return;
+    }
 
-    data->receive = true;
+    if (hwsim_unicast_netgroup(data, skb, _portid))
+        pr_debug("aprf_drv: failed to send a frame batch\n");
+    else
+        hwsim_stats_inc(data, HWSIM_STAT_TX_BATCHES);
 }
 
-static void wifi_hwsim_add_vendor_rtap(struct sk_buff *skb)
+static enum hrtimer_restart hwsim_tx_batch_timer(struct hrtimer *timer)
 {
-    /*
-	 * To enable this code, #define the HWSIM_RADIOTAP_OUI,
-	 * e.g. like this:
-	 * #define HWSIM_RADIOTAP_OUI "\x02\x00\x00"
-	 * (but you should use a valid OUI, not that)
-	 *
-	 * If anyone wants to 'donate' a radiotap OUI/subns code
-	 * please send a patch removing this #ifdef and changing
-	 * the values accordingly.
-	 */
-#ifdef HWSIM_RADIOTAP_OUI
-    struct ieee80211_vendor_radiotap *rtap;
+    struct wifi_hwsim_data *data =
+            container_of(timer, struct wifi_hwsim_data, tx_batch_timer);
+    struct sk_buff *skb;
 
-	/*
-	 * Note that this code requires the headroom in the SKB
-	 * that was allocated earlier.
-	 */
-	rtap = skb_push(skb, sizeof(*rtap) + 8 + 4);
-	rtap->oui[0] = HWSIM_RADIOTAP_OUI[0];
-	rtap->oui[1] = HWSIM_RADIOTAP_OUI[1];
-	rtap->oui[2] = HWSIM_RADIOTAP_OUI[2];
-	rtap->subns = 127;
+    spin_lock_bh(&data->tx_batch_lock);
+    skb = hwsim_tx_batch_take(data);
+    spin_unlock_bh(&data->tx_batch_lock);
 
-	/*
-	 * Radiotap vendor namespaces can (and should) also be
-	 * split into fields by using the standard radiotap
-	 * presence bitmap mechanism. Use just BIT(0) here for
+    hwsim_tx_batch_send(data, skb);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Append @my_skb to the batch of the radio and make it pending. The batch is
+ * sent once it holds tx_batch_frames frames, once it is full, at the end of
+ * the burst the stack is transmitting, or at the latest tx_batch_delay_us
+ * after its first frame.
+ */
+static int hwsim_tx_batch_add(struct wifi_hwsim_data *data,
+                              struct sk_buff *my_skb,
+                              struct ieee80211_channel *channel,
+                              uintptr_t cookie)
+{
+    struct ieee80211_tx_info *info = IEEE80211_SKB_CB(my_skb);
+    struct sk_buff *full = NULL, *skb = NULL;
+    struct nlattr *nest;
+    int err = -ENOMEM;
+
+    spin_lock_bh(&data->tx_batch_lock);
+    for (;;) {
+        if (!data->tx_batch) {
+            data->tx_batch = genlmsg_new(HWSIM_TX_BATCH_SIZE, GFP_ATOMIC);
+            if (!data->tx_batch)
+                goto out;
+
+            data->tx_batch_hdr = genlmsg_put(data->tx_batch, 0, 0,
+                                             &hwsim_genl_family, 0,
+                                             HWSIM_CMD_FRAME_BATCH);
+            data->tx_batch_nest = data->tx_batch_hdr ?
+                    nla_nest_start_noflag(data->tx_batch,
+                                          HWSIM_ATTR_FRAMES) : NULL;
+            if (!data->tx_batch_nest) {
+                nlmsg_free(data->tx_batch);
+                data->tx_batch = NULL;
+                goto out;
+            }
+        }
+
+        nest = nla_nest_start_noflag(data->tx_batch,
+                                     data->tx_batch_count + 1);
+        if (nest && !hwsim_put_tx_frame(data->tx_batch, data, my_skb,
+                                        channel, cookie))
+            break;
+        if (nest)
+            nla_nest_cancel(data->tx_batch, nest);
+
+        /* no room left: send what is there and retry on an empty batch */
+        err = -EMSGSIZE;
+        if (!data->tx_batch_count)
+            goto out;
+        full = hwsim_tx_batch_take(data);
+        hrtimer_try_to_cancel(&data->tx_batch_timer);
+    }
+
+    info->rate_driver_data[0] = (void *)cookie;
+    err = hwsim_pending_add(data, my_skb, cookie);
+    if (err) {
+        nla_nest_cancel(data->tx_batch, nest);
+        goto out;
+    }
+    nla_nest_end(data->tx_batch, nest);
+
+    /*
+     * A held batch only goes out when full or when the TXQ burst ends. The
+     * xmit_more hint of the stack marks the end of other bursts; it may be
+     * stale outside the xmit path, which the timer makes up for.
+     */
+    if ((++data->tx_batch_count >= READ_ONCE(tx_batch_frames) ||
+         !netdev_xmit_more()) && !data->tx_batch_held) {
+        skb = hwsim_tx_batch_take(data);
+        hrtimer_try_to_cancel(&data->tx_batch_timer);
+    } else if (data->tx_batch_count == 1 && !data->tx_batch_held) {
+        hrtimer_start(&data->tx_batch_timer,
+                      ns_to_ktime(READ_ONCE(tx_batch_delay_us) *
+                                  NSEC_PER_USEC),
+                      HRTIMER_MODE_REL_SOFT);
+    }
+
+    out:
+    spin_unlock_bh(&data->tx_batch_lock);
+
+    hwsim_tx_batch_send(data, full);
+    hwsim_tx_batch_send(data, skb);
+
+    return err;
+}
+
+/*
+ * Keep the batch of the radio open while a TXQ burst is fed to it, so that
+ * the whole burst reaches the wmediumd in as few messages as fit.
+ */
+static void hwsim_tx_batch_hold(struct wifi_hwsim_data *data)
+{
+    spin_lock_bh(&data->tx_batch_lock);
+    data->tx_batch_held = true;
+    spin_unlock_bh(&data->tx_batch_lock);
+}
+
+/* end a TXQ burst and send what it left in the batch */
+static void hwsim_tx_batch_release(struct wifi_hwsim_data *data)
+{
+    struct sk_buff *skb;
+
+    spin_lock_bh(&data->tx_batch_lock);
+    data->tx_batch_held = false;
+    skb = hwsim_tx_batch_take(data);
+    hrtimer_try_to_cancel(&data->tx_batch_timer);
+    spin_unlock_bh(&data->tx_batch_lock);
+
+    hwsim_tx_batch_send(data, skb);
+}
+
+/* wake up the medium waiting for frames on the TX ring; tx_lock held */
+static void hwsim_ring_notify(struct hwsim_ring *ring)
+{
+    wake_up_interruptible(&ring->wait);
+    if (ring->eventfd)
+        eventfd_signal(ring->eventfd, 1);
+}
+
+/*
+ * Copy @my_skb into the next TX ring slot and make it pending. Fails if the
+ * medium has not consumed the ring far enough to leave a free slot.
+ */
+static int hwsim_ring_tx(struct hwsim_ring *ring, struct wifi_hwsim_data *data,
+                         struct sk_buff *my_skb,
+                         struct ieee80211_channel *channel,
+                         uintptr_t cookie)
+{
+    struct ieee80211_tx_info *info = IEEE80211_SKB_CB(my_skb);
+    struct hwsim_ring_desc *desc;
+    u32 idx, cons;
+    int err = -ENOBUFS;
+
+    if (my_skb->len > ring->frame_size)
+        return -EMSGSIZE;
+
+    spin_lock_bh(&ring->tx_lock);
+    cons = smp_load_acquire(&ring->tx_hdr->consumer);
+    if (ring->tx_prod - cons >= ring->entries)
+        goto out;
+
+    idx = ring->tx_prod & (ring->entries - 1);
+    desc = &ring->tx_desc[idx];
+    memset(desc, 0, sizeof(*desc));
+    desc->type = HWSIM_RING_FRAME;
+    desc->len = my_skb->len;
+    ether_addr_copy(desc->addr, data->addresses[1].addr);
+    desc->cookie = cookie;
+    desc->flags = hwsim_tx_flags(info);
+    desc->freq = channel->center_freq;
+    hwsim_tx_attempts(info, desc->tx_attempts, desc->tx_attempts_flags);
+    skb_copy_bits(my_skb, 0, ring->tx_frames + idx * ring->frame_size,
+                  my_skb->len);
+
+    info->rate_driver_data[0] = (void *)cookie;
+    err = hwsim_pending_add(data, my_skb, cookie);
+    if (err)
+        goto out;
+
+    smp_store_release(&ring->tx_hdr->producer, ++ring->tx_prod);
+    hwsim_ring_notify(ring);
+
+    out:
+    spin_unlock_bh(&ring->tx_lock);
+
+    return err;
+}
+
+static void wifi_hwsim_tx_frame_nl(struct ieee80211_hw *hw,
+                                       struct sk_buff *my_skb,
+                                       int dst_portid,
+                                       struct ieee80211_channel *channel)
+{
+    struct sk_buff *skb;
+    struct wifi_hwsim_data *data = hw->priv;
+    struct ieee80211_hdr *hdr = (struct ieee80211_hdr *) my_skb->data;
+    struct ieee80211_tx_info *info = IEEE80211_SKB_CB(my_skb);
+    struct hwsim_ring *ring;
+    void *msg_head;
+    uintptr_t cookie;
+    u64 high, low;
+    int err;
+
+    if (data->ps != PS_DISABLED)
+        hdr->frame_control |= cpu_to_le16(IEEE80211_FCTL_PM);
+    /*
+     * If the queue contains tx_queue_high skb's drop some. Backpressure stops
+     * the queues there instead, but frames mac80211 sends on its own, beacons
+     * and the like, keep coming: past twice the watermark the oldest go all
+     * the same, down to the watermark so that the queues stay stopped.
+     */
+    high = READ_ONCE(data->tx_queue_high);
+    low = READ_ONCE(data->tx_queue_low);
+    if (data->tx_backpressure) {
+        low = high;
+        high *= 2;
+    }
+    if (skb_queue_len(&data->pending) >= high) {
+        /* Droping until tx_queue_low level */
+        while (skb_queue_len(&data->pending) > low) {
+            skb = hwsim_pending_dequeue(data);
+            if (!skb)
+                break;
+            ieee80211_free_txskb(hw, skb);
+            hwsim_stats_inc(data, HWSIM_STAT_TX_DROPPED);
+        }
+    }
+
+    /* We create a cookie to identify this skb */
+    cookie = atomic_inc_return(&data->pending_cookie);
+
+    rcu_read_lock();
+    ring = rcu_dereference(data->medium_ring);
+    if (ring) {
+        err = hwsim_ring_tx(ring, data, my_skb, channel, cookie);
+        rcu_read_unlock();
+        if (err)
+            goto err_free_txskb;
+        goto out_queued;
+    }
+    rcu_read_unlock();
+
+    /* the medium went away since the caller looked */
+    if (!dst_portid && !hwsim_virtio_enabled)
+        goto err_free_txskb;
+
+    if (!hwsim_virtio_enabled &&
+        READ_ONCE(data->wmediumd_flags) & HWSIM_REGISTER_F_FRAME_BATCH) {
+        if (hwsim_tx_batch_add(data, my_skb, channel, cookie))
+            goto err_free_txskb;
+        goto out_queued;
+    }
+
+    skb = genlmsg_new(GENLMSG_DEFAULT_SIZE, GFP_ATOMIC);
+    if (skb == NULL)
+        goto nla_put_failure;
+
+    msg_head = genlmsg_put(skb, 0, 0, &hwsim_genl_family, 0,
+                           HWSIM_CMD_FRAME);
+    if (msg_head == NULL) {
+        pr_debug("aprf_drv: problem with msg_head\n");
+        goto nla_put_failure;
+    }
+
+    if (hwsim_put_tx_frame(skb, data, my_skb, channel, cookie))
+        goto nla_put_failure;
+    info->rate_driver_data[0] = (void *)cookie;
+
+    genlmsg_end(skb, msg_head);
+
+    if (hwsim_virtio_enabled) {
+        if (hwsim_tx_virtio(data, skb))
+            goto err_free_txskb;
+    } else {
+        if (hwsim_unicast_netgroup(data, skb, dst_portid))
+            goto err_free_txskb;
+    }
+
+    /* Enqueue the packet */
+    if (hwsim_pending_add(data, my_skb, cookie))
+        goto err_free_txskb;
+    out_queued:
+    hwsim_stats_inc(data, HWSIM_STAT_TX_PKTS);
+    hwsim_stats_add(data, HWSIM_STAT_TX_BYTES, my_skb->len);
+    return;
+
+    nla_put_failure:
+    nlmsg_free(skb);
+    err_free_txskb:
+    pr_debug("aprf_drv error occurred in %s\n", __func__);
+    ieee80211_free_txskb(hw, my_skb);
+    hwsim_stats_inc(data, HWSIM_STAT_TX_FAILED);
+}
+
+static bool hwsim_chans_compat(struct ieee80211_channel *c1,
+                               struct ieee80211_channel *c2)
+{
+    if (!c1 || !c2)
+        return false;
+
+    return c1->center_freq == c2->center_freq;
+}
+
+/*
+ * Position of one of the radio's own channels in its active_chans bitmap.
+ * All radios copy the same channel tables, so the index of a transmitter's
+ * channel is valid for testing the bitmap of any receiver.
+ */
+static int hwsim_chan_idx(struct wifi_hwsim_data *data,
+                          struct ieee80211_channel *chan)
+{
+    int base = 0;
+
+    if (!chan)
+        return -1;
+
+    if (chan >= data->channels_2ghz &&
+        chan < data->channels_2ghz + ARRAY_SIZE(data->channels_2ghz))
+        return base + (chan - data->channels_2ghz);
+    base += ARRAY_SIZE(data->channels_2ghz);
+
+    if (chan >= data->channels_5ghz &&
+        chan < data->channels_5ghz + ARRAY_SIZE(data->channels_5ghz))
+        return base + (chan - data->channels_5ghz);
+    base += ARRAY_SIZE(data->channels_5ghz);
+
+    if (chan >= data->channels_6ghz &&
+        chan < data->channels_6ghz + ARRAY_SIZE(data->channels_6ghz))
+        return base + (chan - data->channels_6ghz);
+    base += ARRAY_SIZE(data->channels_6ghz);
+
+    if (chan >= data->channels_s1g &&
+        chan < data->channels_s1g + ARRAY_SIZE(data->channels_s1g))
+        return base + (chan - data->channels_s1g);
+
+    return -1;
+}
+
+/* called with data->mutex held */
+static void hwsim_active_chan_get(struct wifi_hwsim_data *data,
+                                  struct ieee80211_channel *chan)
+{
+    int idx = hwsim_chan_idx(data, chan);
+
+    if (WARN_ON(idx < 0))
+        return;
+
+    if (data->active_chan_refs[idx]++ == 0)
+        set_bit(idx, data->active_chans);
+}
+
+/* called with data->mutex held */
+static void hwsim_active_chan_put(struct wifi_hwsim_data *data,
+                                  struct ieee80211_channel *chan)
+{
+    int idx = hwsim_chan_idx(data, chan);
+
+    if (idx < 0 || WARN_ON(!data->active_chan_refs[idx]))
+        return;
+
+    if (--data->active_chan_refs[idx] == 0)
+        clear_bit(idx, data->active_chans);
+}
+
+static void wifi_hwsim_add_vendor_rtap(struct sk_buff *skb)
+{
+    /*
+	 * To enable this code, #define the HWSIM_RADIOTAP_OUI,
+	 * e.g. like this:
+	 * #define HWSIM_RADIOTAP_OUI "\x02\x00\x00"
+	 * (but you should use a valid OUI, not that)
+	 *
+	 * If anyone wants to 'donate' a radiotap OUI/subns code
+	 * please send a patch removing this #ifdef and changing
+	 * the values accordingly.
+	 */
+#ifdef HWSIM_RADIOTAP_OUI
+    struct ieee80211_vendor_radiotap *rtap;
+
+	/*
+	 * Note that this code requires the headroom in the SKB
+	 * that was allocated earlier.
+	 */
+	rtap = skb_push(skb, sizeof(*rtap) + 8 + 4);
+	rtap->oui[0] = HWSIM_RADIOTAP_OUI[0];
+	rtap->oui[1] = HWSIM_RADIOTAP_OUI[1];
+	rtap->oui[2] = HWSIM_RADIOTAP_OUI[2];
+	rtap->subns = 127;
+
+	/*
+	 * Radiotap vendor namespaces can (and should) also be
+	 * split into fields by using the standard radiotap
+	 * presence bitmap mechanism. Use just BIT(0) here for
 	 * the presence bitmap.
 	 */
 	rtap->present = BIT(0);
@@ -1283,11 +2440,61 @@ static void wifi_hwsim_add_vendor_rtap(struct sk_buff *skb)
 #endif
 }
 
+/* frames a receiver may have queued before its NAPI context runs */
+#define HWSIM_RX_QUEUE_LEN 1024
+
+/*
+ * Hand a received frame to the receiver's NAPI context. The caller must have
+ * BHs disabled, so that the NAPI softirq runs once it re-enables them, and a
+ * burst of frames is then passed to mac80211 in one ieee80211_rx_list() pass.
+ */
+static void hwsim_rx_deliver(struct wifi_hwsim_data *data,
+                             struct sk_buff *skb)
+{
+    if (skb_queue_len(&data->rx_queue) >= HWSIM_RX_QUEUE_LEN) {
+        hwsim_stats_inc(data, HWSIM_STAT_RX_QUEUE_DROPPED);
+        dev_kfree_skb_any(skb);
+        return;
+    }
+
+    skb_queue_tail(&data->rx_queue, skb);
+    napi_schedule(&data->napi);
+}
+
+static int hwsim_napi_poll(struct napi_struct *napi, int budget)
+{
+    struct wifi_hwsim_data *data =
+            container_of(napi, struct wifi_hwsim_data, napi);
+    struct sk_buff *skb;
+    LIST_HEAD(list);
+    int done = 0;
+
+    rcu_read_lock();
+    while (done < budget && (skb = skb_dequeue(&data->rx_queue))) {
+        ieee80211_rx_list(data->hw, NULL, skb, &list);
+        done++;
+    }
+    rcu_read_unlock();
+
+    netif_receive_skb_list(&list);
+
+    if (done < budget)
+        napi_complete_done(napi, done);
+
+    return done;
+}
+
 static bool wifi_hwsim_tx_frame_no_nl(struct ieee80211_hw *hw,
                                           struct sk_buff *skb,
                                           struct ieee80211_channel *chan)
 {
     struct wifi_hwsim_data *data = hw->priv, *data2;
+    const struct hwsim_rf_state *rf, *rf2;
+    struct hwsim_rx_index_entry *entry;
+    int chan_idx = hwsim_chan_idx(data, chan);
+    u64 group = 0;
+    void *shared = NULL;
+    unsigned int shared_users = 0;
     bool ack = false;
     struct ieee80211_hdr *hdr = (struct ieee80211_hdr *) skb->data;
     struct ieee80211_tx_info *info = IEEE80211_SKB_CB(skb);
@@ -1351,50 +2558,90 @@ static bool wifi_hwsim_tx_frame_no_nl(struct ieee80211_hw *hw,
     }
 
     /* Copy skb to all enabled radios that are on the current frequency */
-    spin_lock(&hwsim_radio_lock);
-    list_for_each_entry(data2, &hwsim_radios, list) {
+    rcu_read_lock();
+    rf = rcu_dereference(data->rf);
+    if (rf)
+        group = rf->group;
+    hash_for_each_possible_rcu(hwsim_rx_index, entry, node,
+                           hwsim_rx_index_key(data->netgroup,
+                                              chan->center_freq)) {
         struct sk_buff *nskb;
-        struct tx_iter_data tx_iter_data = {
-                .receive = false,
-                .channel = chan,
-        };
 
-        if (data == data2)
+        if (entry->netgroup != data->netgroup ||
+            entry->freq != chan->center_freq)
             continue;
 
-        if (!data2->started || (data2->idle && !data2->tmp_chan) ||
-            !hwsim_ps_rx_ok(data2, skb))
+        data2 = entry->data;
+        if (data == data2)
             continue;
 
-        if (!(data->group & data2->group))
+        rf2 = rcu_dereference(data2->rf);
+        if (!rf2 || !rf2->started || (rf2->idle && !rf2->tmp_chan))
             continue;
 
-        if (data->netgroup != data2->netgroup)
+        /* radios in other groups would never have heard it */
+        if (!(group & rf2->group))
             continue;
 
-        if (!hwsim_chans_compat(chan, data2->tmp_chan) &&
-            !hwsim_chans_compat(chan, data2->channel)) {
-            ieee80211_iterate_active_interfaces_atomic(
-                    data2->hw, IEEE80211_IFACE_ITER_NORMAL,
-                    wifi_hwsim_tx_iter, &tx_iter_data);
-            if (!tx_iter_data.receive)
-                continue;
+        if (!hwsim_ps_rx_ok(data2, rf2, skb)) {
+            hwsim_stats_inc(data2, HWSIM_STAT_RX_PS_DROPPED);
+            continue;
         }
 
+        /*
+         * The index only holds radios on this frequency, this merely
+         * catches an entry that lags behind a channel switch. Off-channel
+         * drops are counted by the medium RX path, where they happen.
+         */
+        if (!hwsim_chans_compat(chan, rf2->tmp_chan) &&
+            !hwsim_chans_compat(chan, rf2->channel) &&
+            (chan_idx < 0 || !test_bit(chan_idx, rf2->active_chans)))
+            continue;
+
         /*
 		 * reserve some space for our vendor and the normal
 		 * radiotap header, since we're copying anyway
 		 */
-        if (skb->len < PAGE_SIZE && paged_rx) {
+        if (skb->len < PAGE_SIZE && shared_rx) {
+            struct page *page;
+
+            /*
+             * The payload is copied once into a page fragment and every
+             * receiver only gets a small head with a reference to it.
+             * mac80211 pulls headers into that private head and
+             * linearizes before software decryption, so the fragment
+             * itself is never written to; SKBFL_SHARED_FRAG makes
+             * anything else that wants to touch it copy first.
+             */
+            if (!shared) {
+                shared = netdev_alloc_frag(skb->len);
+                if (!shared)
+                    goto copy_failed;
+                memcpy(shared, skb->data, skb->len);
+            }
+
+            nskb = dev_alloc_skb(128);
+            if (!nskb)
+                goto copy_failed;
+
+            page = virt_to_head_page(shared);
+            get_page(page);
+            skb_add_rx_frag(nskb, 0, page, shared - page_address(page),
+                            skb->len, skb->len);
+            skb_shinfo(nskb)->flags |= SKBFL_SHARED_FRAG;
+
+            if (shared_users++)
+                hwsim_stats_inc(data, HWSIM_STAT_FANOUT_COPIES_AVOIDED);
+        } else if (skb->len < PAGE_SIZE && paged_rx) {
             struct page *page = alloc_page(GFP_ATOMIC);
 
             if (!page)
-                continue;
+                goto copy_failed;
 
             nskb = dev_alloc_skb(128);
             if (!nskb) {
                 __free_page(page);
-                continue;
+                goto copy_failed;
             }
 
             memcpy(page_address(page), skb->data, skb->len);
@@ -1402,7 +2649,7 @@ static bool wifi_hwsim_tx_frame_no_nl(struct ieee80211_hw *hw,
         } else {
             nskb = skb_copy(skb, GFP_ATOMIC);
             if (!nskb)
-                continue;
+                goto copy_failed;
         }
 
         if (wifi_hwsim_addr_match(data2, hdr->addr1))
@@ -1414,15 +2661,60 @@ static bool wifi_hwsim_tx_frame_no_nl(struct ieee80211_hw *hw,
 
         wifi_hwsim_add_vendor_rtap(nskb);
 
-        data2->rx_pkts++;
-        data2->rx_bytes += nskb->len;
-        ieee80211_rx_irqsafe(data2->hw, nskb);
+        hwsim_stats_inc(data2, HWSIM_STAT_RX_PKTS);
+        hwsim_stats_add(data2, HWSIM_STAT_RX_BYTES, nskb->len);
+        hwsim_rx_deliver(data2, nskb);
+        continue;
+
+        copy_failed:
+        hwsim_stats_inc(data2, HWSIM_STAT_RX_COPY_FAILED);
     }
-    spin_unlock(&hwsim_radio_lock);
+    rcu_read_unlock();
+
+    /* drop our own reference, receivers hold theirs */
+    if (shared)
+        skb_free_frag(shared);
 
     return ack;
 }
 
+/*
+ * Charge the airtime a frame of a TXQ radio used to its station, so that
+ * airtime fairness and AQL work on what was sent. mac80211 keeps its estimate
+ * for one attempt of the frame in tx_time_est; called with the TX status
+ * filled in, before it is reported.
+ */
+static void hwsim_tx_airtime_report(struct wifi_hwsim_data *data,
+                                    struct sk_buff *skb)
+{
+    struct ieee80211_tx_info *txi = IEEE80211_SKB_CB(skb);
+    struct ieee80211_hdr *hdr = (struct ieee80211_hdr *)skb->data;
+    struct ieee80211_sta *sta;
+    u32 airtime, attempts = 0;
+    int i;
+
+    if (!data->use_txq || skb->len < 24 ||
+        !ieee80211_is_data_qos(hdr->frame_control))
+        return;
+
+    for (i = 0; i < IEEE80211_TX_MAX_RATES; i++) {
+        if (txi->status.rates[i].idx < 0)
+            break;
+        attempts += txi->status.rates[i].count;
+    }
+
+    airtime = ieee80211_info_get_tx_time_est(txi) * attempts;
+    if (!airtime)
+        return;
+
+    rcu_read_lock();
+    sta = ieee80211_find_sta_by_ifaddr(data->hw, hdr->addr1, hdr->addr2);
+    if (sta)
+        ieee80211_sta_register_airtime(sta, ieee80211_get_tid(hdr),
+                                       airtime, 0);
+    rcu_read_unlock();
+}
+
 static void wifi_hwsim_tx(struct ieee80211_hw *hw,
                               struct ieee80211_tx_control *control,
                               struct sk_buff *skb)
@@ -1431,7 +2723,8 @@ static void wifi_hwsim_tx(struct ieee80211_hw *hw,
     struct ieee80211_tx_info *txi = IEEE80211_SKB_CB(skb);
     struct ieee80211_hdr *hdr = (void *)skb->data;
     struct ieee80211_chanctx_conf *chanctx_conf;
-    struct ieee80211_channel *channel;
+    struct ieee80211_channel *channel = NULL;
+    const struct hwsim_rf_state *rf;
     bool ack;
     u32 _portid;
 
@@ -1441,16 +2734,20 @@ static void wifi_hwsim_tx(struct ieee80211_hw *hw,
         return;
     }
 
-    if (!data->use_chanctx) {
-        channel = data->channel;
+    rf = rcu_dereference(data->rf);
+    if (!rf) {
+        ieee80211_free_txskb(hw, skb);
+        return;
+    }
+
+    if (!data->use_chanctx) {
+        channel = rf->channel;
     } else if (txi->hw_queue == 4) {
-        channel = data->tmp_chan;
+        channel = rf->tmp_chan;
     } else {
         chanctx_conf = rcu_dereference(txi->control.vif->chanctx_conf);
         if (chanctx_conf)
             channel = chanctx_conf->def.chan;
-        else
-            channel = NULL;
     }
 
     if (WARN(!channel, "TX w/o channel - queue = %d\n", txi->hw_queue)) {
@@ -1458,7 +2755,7 @@ static void wifi_hwsim_tx(struct ieee80211_hw *hw,
         return;
     }
 
-    if (data->idle && !data->tmp_chan) {
+    if (rf->idle && !rf->tmp_chan) {
         wiphy_dbg(hw->wiphy, "Trying to TX when idle - reject\n");
         ieee80211_free_txskb(hw, skb);
         return;
@@ -1498,16 +2795,17 @@ static void wifi_hwsim_tx(struct ieee80211_hw *hw,
     /* wmediumd mode check */
     _portid = READ_ONCE(data->wmediumd);
 
-    if (_portid || hwsim_virtio_enabled)
+    if (_portid || hwsim_virtio_enabled ||
+        rcu_access_pointer(data->medium_ring))
         return wifi_hwsim_tx_frame_nl(hw, skb, _portid, channel);
 
     /* NO wmediumd detected, perfect medium simulation */
-    data->tx_pkts++;
-    data->tx_bytes += skb->len;
+    hwsim_stats_inc(data, HWSIM_STAT_TX_PKTS);
+    hwsim_stats_add(data, HWSIM_STAT_TX_BYTES, skb->len);
     ack = wifi_hwsim_tx_frame_no_nl(hw, skb, channel);
 
     if (ack && skb->len >= 16)
-        wifi_hwsim_monitor_ack(channel, hdr->addr2);
+        wifi_hwsim_monitor_ack(data, channel, hdr->addr2);
 
     ieee80211_tx_info_clear_status(txi);
 
@@ -1517,15 +2815,95 @@ static void wifi_hwsim_tx(struct ieee80211_hw *hw,
 
     if (!(txi->flags & IEEE80211_TX_CTL_NO_ACK) && ack)
         txi->flags |= IEEE80211_TX_STAT_ACK;
+    hwsim_tx_airtime_report(data, skb);
     ieee80211_tx_status_irqsafe(hw, skb);
 }
 
+/* frames pulled from one TXQ before moving on to the next one */
+#define HWSIM_TXQ_BURST 64
+
+static void wifi_hwsim_wake_tx_queue(struct ieee80211_hw *hw,
+                                     struct ieee80211_txq *txq)
+{
+    struct wifi_hwsim_data *data = hw->priv;
+
+    ieee80211_queue_work(hw, &data->txq_work);
+}
+
+/*
+ * Pull frames from the mac80211 TXQs and feed them to the medium. Every TXQ
+ * is served at most once per AC round (mac80211 enforces that for airtime
+ * fairness) with up to HWSIM_TXQ_BURST frames, and the work requeues itself
+ * if some TXQ still had frames left after its burst. With a batching
+ * wmediumd the frames of one run are sent together in a FRAME_BATCH.
+ */
+static void hwsim_txq_work(struct work_struct *work)
+{
+    struct wifi_hwsim_data *data =
+            container_of(work, struct wifi_hwsim_data, txq_work);
+    struct ieee80211_hw *hw = data->hw;
+    struct ieee80211_tx_control control = {};
+    struct ieee80211_txq *txq;
+    struct sk_buff *skb;
+    bool more = false;
+    int ac, n;
+
+    hwsim_tx_batch_hold(data);
+    for (ac = 0; ac < IEEE80211_NUM_ACS; ac++) {
+        local_bh_disable();
+        rcu_read_lock();
+        ieee80211_txq_schedule_start(hw, ac);
+        while ((txq = ieee80211_next_txq(hw, ac))) {
+            control.sta = txq->sta;
+            for (n = 0; n < HWSIM_TXQ_BURST; n++) {
+                skb = ieee80211_tx_dequeue(hw, txq);
+                if (!skb)
+                    break;
+                wifi_hwsim_tx(hw, &control, skb);
+            }
+            if (n == HWSIM_TXQ_BURST)
+                more = true;
+            ieee80211_return_txq(hw, txq, false);
+        }
+        ieee80211_txq_schedule_end(hw, ac);
+        rcu_read_unlock();
+        local_bh_enable();
+    }
+    hwsim_tx_batch_release(data);
+
+    if (more && data->started)
+        ieee80211_queue_work(hw, &data->txq_work);
+}
+
+/*
+ * Keep the radio's monitor netdev in the radio's netns. Moving a wiphy closes
+ * its interfaces, so the radio is always started again before it has frames
+ * to capture in the new netns; mac80211 starts it under RTNL.
+ */
+static void hwsim_radio_mon_follow(struct wifi_hwsim_data *data)
+{
+    struct net *net = wiphy_net(data->hw->wiphy);
+    int err;
+
+    if (!data->mon || net_eq(dev_net(data->mon), net))
+        return;
+
+    err = dev_change_net_namespace(data->mon, net, "wmon%d");
+    if (err)
+        wiphy_warn(data->hw->wiphy,
+                   "failed to move monitor netdev: %d\n", err);
+}
 
 static int wifi_hwsim_start(struct ieee80211_hw *hw)
 {
     struct wifi_hwsim_data *data = hw->priv;
     wiphy_dbg(hw->wiphy, "%s\n", __func__);
+    hwsim_radio_mon_follow(data);
+    napi_enable(&data->napi);
+    mutex_lock(&data->mutex);
     data->started = true;
+    hwsim_rf_state_update(data);
+    mutex_unlock(&data->mutex);
     return 0;
 }
 
@@ -1534,11 +2912,29 @@ static void wifi_hwsim_stop(struct ieee80211_hw *hw)
 {
     struct wifi_hwsim_data *data = hw->priv;
 
+    mutex_lock(&data->mutex);
     data->started = false;
+    hwsim_rf_state_update(data);
+    mutex_unlock(&data->mutex);
     hrtimer_cancel(&data->beacon_timer);
 
-    while (!skb_queue_empty(&data->pending))
-        ieee80211_free_txskb(hw, skb_dequeue(&data->pending));
+    if (data->use_txq)
+        cancel_work_sync(&data->txq_work);
+
+    napi_disable(&data->napi);
+    /*
+     * Senders deliver under RCU; once those that still saw the radio
+     * started are done, nothing is queued anymore until the next start.
+     */
+    synchronize_rcu();
+    skb_queue_purge(&data->rx_queue);
+
+    hrtimer_cancel(&data->tx_batch_timer);
+    spin_lock_bh(&data->tx_batch_lock);
+    nlmsg_free(hwsim_tx_batch_take(data));
+    spin_unlock_bh(&data->tx_batch_lock);
+
+    hwsim_pending_purge(data);
 
     wiphy_dbg(hw->wiphy, "%s\n", __func__);
 }
@@ -1547,11 +2943,17 @@ static void wifi_hwsim_stop(struct ieee80211_hw *hw)
 static int wifi_hwsim_add_interface(struct ieee80211_hw *hw,
                                         struct ieee80211_vif *vif)
 {
+    struct wifi_hwsim_data *data = hw->priv;
+
     wiphy_dbg(hw->wiphy, "%s (type=%d mac_addr=%pM)\n",
               __func__, ieee80211_vif_type_p2p(vif),
               vif->addr);
     hwsim_set_magic(vif);
 
+    mutex_lock(&data->mutex);
+    hwsim_vif_addrs_update(data, vif->addr, true);
+    mutex_unlock(&data->mutex);
+
     if (vif->type != NL80211_IFTYPE_MONITOR)
         wifi_hwsim_config_mac_nl(hw, vif->addr, true);
 
@@ -1583,17 +2985,25 @@ static int wifi_hwsim_change_interface(struct ieee80211_hw *hw,
 	 */
     vif->cab_queue = 0;
 
+    /* the address stays the same, so the vif_addrs set is still valid */
+
     return 0;
 }
 
 static void wifi_hwsim_remove_interface(
         struct ieee80211_hw *hw, struct ieee80211_vif *vif)
 {
+    struct wifi_hwsim_data *data = hw->priv;
+
     wiphy_dbg(hw->wiphy, "%s (type=%d mac_addr=%pM)\n",
               __func__, ieee80211_vif_type_p2p(vif),
               vif->addr);
     hwsim_check_magic(vif);
     hwsim_clear_magic(vif);
+
+    mutex_lock(&data->mutex);
+    hwsim_vif_addrs_update(data, vif->addr, false);
+    mutex_unlock(&data->mutex);
     if (vif->type != NL80211_IFTYPE_MONITOR)
         wifi_hwsim_config_mac_nl(hw, vif->addr, false);
 }
@@ -1614,11 +3024,12 @@ static void wifi_hwsim_tx_frame(struct ieee80211_hw *hw,
 
     wifi_hwsim_monitor_rx(hw, skb, chan);
 
-    if (_pid || hwsim_virtio_enabled)
+    if (_pid || hwsim_virtio_enabled ||
+        rcu_access_pointer(data->medium_ring))
         return wifi_hwsim_tx_frame_nl(hw, skb, _pid, chan);
 
-    data->tx_pkts++;
-    data->tx_bytes += skb->len;
+    hwsim_stats_inc(data, HWSIM_STAT_TX_PKTS);
+    hwsim_stats_add(data, HWSIM_STAT_TX_BYTES, skb->len);
     wifi_hwsim_tx_frame_no_nl(hw, skb, chan);
     dev_kfree_skb(skb);
 }
@@ -1736,6 +3147,7 @@ static int wifi_hwsim_config(struct ieee80211_hw *hw, u32 changed)
             [IEEE80211_SMPS_STATIC] = "static",
             [IEEE80211_SMPS_DYNAMIC] = "dynamic",
     };
+    struct ieee80211_channel *old_chan;
     int idx;
 
     if (conf->chandef.chan)
@@ -1757,11 +3169,11 @@ static int wifi_hwsim_config(struct ieee80211_hw *hw, u32 changed)
                   !!(conf->flags & IEEE80211_CONF_PS),
                   smps_modes[conf->smps_mode]);
 
-    data->idle = !!(conf->flags & IEEE80211_CONF_IDLE);
-
     WARN_ON(conf->chandef.chan && data->use_chanctx);
 
     mutex_lock(&data->mutex);
+    data->idle = !!(conf->flags & IEEE80211_CONF_IDLE);
+    old_chan = data->channel;
     if (data->scanning && conf->chandef.chan) {
         for (idx = 0; idx < ARRAY_SIZE(data->survey_data); idx++) {
             if (data->survey_data[idx].channel == data->channel) {
@@ -1785,6 +3197,12 @@ static int wifi_hwsim_config(struct ieee80211_hw *hw, u32 changed)
     } else {
         data->channel = conf->chandef.chan;
     }
+
+    if (data->channel != old_chan) {
+        hwsim_rx_index_del(data, old_chan);
+        hwsim_rx_index_add(data, data->channel);
+    }
+    hwsim_rf_state_update(data);
     mutex_unlock(&data->mutex);
 
     if (!data->started || !data->beacon_int)
@@ -2222,7 +3640,9 @@ static void hw_scan_work(struct work_struct *work)
         ieee80211_scan_completed(hwsim->hw, &info);
         hwsim->hw_scan_request = NULL;
         hwsim->hw_scan_vif = NULL;
+        hwsim_rx_index_del(hwsim, hwsim->tmp_chan);
         hwsim->tmp_chan = NULL;
+        hwsim_rf_state_update(hwsim);
         mutex_unlock(&hwsim->mutex);
         wifi_hwsim_config_mac_nl(hwsim->hw, hwsim->scan_addr,
                                      false);
@@ -2232,7 +3652,10 @@ static void hw_scan_work(struct work_struct *work)
     wiphy_dbg(hwsim->hw->wiphy, "hw scan %d MHz\n",
               req->channels[hwsim->scan_chan_idx]->center_freq);
 
+    hwsim_rx_index_add(hwsim, req->channels[hwsim->scan_chan_idx]);
+    hwsim_rx_index_del(hwsim, hwsim->tmp_chan);
     hwsim->tmp_chan = req->channels[hwsim->scan_chan_idx];
+    hwsim_rf_state_update(hwsim);
     if (hwsim->tmp_chan->flags & (IEEE80211_CHAN_NO_IR |
                                   IEEE80211_CHAN_RADAR) ||
         !req->n_ssids) {
@@ -2333,7 +3756,9 @@ static void wifi_hwsim_cancel_hw_scan(struct ieee80211_hw *hw,
 
     mutex_lock(&hwsim->mutex);
     ieee80211_scan_completed(hwsim->hw, &info);
+    hwsim_rx_index_del(hwsim, hwsim->tmp_chan);
     hwsim->tmp_chan = NULL;
+    hwsim_rf_state_update(hwsim);
     hwsim->hw_scan_request = NULL;
     hwsim->hw_scan_vif = NULL;
     mutex_unlock(&hwsim->mutex);
@@ -2356,6 +3781,7 @@ static void wifi_hwsim_sw_scan(struct ieee80211_hw *hw,
 
     memcpy(hwsim->scan_addr, mac_addr, ETH_ALEN);
     wifi_hwsim_config_mac_nl(hw, hwsim->scan_addr, true);
+    hwsim_vif_addrs_update(hwsim, hwsim->scan_addr, true);
     hwsim->scanning = true;
     memset(hwsim->survey_data, 0, sizeof(hwsim->survey_data));
 
@@ -2371,6 +3797,8 @@ static void wifi_hwsim_sw_scan_complete(struct ieee80211_hw *hw,
     mutex_lock(&hwsim->mutex);
 
     pr_debug("hwsim sw_scan_complete\n");
+    if (hwsim->scanning)
+        hwsim_vif_addrs_update(hwsim, hwsim->scan_addr, false);
     hwsim->scanning = false;
     wifi_hwsim_config_mac_nl(hw, hwsim->scan_addr, false);
     eth_zero_addr(hwsim->scan_addr);
@@ -2387,6 +3815,8 @@ static void hw_roc_start(struct work_struct *work)
 
     wiphy_dbg(hwsim->hw->wiphy, "hwsim ROC begins\n");
     hwsim->tmp_chan = hwsim->roc_chan;
+    hwsim_rx_index_add(hwsim, hwsim->tmp_chan);
+    hwsim_rf_state_update(hwsim);
     ieee80211_ready_on_channel(hwsim->hw);
 
     ieee80211_queue_delayed_work(hwsim->hw, &hwsim->roc_done,
@@ -2402,7 +3832,9 @@ static void hw_roc_done(struct work_struct *work)
 
     mutex_lock(&hwsim->mutex);
     ieee80211_remain_on_channel_expired(hwsim->hw);
+    hwsim_rx_index_del(hwsim, hwsim->tmp_chan);
     hwsim->tmp_chan = NULL;
+    hwsim_rf_state_update(hwsim);
     mutex_unlock(&hwsim->mutex);
 
     wiphy_dbg(hwsim->hw->wiphy, "hwsim ROC expired\n");
@@ -2442,7 +3874,9 @@ static int wifi_hwsim_croc(struct ieee80211_hw *hw,
     cancel_delayed_work_sync(&hwsim->roc_done);
 
     mutex_lock(&hwsim->mutex);
+    hwsim_rx_index_del(hwsim, hwsim->tmp_chan);
     hwsim->tmp_chan = NULL;
+    hwsim_rf_state_update(hwsim);
     mutex_unlock(&hwsim->mutex);
 
     wiphy_dbg(hw->wiphy, "hwsim ROC canceled\n");
@@ -2454,9 +3888,18 @@ static int wifi_hwsim_add_chanctx(struct ieee80211_hw *hw,
                                       struct ieee80211_chanctx_conf *ctx)
 {
     struct wifi_hwsim_data *hwsim = hw->priv;
+    struct hwsim_chanctx_priv *cp = (void *)ctx->drv_priv;
+    int err;
 
     mutex_lock(&hwsim->mutex);
+    err = hwsim_rx_index_add(hwsim, ctx->def.chan);
+    if (err) {
+        mutex_unlock(&hwsim->mutex);
+        return err;
+    }
     hwsim->chanctx = ctx;
+    cp->rx_chan = ctx->def.chan;
+    hwsim_rf_state_update(hwsim);
     mutex_unlock(&hwsim->mutex);
     hwsim_set_chanctx_magic(ctx);
     wiphy_dbg(hw->wiphy,
@@ -2470,9 +3913,13 @@ static void wifi_hwsim_remove_chanctx(struct ieee80211_hw *hw,
                                           struct ieee80211_chanctx_conf *ctx)
 {
     struct wifi_hwsim_data *hwsim = hw->priv;
+    struct hwsim_chanctx_priv *cp = (void *)ctx->drv_priv;
 
     mutex_lock(&hwsim->mutex);
     hwsim->chanctx = NULL;
+    hwsim_rx_index_del(hwsim, cp->rx_chan);
+    cp->rx_chan = NULL;
+    hwsim_rf_state_update(hwsim);
     mutex_unlock(&hwsim->mutex);
     wiphy_dbg(hw->wiphy,
               "remove channel context control: %d MHz/width: %d/cfreqs:%d/%d MHz\n",
@@ -2487,9 +3934,21 @@ static void wifi_hwsim_change_chanctx(struct ieee80211_hw *hw,
                                           u32 changed)
 {
     struct wifi_hwsim_data *hwsim = hw->priv;
+    struct hwsim_chanctx_priv *cp = (void *)ctx->drv_priv;
 
     mutex_lock(&hwsim->mutex);
     hwsim->chanctx = ctx;
+    if (cp->rx_chan != ctx->def.chan) {
+        hwsim_rx_index_add(hwsim, ctx->def.chan);
+        hwsim_rx_index_del(hwsim, cp->rx_chan);
+        cp->rx_chan = ctx->def.chan;
+    }
+    if (cp->n_vifs && cp->active_chan != ctx->def.chan) {
+        hwsim_active_chan_get(hwsim, ctx->def.chan);
+        hwsim_active_chan_put(hwsim, cp->active_chan);
+        cp->active_chan = ctx->def.chan;
+    }
+    hwsim_rf_state_update(hwsim);
     mutex_unlock(&hwsim->mutex);
     hwsim_check_chanctx_magic(ctx);
     wiphy_dbg(hw->wiphy,
@@ -2502,9 +3961,20 @@ static int wifi_hwsim_assign_vif_chanctx(struct ieee80211_hw *hw,
                                              struct ieee80211_vif *vif,
                                              struct ieee80211_chanctx_conf *ctx)
 {
+    struct wifi_hwsim_data *hwsim = hw->priv;
+    struct hwsim_chanctx_priv *cp = (void *)ctx->drv_priv;
+
     hwsim_check_magic(vif);
     hwsim_check_chanctx_magic(ctx);
 
+    mutex_lock(&hwsim->mutex);
+    if (cp->n_vifs++ == 0) {
+        cp->active_chan = ctx->def.chan;
+        hwsim_active_chan_get(hwsim, cp->active_chan);
+        hwsim_rf_state_update(hwsim);
+    }
+    mutex_unlock(&hwsim->mutex);
+
     return 0;
 }
 
@@ -2512,8 +3982,19 @@ static void wifi_hwsim_unassign_vif_chanctx(struct ieee80211_hw *hw,
                                                 struct ieee80211_vif *vif,
                                                 struct ieee80211_chanctx_conf *ctx)
 {
+    struct wifi_hwsim_data *hwsim = hw->priv;
+    struct hwsim_chanctx_priv *cp = (void *)ctx->drv_priv;
+
     hwsim_check_magic(vif);
     hwsim_check_chanctx_magic(ctx);
+
+    mutex_lock(&hwsim->mutex);
+    if (!WARN_ON(!cp->n_vifs) && --cp->n_vifs == 0) {
+        hwsim_active_chan_put(hwsim, cp->active_chan);
+        cp->active_chan = NULL;
+        hwsim_rf_state_update(hwsim);
+    }
+    mutex_unlock(&hwsim->mutex);
 }
 
 static const char wifi_hwsim_gstrings_stats[][ETH_GSTRING_LEN] = {
@@ -2525,6 +4006,15 @@ static const char wifi_hwsim_gstrings_stats[][ETH_GSTRING_LEN] = {
         "d_tx_failed",
         "d_ps_mode",
         "d_group",
+        "d_fanout_copies_avoided",
+        "d_rx_queue_dropped",
+        "d_rx_copy_failed",
+        "d_rx_offchan_dropped",
+        "d_rx_ps_dropped",
+        "d_tx_batches",
+        "d_tx_queue_depth",
+        "d_tx_queue_stops",
+        "d_tx_queue_wakes",
 };
 
 #define WIFI_HWSIM_SSTATS_LEN ARRAY_SIZE(wifi_hwsim_gstrings_stats)
@@ -2551,16 +4041,28 @@ static void wifi_hwsim_get_et_stats(struct ieee80211_hw *hw,
                                         struct ethtool_stats *stats, u64 *data)
 {
     struct wifi_hwsim_data *ar = hw->priv;
+    u64 sum[HWSIM_STAT_NUM];
     int i = 0;
 
-    data[i++] = ar->tx_pkts;
-    data[i++] = ar->tx_bytes;
-    data[i++] = ar->rx_pkts;
-    data[i++] = ar->rx_bytes;
-    data[i++] = ar->tx_dropped;
-    data[i++] = ar->tx_failed;
+    hwsim_stats_fetch(ar, sum);
+
+    data[i++] = sum[HWSIM_STAT_TX_PKTS];
+    data[i++] = sum[HWSIM_STAT_TX_BYTES];
+    data[i++] = sum[HWSIM_STAT_RX_PKTS];
+    data[i++] = sum[HWSIM_STAT_RX_BYTES];
+    data[i++] = sum[HWSIM_STAT_TX_DROPPED];
+    data[i++] = sum[HWSIM_STAT_TX_FAILED];
     data[i++] = ar->ps;
     data[i++] = ar->group;
+    data[i++] = sum[HWSIM_STAT_FANOUT_COPIES_AVOIDED];
+    data[i++] = sum[HWSIM_STAT_RX_QUEUE_DROPPED];
+    data[i++] = sum[HWSIM_STAT_RX_COPY_FAILED];
+    data[i++] = sum[HWSIM_STAT_RX_OFFCHAN_DROPPED];
+    data[i++] = sum[HWSIM_STAT_RX_PS_DROPPED];
+    data[i++] = sum[HWSIM_STAT_TX_BATCHES];
+    data[i++] = skb_queue_len(&ar->pending);
+    data[i++] = sum[HWSIM_STAT_TX_QUEUE_STOPS];
+    data[i++] = sum[HWSIM_STAT_TX_QUEUE_WAKES];
 
     WARN_ON(i != WIFI_HWSIM_SSTATS_LEN);
 }
@@ -3187,6 +4689,9 @@ out:
 	return err;
 }
 
+#define HWSIM_TXQ_OPS						\
+	.wake_tx_queue = wifi_hwsim_wake_tx_queue,
+
 #define HWSIM_COMMON_OPS					\
 	.tx = wifi_hwsim_tx,				\
 	.start = wifi_hwsim_start,				\
@@ -3219,6 +4724,13 @@ static const struct ieee80211_ops wifi_hwsim_ops = {
         .sw_scan_complete = wifi_hwsim_sw_scan_complete,
 };
 
+static const struct ieee80211_ops wifi_hwsim_txq_ops = {
+        HWSIM_COMMON_OPS
+        HWSIM_TXQ_OPS
+        .sw_scan_start = wifi_hwsim_sw_scan,
+        .sw_scan_complete = wifi_hwsim_sw_scan_complete,
+};
+
 struct hwsim_new_radio_params {
     unsigned int channels;
     const char *reg_alpha2;
@@ -3235,6 +4747,14 @@ struct hwsim_new_radio_params {
     u8 n_ciphers;
     bool mlo;
 	const struct cfg80211_pmsr_capabilities *pmsr_capa;
+    bool use_txq;
+    u32 tx_queue_high;
+    u32 tx_queue_low;
+    bool tx_backpressure;
+    u64 group;
+    /* index taken from hwsim_radio_idx in advance, by a radio batch */
+    bool idx_reserved;
+    int idx;
 };
 
 static void hwsim_mcast_config_msg(struct sk_buff *mcast_skb,
@@ -3302,6 +4822,38 @@ static int append_radio_msg(struct sk_buff *skb, int id,
             return ret;
     }
 
+    if (param->use_txq) {
+        ret = nla_put_flag(skb, HWSIM_ATTR_USE_TXQ);
+        if (ret < 0)
+            return ret;
+    }
+
+    /* a low watermark of 0 is valid, it comes with every high one */
+    if (param->tx_queue_high) {
+        ret = nla_put_u32(skb, HWSIM_ATTR_TX_QUEUE_HIGH,
+                          param->tx_queue_high);
+        if (ret < 0)
+            return ret;
+
+        ret = nla_put_u32(skb, HWSIM_ATTR_TX_QUEUE_LOW,
+                          param->tx_queue_low);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (param->tx_backpressure) {
+        ret = nla_put_flag(skb, HWSIM_ATTR_TX_BACKPRESSURE);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (param->group) {
+        ret = nla_put_u64_64bit(skb, HWSIM_ATTR_GROUP, param->group,
+                                HWSIM_ATTR_PAD);
+        if (ret < 0)
+            return ret;
+    }
+
     if (param->hwname) {
         ret = nla_put(skb, HWSIM_ATTR_RADIO_NAME,
                       strlen(param->hwname), param->hwname);
@@ -3619,6 +5171,13 @@ static const struct ieee80211_ops wifi_hwsim_mchan_ops = {
 	HWSIM_CHANCTX_OPS
 };
 
+static const struct ieee80211_ops wifi_hwsim_mchan_txq_ops = {
+	HWSIM_COMMON_OPS
+	HWSIM_TXQ_OPS
+	HWSIM_NON_MLO_OPS
+	HWSIM_CHANCTX_OPS
+};
+
 static const struct ieee80211_ops wifi_hwsim_mlo_ops = {
 	HWSIM_COMMON_OPS
 	HWSIM_CHANCTX_OPS
@@ -3628,6 +5187,32 @@ static const struct ieee80211_ops wifi_hwsim_mlo_ops = {
 	.sta_state = wifi_hwsim_sta_state,
 };
 
+static const struct ieee80211_ops wifi_hwsim_mlo_txq_ops = {
+	HWSIM_COMMON_OPS
+	HWSIM_TXQ_OPS
+	HWSIM_CHANCTX_OPS
+	.set_rts_threshold = wifi_hwsim_set_rts_threshold,
+	.sta_state = wifi_hwsim_sta_state,
+};
+
+/* monitor netdev of a single radio, living in the radio's netns */
+static struct net_device *hwsim_radio_mon_create(struct net *net)
+{
+    struct net_device *dev;
+
+    dev = alloc_netdev(0, "wmon%d", NET_NAME_ENUM, hwsim_mon_setup);
+    if (!dev)
+        return NULL;
+
+    dev_net_set(dev, net);
+    if (register_netdev(dev)) {
+        free_netdev(dev);
+        return NULL;
+    }
+
+    return dev;
+}
+
 static int wifi_hwsim_new_radio(struct genl_info *info,
                                     struct hwsim_new_radio_params *param)
 {
@@ -3637,6 +5222,7 @@ static int wifi_hwsim_new_radio(struct genl_info *info,
     struct ieee80211_hw *hw;
     enum nl80211_band band;
     const struct ieee80211_ops *ops = &wifi_hwsim_ops;
+    struct hwsim_medium_shard *shard;
     struct net *net;
     int idx, i;
     int n_limits = 0;
@@ -3644,14 +5230,21 @@ static int wifi_hwsim_new_radio(struct genl_info *info,
     if (WARN_ON(param->channels > 1 && !param->use_chanctx))
         return -EINVAL;
 
-    spin_lock_bh(&hwsim_radio_lock);
-    idx = hwsim_radio_idx++;
-    spin_unlock_bh(&hwsim_radio_lock);
+    if (param->idx_reserved) {
+        idx = param->idx;
+    } else {
+        spin_lock_bh(&hwsim_radio_lock);
+        idx = hwsim_radio_idx++;
+        spin_unlock_bh(&hwsim_radio_lock);
+    }
 
     if (param->mlo)
-		ops = &wifi_hwsim_mlo_ops;
+		ops = param->use_txq ? &wifi_hwsim_mlo_txq_ops : &wifi_hwsim_mlo_ops;
     else if (param->use_chanctx)
-        ops = &wifi_hwsim_mchan_ops;
+        ops = param->use_txq ? &wifi_hwsim_mchan_txq_ops :
+                               &wifi_hwsim_mchan_ops;
+    else if (param->use_txq)
+        ops = &wifi_hwsim_txq_ops;
     hw = ieee80211_alloc_hw_nm(sizeof(*data), ops, param->hwname);
     if (!hw) {
         pr_debug("aprf_drv: ieee80211_alloc_hw failed\n");
@@ -3688,6 +5281,19 @@ static int wifi_hwsim_new_radio(struct genl_info *info,
     }
 
     skb_queue_head_init(&data->pending);
+    xa_init(&data->pending_cookies);
+    INIT_LIST_HEAD(&data->rx_index);
+
+    skb_queue_head_init(&data->rx_queue);
+    init_dummy_netdev(&data->napi_dev);
+    netif_napi_add(&data->napi_dev, &data->napi, hwsim_napi_poll,
+                   NAPI_POLL_WEIGHT);
+
+    data->stats = netdev_alloc_pcpu_stats(struct hwsim_pcpu_stats);
+    if (!data->stats) {
+        err = -ENOMEM;
+        goto failed_hw;
+    }
 
     SET_IEEE80211_DEV(hw, data->dev);
     if (!param->perm_addr) {
@@ -3712,6 +5318,10 @@ static int wifi_hwsim_new_radio(struct genl_info *info,
 
     data->channels = param->channels;
     data->use_chanctx = param->use_chanctx;
+    data->use_txq = param->use_txq;
+    data->tx_queue_high = param->tx_queue_high;
+    data->tx_queue_low = param->tx_queue_low;
+    data->tx_backpressure = param->tx_backpressure;
     data->idx = idx;
     data->destroy_on_close = param->destroy_on_close;
     if (info)
@@ -3794,6 +5404,7 @@ static int wifi_hwsim_new_radio(struct genl_info *info,
 
     INIT_DELAYED_WORK(&data->roc_start, hw_roc_start);
     INIT_DELAYED_WORK(&data->roc_done, hw_roc_done);
+    INIT_WORK(&data->txq_work, hwsim_txq_work);
     INIT_DELAYED_WORK(&data->hw_scan, hw_scan_work);
 
     hw->queues = 5;
@@ -3930,11 +5541,21 @@ static int wifi_hwsim_new_radio(struct genl_info *info,
     }
 
     /* By default all radios belong to the first group */
-    data->group = 1;
+    data->group = param->group ?: 1;
     mutex_init(&data->mutex);
+    mutex_lock(&data->mutex);
+    err = hwsim_rf_state_update(data);
+    mutex_unlock(&data->mutex);
+    if (err)
+        goto failed_hw;
 
     data->netgroup = hwsim_net_get_netgroup(net);
-    data->wmediumd = hwsim_net_get_wmediumd(net);
+    shard = hwsim_net_get_shard(net, data->idx);
+    if (shard) {
+        data->wmediumd = READ_ONCE(shard->portid);
+        data->wmediumd_flags = READ_ONCE(shard->flags);
+    }
+    RCU_INIT_POINTER(data->medium_ring, hwsim_net_get_medium_ring(net));
 
     /* Enable frame retransmissions for lossy channels */
     hw->max_rates = 4;
@@ -3960,11 +5581,18 @@ static int wifi_hwsim_new_radio(struct genl_info *info,
         ieee80211_hw_set(hw, NO_AUTO_VIF);
 
     wiphy_ext_feature_set(hw->wiphy, NL80211_EXT_FEATURE_CQM_RSSI_LIST);
+    if (data->use_txq)
+        wiphy_ext_feature_set(hw->wiphy, NL80211_EXT_FEATURE_AQL);
 
     hrtimer_init(&data->beacon_timer, CLOCK_MONOTONIC,
                  HRTIMER_MODE_ABS_SOFT);
     data->beacon_timer.function = wifi_hwsim_beacon;
 
+    spin_lock_init(&data->tx_batch_lock);
+    hrtimer_init(&data->tx_batch_timer, CLOCK_MONOTONIC,
+                 HRTIMER_MODE_REL_SOFT);
+    data->tx_batch_timer.function = hwsim_tx_batch_timer;
+
     err = ieee80211_register_hw(hw);
     if (err < 0) {
         pr_debug("aprf_drv: ieee80211_register_hw failed (%d)\n",
@@ -3986,11 +5614,21 @@ static int wifi_hwsim_new_radio(struct genl_info *info,
                         &hwsim_fops_group);
     debugfs_create_file("rx_rssi", 0666, data->debugfs, data,
 			    &hwsim_fops_rx_rssi);
+    debugfs_create_file("tx_queue_high", 0644, data->debugfs, data,
+                        &hwsim_fops_tx_queue_high);
+    debugfs_create_file("tx_queue_low", 0644, data->debugfs, data,
+                        &hwsim_fops_tx_queue_low);
     if (!data->use_chanctx)
         debugfs_create_file("dfs_simulate_radar", 0222,
                             data->debugfs,
                             data, &hwsim_simulate_radar);
 
+    if (radio_mon) {
+        data->mon = hwsim_radio_mon_create(net);
+        if (!data->mon)
+            wiphy_warn(hw->wiphy, "failed to create monitor netdev\n");
+    }
+
     spin_lock_bh(&hwsim_radio_lock);
     err = rhashtable_insert_fast(&hwsim_radios_rht, &data->rht,
                                  hwsim_rht_params);
@@ -4004,7 +5642,7 @@ static int wifi_hwsim_new_radio(struct genl_info *info,
         goto failed_final_insert;
     }
 
-    list_add_tail(&data->list, &hwsim_radios);
+    list_add_tail_rcu(&data->list, &hwsim_radios);
     hwsim_radios_generation++;
     spin_unlock_bh(&hwsim_radio_lock);
 
@@ -4015,7 +5653,19 @@ static int wifi_hwsim_new_radio(struct genl_info *info,
     failed_final_insert:
     debugfs_remove_recursive(data->debugfs);
     ieee80211_unregister_hw(data->hw);
+    if (data->mon)
+        unregister_netdev(data->mon);
+    spin_lock_bh(&hwsim_radio_lock);
+    hwsim_rx_index_flush(data);
+    data->unlinked = true;
+    spin_unlock_bh(&hwsim_radio_lock);
+    synchronize_rcu();
     failed_hw:
+    kfree(rcu_access_pointer(data->vif_addrs));
+    kfree(rcu_access_pointer(data->rf));
+    kfree(data->rf_spare);
+    free_percpu(data->stats);
+    netif_napi_del(&data->napi);
     device_release_driver(data->dev);
     failed_bind:
     device_unregister(data->dev);
@@ -4060,6 +5710,12 @@ static void hwsim_mcast_del_radio(int id, const char *hwname,
     nlmsg_free(skb);
 }
 
+/*
+ * The radio must have been taken off the lists with hwsim_radio_unlink() and
+ * an RCU grace period must have passed since, so that no datapath reader can
+ * still reference it. Callers removing several radios unlink all of them
+ * first and wait for a single grace period.
+ */
 static void wifi_hwsim_del_radio(struct wifi_hwsim_data *data,
                                      const char *hwname,
                                      struct genl_info *info)
@@ -4067,6 +5723,15 @@ static void wifi_hwsim_del_radio(struct wifi_hwsim_data *data,
     hwsim_mcast_del_radio(data->idx, hwname, info);
     debugfs_remove_recursive(data->debugfs);
     ieee80211_unregister_hw(data->hw);
+    if (data->mon)
+        unregister_netdev(data->mon);
+    netif_napi_del(&data->napi);
+    skb_queue_purge(&data->rx_queue);
+    xa_destroy(&data->pending_cookies);
+    kfree(rcu_access_pointer(data->vif_addrs));
+    kfree(rcu_access_pointer(data->rf));
+    kfree(data->rf_spare);
+    free_percpu(data->stats);
     device_release_driver(data->dev);
     device_unregister(data->dev);
     ieee80211_free_hw(data->hw);
@@ -4097,8 +5762,13 @@ static int wifi_hwsim_get_radio(struct sk_buff *skb,
     param.p2p_device = !!(data->hw->wiphy->interface_modes &
                           BIT(NL80211_IFTYPE_P2P_DEVICE));
     param.use_chanctx = data->use_chanctx;
+    param.use_txq = data->use_txq;
+    param.tx_queue_high = data->tx_queue_high;
+    param.tx_queue_low = data->tx_queue_low;
+    param.tx_backpressure = data->tx_backpressure;
     param.regd = data->regd;
     param.channels = data->channels;
+    param.group = data->group;
     param.hwname = wiphy_name(data->hw->wiphy);
 
     res = append_radio_msg(skb, data->idx, &param);
@@ -4115,19 +5785,23 @@ static int wifi_hwsim_get_radio(struct sk_buff *skb,
 
 static void wifi_hwsim_free(void)
 {
-    struct wifi_hwsim_data *data;
+    struct wifi_hwsim_data *data, *tmp;
+    LIST_HEAD(list);
 
     spin_lock_bh(&hwsim_radio_lock);
-    while ((data = list_first_entry_or_null(&hwsim_radios,
-                                            struct wifi_hwsim_data,
-                                            list))) {
-        list_del(&data->list);
-        spin_unlock_bh(&hwsim_radio_lock);
+    list_for_each_entry_safe(data, tmp, &hwsim_radios, list) {
+        hwsim_radio_unlink(data);
+        list_add_tail(&data->destroy_list, &list);
+    }
+    spin_unlock_bh(&hwsim_radio_lock);
+
+    synchronize_rcu();
+
+    list_for_each_entry_safe(data, tmp, &list, destroy_list) {
+        list_del(&data->destroy_list);
         wifi_hwsim_del_radio(data, wiphy_name(data->hw->wiphy),
                                  NULL);
-        spin_lock_bh(&hwsim_radio_lock);
     }
-    spin_unlock_bh(&hwsim_radio_lock);
     class_destroy(hwsim_class);
 }
 
@@ -4148,88 +5822,142 @@ static void hwsim_mon_setup(struct net_device *dev)
     dev->dev_addr[0] = 0x12;
 }
 
-static void hwsim_register_wmediumd(struct net *net, u32 portid)
+/* hand the radios of @shard over to its wmediumd, under hwsim_radio_lock */
+static void hwsim_update_shard(struct hwsim_net *hwsim_net, u32 shard)
 {
+    struct hwsim_medium_shard *s = &hwsim_net->shards[shard];
     struct wifi_hwsim_data *data;
 
-    hwsim_net_set_wmediumd(net, portid);
-
-    spin_lock_bh(&hwsim_radio_lock);
     list_for_each_entry(data, &hwsim_radios, list) {
-        if (data->netgroup == hwsim_net_get_netgroup(net))
-            data->wmediumd = portid;
+        if (data->netgroup != hwsim_net->netgroup ||
+            data->idx % hwsim_net->nr_shards != shard)
+            continue;
+
+        WRITE_ONCE(data->wmediumd_flags, s->flags);
+        WRITE_ONCE(data->wmediumd, s->portid);
     }
-    spin_unlock_bh(&hwsim_radio_lock);
 }
 
-static int hwsim_tx_info_frame_received_nl(struct sk_buff *skb_2,
-                                           struct genl_info *info)
+/*
+ * Drop the pending frames of the radios of @netgroup, of all of them or only
+ * of those left without a medium. The radios are walked under RCU rather
+ * than hwsim_radio_lock, there may be any number of frames to free.
+ */
+static void hwsim_netgroup_pending_purge(int netgroup, bool unserved_only)
 {
+    struct wifi_hwsim_data *data;
 
-    struct ieee80211_hdr *hdr;
-    struct wifi_hwsim_data *data2;
-    struct ieee80211_tx_info *txi;
-    struct hwsim_tx_rate *tx_attempts;
-    u64 ret_skb_cookie;
-    struct sk_buff *skb, *tmp;
-    const u8 *src;
-    unsigned int hwsim_flags;
-    int i;
-    unsigned long flags;
-    bool found = false;
+    rcu_read_lock();
+    list_for_each_entry_rcu(data, &hwsim_radios, list) {
+        if (data->netgroup != netgroup)
+            continue;
+        if (unserved_only && (READ_ONCE(data->wmediumd) ||
+                              rcu_access_pointer(data->medium_ring)))
+            continue;
 
-    if (!info->attrs[HWSIM_ATTR_ADDR_TRANSMITTER] ||
-        !info->attrs[HWSIM_ATTR_FLAGS] ||
-        !info->attrs[HWSIM_ATTR_COOKIE] ||
-        !info->attrs[HWSIM_ATTR_SIGNAL] ||
-        !info->attrs[HWSIM_ATTR_TX_INFO])
-        goto out;
+        hwsim_pending_purge(data);
+    }
+    rcu_read_unlock();
+}
 
-    src = (void *)nla_data(info->attrs[HWSIM_ATTR_ADDR_TRANSMITTER]);
-    hwsim_flags = nla_get_u32(info->attrs[HWSIM_ATTR_FLAGS]);
-    ret_skb_cookie = nla_get_u64(info->attrs[HWSIM_ATTR_COOKIE]);
+static int hwsim_register_wmediumd(struct net *net, u32 shard, u32 nr_shards,
+                                   u32 portid, u32 flags)
+{
+    struct hwsim_net *hwsim_net = net_generic(net, hwsim_net_id);
+    int err = -EBUSY;
+    u32 i;
 
-    data2 = get_hwsim_data_ref_from_addr(src);
-    if (!data2)
+    spin_lock_bh(&hwsim_radio_lock);
+    if (hwsim_net->medium_ring)
         goto out;
 
-    if (!hwsim_virtio_enabled) {
-        if (hwsim_net_get_netgroup(genl_info_net(info)) !=
-            data2->netgroup)
+    if (hwsim_net->nr_shards) {
+        /* only another shard of the same split may join */
+        if (!(flags & HWSIM_REGISTER_F_SHARD) ||
+            nr_shards != hwsim_net->nr_shards ||
+            hwsim_net->shards[shard].portid)
             goto out;
 
-        if (info->snd_portid != data2->wmediumd)
-            goto out;
+        for (i = 0; i < hwsim_net->nr_shards; i++)
+            if (hwsim_net->shards[i].portid == portid)
+                goto out;
     }
 
-    /* look for the skb matching the cookie passed back from user */
-    spin_lock_irqsave(&data2->pending.lock, flags);
-    skb_queue_walk_safe(&data2->pending, skb, tmp) {
-        uintptr_t skb_cookie;
+    WRITE_ONCE(hwsim_net->shards[shard].flags, flags);
+    WRITE_ONCE(hwsim_net->shards[shard].portid, portid);
+    WRITE_ONCE(hwsim_net->nr_shards, nr_shards);
+    hwsim_update_shard(hwsim_net, shard);
+    err = 0;
+out:
+    spin_unlock_bh(&hwsim_radio_lock);
+    return err;
+}
+
+/* drop @portid from the wmediumds of @net, returns whether it was one */
+static bool hwsim_unregister_wmediumd(struct net *net, u32 portid)
+{
+    struct hwsim_net *hwsim_net = net_generic(net, hwsim_net_id);
+    bool found = false, left = false;
+    u32 i;
 
-        txi = IEEE80211_SKB_CB(skb);
-        skb_cookie = (uintptr_t)txi->rate_driver_data[0];
+    if (!portid)
+        return false;
 
-        if (skb_cookie == ret_skb_cookie) {
-            __skb_unlink(skb, &data2->pending);
-            found = true;
-            break;
+    spin_lock_bh(&hwsim_radio_lock);
+    for (i = 0; i < hwsim_net->nr_shards; i++) {
+        if (hwsim_net->shards[i].portid != portid) {
+            left |= !!hwsim_net->shards[i].portid;
+            continue;
         }
+
+        WRITE_ONCE(hwsim_net->shards[i].portid, 0);
+        WRITE_ONCE(hwsim_net->shards[i].flags, 0);
+        hwsim_update_shard(hwsim_net, i);
+        found = true;
     }
-    spin_unlock_irqrestore(&data2->pending.lock, flags);
+    if (!left)
+        WRITE_ONCE(hwsim_net->nr_shards, 0);
+    spin_unlock_bh(&hwsim_radio_lock);
 
-    /* not found */
-    if (!found)
-        goto out;
+    /* nothing will report the status of frames sent so far */
+    if (found) {
+        synchronize_rcu();
+        hwsim_netgroup_pending_purge(hwsim_net->netgroup, true);
+    }
 
-    /* Tx info received because the frame was broadcasted on user space,
-	 so we get all the necessary info: tx attempts and skb control buff */
+    return found;
+}
 
-    tx_attempts = (struct hwsim_tx_rate *)nla_data(
-            info->attrs[HWSIM_ATTR_TX_INFO]);
+/* radio @src, if the medium that sent @info may report on its frames */
+static struct wifi_hwsim_data *hwsim_tx_info_radio(struct genl_info *info,
+                                                   const u8 *src)
+{
+    struct wifi_hwsim_data *data2;
+
+    data2 = get_hwsim_data_ref_from_addr(src);
+    if (!data2)
+        return NULL;
+
+    if (!hwsim_virtio_enabled) {
+        if (hwsim_net_get_netgroup(genl_info_net(info)) !=
+            data2->netgroup)
+            return NULL;
 
-    /* now send back TX status */
-    txi = IEEE80211_SKB_CB(skb);
+        if (info->snd_portid != data2->wmediumd)
+            return NULL;
+    }
+
+    return data2;
+}
+
+/* Tx info received because the frame was broadcasted on user space,
+ so we get all the necessary info: tx attempts and skb control buff */
+static void hwsim_tx_status_fill(struct sk_buff *skb,
+                                 unsigned int hwsim_flags, int signal,
+                                 const struct hwsim_tx_rate *tx_attempts)
+{
+    struct ieee80211_tx_info *txi = IEEE80211_SKB_CB(skb);
+    int i;
 
     ieee80211_tx_info_clear_status(txi);
 
@@ -4238,132 +5966,324 @@ static int hwsim_tx_info_frame_received_nl(struct sk_buff *skb_2,
         txi->status.rates[i].count = tx_attempts[i].count;
     }
 
-    txi->status.ack_signal = nla_get_u32(info->attrs[HWSIM_ATTR_SIGNAL]);
+    txi->status.ack_signal = signal;
 
     if (!(hwsim_flags & HWSIM_TX_CTL_NO_ACK) &&
-        (hwsim_flags & HWSIM_TX_STAT_ACK)) {
-        if (skb->len >= 16) {
-            hdr = (struct ieee80211_hdr *) skb->data;
-            wifi_hwsim_monitor_ack(data2->channel,
-                                       hdr->addr2);
-        }
+        (hwsim_flags & HWSIM_TX_STAT_ACK))
         txi->flags |= IEEE80211_TX_STAT_ACK;
-    }
 
     if (hwsim_flags & HWSIM_TX_CTL_NO_ACK)
         txi->flags |= IEEE80211_TX_STAT_NOACK_TRANSMITTED;
-
-    ieee80211_tx_status_irqsafe(data2->hw, skb);
-    return 0;
-    out:
-    return -EINVAL;
-
 }
 
-static int hwsim_cloned_frame_received_nl(struct sk_buff *skb_2,
-                                          struct genl_info *info)
+/* now send back TX status */
+static void hwsim_tx_status_report(struct wifi_hwsim_data *data2,
+                                   struct sk_buff *skb)
 {
-    struct wifi_hwsim_data *data2;
-    struct ieee80211_rx_status rx_status;
+    struct ieee80211_tx_info *txi = IEEE80211_SKB_CB(skb);
     struct ieee80211_hdr *hdr;
-    const u8 *dst;
-    int frame_data_len;
-    void *frame_data;
-    struct sk_buff *skb = NULL;
-    struct ieee80211_channel *channel = NULL;
 
-    if (!info->attrs[HWSIM_ATTR_ADDR_RECEIVER] ||
-        !info->attrs[HWSIM_ATTR_FRAME] ||
-        !info->attrs[HWSIM_ATTR_RX_RATE] ||
-        !info->attrs[HWSIM_ATTR_SIGNAL])
-        goto out;
+    if (txi->flags & IEEE80211_TX_STAT_ACK && skb->len >= 16) {
+        hdr = (struct ieee80211_hdr *) skb->data;
+        wifi_hwsim_monitor_ack(data2, data2->channel,
+                                   hdr->addr2);
+    }
 
-    dst = (void *)nla_data(info->attrs[HWSIM_ATTR_ADDR_RECEIVER]);
-    frame_data_len = nla_len(info->attrs[HWSIM_ATTR_FRAME]);
-    frame_data = (void *)nla_data(info->attrs[HWSIM_ATTR_FRAME]);
+    hwsim_tx_airtime_report(data2, skb);
+    ieee80211_tx_status_irqsafe(data2->hw, skb);
+}
 
-    /* Allocate new skb here */
-    skb = alloc_skb(frame_data_len, GFP_KERNEL);
-    if (skb == NULL)
-        goto err;
+static int hwsim_tx_info_frame_received_nl(struct sk_buff *skb_2,
+                                           struct genl_info *info)
+{
 
-    if (frame_data_len > IEEE80211_MAX_DATA_LEN)
-        goto err;
+    struct wifi_hwsim_data *data2;
+    struct hwsim_tx_rate *tx_attempts;
+    u64 ret_skb_cookie;
+    struct sk_buff *skb;
+    const u8 *src;
+    unsigned int hwsim_flags;
 
-    /* Copy the data */
-    skb_put_data(skb, frame_data, frame_data_len);
+    if (!info->attrs[HWSIM_ATTR_ADDR_TRANSMITTER] ||
+        !info->attrs[HWSIM_ATTR_FLAGS] ||
+        !info->attrs[HWSIM_ATTR_COOKIE] ||
+        !info->attrs[HWSIM_ATTR_SIGNAL] ||
+        !info->attrs[HWSIM_ATTR_TX_INFO])
+        goto out;
 
-    data2 = get_hwsim_data_ref_from_addr(dst);
+    src = (void *)nla_data(info->attrs[HWSIM_ATTR_ADDR_TRANSMITTER]);
+    hwsim_flags = nla_get_u32(info->attrs[HWSIM_ATTR_FLAGS]);
+    ret_skb_cookie = nla_get_u64(info->attrs[HWSIM_ATTR_COOKIE]);
+
+    rcu_read_lock();
+    data2 = hwsim_tx_info_radio(info, src);
     if (!data2)
-        goto out;
+        goto out_unlock;
 
-    if (data2->use_chanctx) {
-        if (data2->tmp_chan)
-            channel = data2->tmp_chan;
-        else if (data2->chanctx)
-            channel = data2->chanctx->def.chan;
-    } else {
-        channel = data2->channel;
-    }
-    if (!channel)
-        goto out;
+    /* look for the skb matching the cookie passed back from user */
+    skb = hwsim_pending_take(data2, ret_skb_cookie);
+    if (!skb)
+        goto out_unlock;
 
-    if (!hwsim_virtio_enabled) {
-        if (hwsim_net_get_netgroup(genl_info_net(info)) !=
-            data2->netgroup)
-            goto out;
+    tx_attempts = (struct hwsim_tx_rate *)nla_data(
+            info->attrs[HWSIM_ATTR_TX_INFO]);
 
-        if (info->snd_portid != data2->wmediumd)
-            goto out;
+    hwsim_tx_status_fill(skb, hwsim_flags,
+                         nla_get_u32(info->attrs[HWSIM_ATTR_SIGNAL]),
+                         tx_attempts);
+    hwsim_tx_status_report(data2, skb);
+    rcu_read_unlock();
+    return 0;
+    out_unlock:
+    rcu_read_unlock();
+    out:
+    return -EINVAL;
+
+}
+
+/*
+ * Adjacent records of the same transmitter are resolved under a single
+ * pending.lock section; the statuses are reported once the lock is dropped.
+ * Records of unknown radios or cookies are skipped.
+ */
+static int hwsim_tx_info_batch_received_nl(struct sk_buff *skb_2,
+                                           struct genl_info *info)
+{
+    const struct hwsim_tx_info_record *rec;
+    struct wifi_hwsim_data *data2;
+    struct sk_buff_head done;
+    struct sk_buff *skb;
+    unsigned long flags;
+    int n, i, j, k;
+
+    if (!info->attrs[HWSIM_ATTR_TX_INFO_BATCH])
+        return -EINVAL;
+
+    n = nla_len(info->attrs[HWSIM_ATTR_TX_INFO_BATCH]);
+    if (n % sizeof(*rec))
+        return -EINVAL;
+    n /= sizeof(*rec);
+    rec = nla_data(info->attrs[HWSIM_ATTR_TX_INFO_BATCH]);
+
+    __skb_queue_head_init(&done);
+
+    rcu_read_lock();
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n; j++)
+            if (!ether_addr_equal(rec[j].transmitter, rec[i].transmitter))
+                break;
+
+        data2 = hwsim_tx_info_radio(info, rec[i].transmitter);
+        if (!data2)
+            continue;
+
+        spin_lock_irqsave(&data2->pending.lock, flags);
+        for (k = i; k < j; k++) {
+            skb = __hwsim_pending_take(data2, rec[k].cookie);
+            if (!skb)
+                continue;
+
+            hwsim_tx_status_fill(skb, rec[k].flags, rec[k].signal,
+                                 rec[k].tx_attempts);
+            __skb_queue_tail(&done, skb);
+        }
+        spin_unlock_irqrestore(&data2->pending.lock, flags);
+
+        while ((skb = __skb_dequeue(&done)))
+            hwsim_tx_status_report(data2, skb);
     }
+    rcu_read_unlock();
+
+    return 0;
+}
+
+/*
+ * The channel of @data2 a frame sent on @freq is received on: @channel, the
+ * one the radio is on, or any other its channel contexts are active on.
+ */
+static struct ieee80211_channel *
+hwsim_medium_rx_chan(struct wifi_hwsim_data *data2,
+                     const struct hwsim_rf_state *rf,
+                     struct ieee80211_channel *channel, u32 freq)
+{
+    struct ieee80211_channel *chan;
+    int idx;
+
+    if (channel->center_freq == freq)
+        return channel;
+
+    if (!data2->use_chanctx)
+        return NULL;
+
+    chan = ieee80211_get_channel(data2->hw->wiphy, freq);
+    idx = hwsim_chan_idx(data2, chan);
+    if (idx < 0 || !test_bit(idx, rf->active_chans))
+        return NULL;
+
+    return chan;
+}
+
+/*
+ * Deliver the @len bytes at @frame, a frame the medium forwards to @data2, if
+ * the radio can receive it. @freq is the frequency it was sent on, or 0 if
+ * unknown. Everything is checked before the RX skb is built: its head comes
+ * from the per-CPU NAPI cache and the frame is copied once into its page
+ * fragment. Called under rcu_read_lock(), taken before @data2 was looked up
+ * and held until the frame is queued to its NAPI, so that the radio cannot
+ * be deleted meanwhile.
+ */
+static int hwsim_medium_rx(struct wifi_hwsim_data *data2, const void *frame,
+                           unsigned int len, u32 freq, u32 rate_idx,
+                           int signal)
+{
+    const struct ieee80211_hdr *hdr = frame;
+    struct ieee80211_rx_status rx_status;
+    struct ieee80211_channel *channel = NULL;
+    const struct hwsim_rf_state *rf;
+    struct sk_buff *skb;
+
+    /* at least a frame control field, duration and addr1 */
+    if (len < 10 || len > IEEE80211_MAX_DATA_LEN)
+        return -EINVAL;
+
+    rf = rcu_dereference(data2->rf);
+    if (!rf)
+        return -EINVAL;
+
+    if (data2->use_chanctx)
+        channel = rf->tmp_chan ?: rf->chanctx_chan;
+    else
+        channel = rf->channel;
+    if (!channel)
+        return -EINVAL;
 
     /* check if radio is configured properly */
 
-    if ((data2->idle && !data2->tmp_chan) || !data2->started)
-        goto out;
+    if ((rf->idle && !rf->tmp_chan) || !rf->started)
+        return -EINVAL;
 
     /* A frame is received from user space */
     memset(&rx_status, 0, sizeof(rx_status));
-    if (info->attrs[HWSIM_ATTR_FREQ]) {
+    if (freq) {
         /* throw away off-channel packets, but allow both the temporary
-		 * ("hw" scan/remain-on-channel) and regular channel, since the
-		 * internal datapath also allows this
+		 * ("hw" scan/remain-on-channel) and every active channel, since
+		 * the internal datapath also allows this
 		 */
-        mutex_lock(&data2->mutex);
-        rx_status.freq = nla_get_u32(info->attrs[HWSIM_ATTR_FREQ]);
-
-        if (rx_status.freq != channel->center_freq) {
-            mutex_unlock(&data2->mutex);
-            goto out;
+        rx_status.freq = freq;
+        channel = hwsim_medium_rx_chan(data2, rf, channel, freq);
+        if (!channel) {
+            hwsim_stats_inc(data2, HWSIM_STAT_RX_OFFCHAN_DROPPED);
+            return -EINVAL;
         }
-        mutex_unlock(&data2->mutex);
     } else {
         rx_status.freq = channel->center_freq;
     }
 
     rx_status.band = channel->band;
-    rx_status.rate_idx = nla_get_u32(info->attrs[HWSIM_ATTR_RX_RATE]);
+    rx_status.rate_idx = rate_idx;
     if (rx_status.rate_idx >= data2->hw->wiphy->bands[rx_status.band]->n_bitrates)
-        goto out;
-    rx_status.signal = nla_get_u32(info->attrs[HWSIM_ATTR_SIGNAL]);
-
-    hdr = (void *)skb->data;
+        return -EINVAL;
+    rx_status.signal = signal;
 
     if (ieee80211_is_beacon(hdr->frame_control) ||
         ieee80211_is_probe_resp(hdr->frame_control))
         rx_status.boottime_ns = ktime_get_boottime_ns();
 
+    /* no point in building a frame the receiver has no room for */
+    if (skb_queue_len(&data2->rx_queue) >= HWSIM_RX_QUEUE_LEN) {
+        hwsim_stats_inc(data2, HWSIM_STAT_RX_QUEUE_DROPPED);
+        return -ENOBUFS;
+    }
+
+    local_bh_disable();
+    skb = napi_alloc_skb(&data2->napi, len);
+    if (!skb) {
+        local_bh_enable();
+        return -ENOMEM;
+    }
+    skb_put_data(skb, frame, len);
+
     memcpy(IEEE80211_SKB_RXCB(skb), &rx_status, sizeof(rx_status));
-    data2->rx_pkts++;
-    data2->rx_bytes += skb->len;
-    ieee80211_rx_irqsafe(data2->hw, skb);
+    hwsim_stats_inc(data2, HWSIM_STAT_RX_PKTS);
+    hwsim_stats_add(data2, HWSIM_STAT_RX_BYTES, len);
+    hwsim_rx_deliver(data2, skb);
+    local_bh_enable();
 
     return 0;
-    err:
-    pr_debug("aprf_drv: error occurred in %s\n", __func__);
+}
+
+static int hwsim_cloned_frame_received_nl(struct sk_buff *skb_2,
+                                          struct genl_info *info)
+{
+    struct wifi_hwsim_data *data2;
+    const u8 *dst;
+    u32 freq = 0;
+    int ret = -EINVAL;
+
+    if (!info->attrs[HWSIM_ATTR_ADDR_RECEIVER] ||
+        !info->attrs[HWSIM_ATTR_FRAME] ||
+        !info->attrs[HWSIM_ATTR_RX_RATE] ||
+        !info->attrs[HWSIM_ATTR_SIGNAL])
+        return -EINVAL;
+
+    dst = (void *)nla_data(info->attrs[HWSIM_ATTR_ADDR_RECEIVER]);
+
+    if (info->attrs[HWSIM_ATTR_FREQ])
+        freq = nla_get_u32(info->attrs[HWSIM_ATTR_FREQ]);
+
+    /* the virtio RX work is not serialized against radio deletion */
+    rcu_read_lock();
+    data2 = get_hwsim_data_ref_from_addr(dst);
+    if (!data2)
+        goto out;
+
+    if (!hwsim_virtio_enabled) {
+        if (hwsim_net_get_netgroup(genl_info_net(info)) !=
+            data2->netgroup)
+            goto out;
+
+        /* any shard may hand frames to any radio of the netgroup */
+        if (!hwsim_net_is_wmediumd(genl_info_net(info), info->snd_portid))
+            goto out;
+    }
+
+    ret = hwsim_medium_rx(data2, nla_data(info->attrs[HWSIM_ATTR_FRAME]),
+                          nla_len(info->attrs[HWSIM_ATTR_FRAME]), freq,
+                          nla_get_u32(info->attrs[HWSIM_ATTR_RX_RATE]),
+                          nla_get_u32(info->attrs[HWSIM_ATTR_SIGNAL]));
     out:
-    dev_kfree_skb(skb);
-    return -EINVAL;
+    rcu_read_unlock();
+    return ret;
+}
+
+/*
+ * Every frame of the batch is handled as if it came in its own HWSIM_CMD_FRAME
+ * message. A frame that is rejected is dropped without affecting the others.
+ */
+static int hwsim_frame_batch_received_nl(struct sk_buff *skb_2,
+                                         struct genl_info *info)
+{
+    struct nlattr *tb[HWSIM_ATTR_MAX + 1];
+    struct genl_info frame_info;
+    struct nlattr *nla;
+    int rem, err;
+
+    if (!info->attrs[HWSIM_ATTR_FRAMES])
+        return -EINVAL;
+
+    frame_info = *info;
+    frame_info.attrs = tb;
+
+    nla_for_each_nested(nla, info->attrs[HWSIM_ATTR_FRAMES], rem) {
+        err = nla_parse_nested_deprecated(tb, HWSIM_ATTR_MAX, nla,
+                                          hwsim_genl_policy, NULL);
+        if (err)
+            return err;
+
+        hwsim_cloned_frame_received_nl(skb_2, &frame_info);
+    }
+
+    return 0;
 }
 
 static int hwsim_register_received_nl(struct sk_buff *skb_2,
@@ -4371,31 +6291,414 @@ static int hwsim_register_received_nl(struct sk_buff *skb_2,
 {
     struct net *net = genl_info_net(info);
     struct wifi_hwsim_data *data;
+    u32 shard = 0, nr_shards = 1;
     int chans = 1;
+    u32 flags = 0;
+    int err;
 
-    spin_lock_bh(&hwsim_radio_lock);
-    list_for_each_entry(data, &hwsim_radios, list)
+    if (info->attrs[HWSIM_ATTR_REGISTER_FLAGS])
+        flags = nla_get_u32(info->attrs[HWSIM_ATTR_REGISTER_FLAGS]);
+
+    if (flags & ~HWSIM_REGISTER_F_ALL)
+        return -EOPNOTSUPP;
+
+    if (flags & HWSIM_REGISTER_F_SHARD) {
+        if (!info->attrs[HWSIM_ATTR_SHARD_ID] ||
+            !info->attrs[HWSIM_ATTR_SHARD_COUNT]) {
+            GENL_SET_ERR_MSG(info, "shard id and count are required");
+            return -EINVAL;
+        }
+
+        shard = nla_get_u32(info->attrs[HWSIM_ATTR_SHARD_ID]);
+        nr_shards = nla_get_u32(info->attrs[HWSIM_ATTR_SHARD_COUNT]);
+        if (!nr_shards || nr_shards > HWSIM_MAX_SHARDS ||
+            shard >= nr_shards) {
+            GENL_SET_ERR_MSG(info, "invalid shard id or count");
+            return -EINVAL;
+        }
+    }
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(data, &hwsim_radios, list)
             chans = max(chans, data->channels);
-    spin_unlock_bh(&hwsim_radio_lock);
+    rcu_read_unlock();
 
-    /* In the future we should revise the userspace API and allow it
-	 * to set a flag that it does support multi-channel, then we can
-	 * let this pass conditionally on the flag.
-	 * For current userspace, prohibit it since it won't work right.
+    /* Only a medium that declares it handles multi-channel radios gets
+	 * the channel definition of every frame, prohibit it for the others
+	 * since it won't work right.
 	 */
+    if (chans > 1 && !(flags & HWSIM_REGISTER_F_MULTI_CHANNEL))
+        return -EOPNOTSUPP;
+
+    err = hwsim_register_wmediumd(net, shard, nr_shards, info->snd_portid,
+                                  flags);
+    if (err)
+        return err;
+
+    pr_debug("aprf_drv: received a REGISTER, "
+             "switching to eltex_wmediumd mode with pid %d (shard %u/%u)\n",
+             info->snd_portid, shard, nr_shards);
+
+    return 0;
+}
+
+/* shared memory medium transport, see the DOC section in the header */
+
+/* largest mapping a medium may set up */
+#define HWSIM_RING_MAX_SIZE (256 << 20)
+
+/* point @net and its radios at @ring, under hwsim_radio_lock */
+static void hwsim_set_medium_ring(struct net *net, struct hwsim_ring *ring)
+{
+    struct wifi_hwsim_data *data;
+
+    hwsim_net_set_medium_ring(net, ring);
+    list_for_each_entry(data, &hwsim_radios, list) {
+        if (data->netgroup == hwsim_net_get_netgroup(net))
+            rcu_assign_pointer(data->medium_ring, ring);
+    }
+}
+
+/*
+ * Checked and set under hwsim_radio_lock, like hwsim_register_wmediumd(), so
+ * that neither a netlink medium nor another ioctl on the same ring can slip in.
+ */
+static int hwsim_register_medium_ring(struct net *net, struct hwsim_ring *ring)
+{
+    int err = 0;
+
+    spin_lock_bh(&hwsim_radio_lock);
+    if (ring->registered) {
+        err = -EALREADY;
+        goto out;
+    }
+
+    if (hwsim_net_has_wmediumd(net) || hwsim_net_get_medium_ring(net)) {
+        err = -EBUSY;
+        goto out;
+    }
+
+    hwsim_set_medium_ring(net, ring);
+    WRITE_ONCE(ring->registered, true);
+out:
+    spin_unlock_bh(&hwsim_radio_lock);
+    return err;
+}
+
+static void hwsim_unregister_medium_ring(struct net *net)
+{
+    spin_lock_bh(&hwsim_radio_lock);
+    hwsim_set_medium_ring(net, NULL);
+    spin_unlock_bh(&hwsim_radio_lock);
+}
+
+static int hwsim_ring_register(struct hwsim_ring *ring)
+{
+    struct net *net = ring->net;
+    struct wifi_hwsim_data *data;
+    int chans = 1, err;
+
+    if (!ns_capable(net->user_ns, CAP_NET_ADMIN))
+        return -EPERM;
+
+    if (!ring->area)
+        return -EINVAL;
+
+    if (READ_ONCE(ring->registered))
+        return -EALREADY;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(data, &hwsim_radios, list)
+            chans = max(chans, data->channels);
+    rcu_read_unlock();
+
+    /* ring descriptors carry no channel definition, single channel only */
     if (chans > 1)
         return -EOPNOTSUPP;
 
-    if (hwsim_net_get_wmediumd(net))
+    err = hwsim_register_medium_ring(net, ring);
+    if (err)
+        return err;
+
+    pr_debug("aprf_drv: shared memory medium registered\n");
+
+    return 0;
+}
+
+static int hwsim_ring_setup(struct hwsim_ring *ring, void __user *arg)
+{
+    struct hwsim_ring_setup setup;
+    unsigned long desc_len, ring_len;
+
+    if (copy_from_user(&setup, arg, sizeof(setup)))
+        return -EFAULT;
+
+    if (ring->area)
         return -EBUSY;
 
-    hwsim_register_wmediumd(net, info->snd_portid);
+    if (!setup.entries || !is_power_of_2(setup.entries) ||
+        setup.entries > 4096)
+        return -EINVAL;
 
-    pr_debug("aprf_drv: received a REGISTER, "
-             "switching to eltex_wmediumd mode with pid %d\n", info->snd_portid);
+    if (setup.frame_size < 256 || setup.frame_size > 65536)
+        return -EINVAL;
+    setup.frame_size = ALIGN(setup.frame_size, SMP_CACHE_BYTES);
+
+    desc_len = PAGE_ALIGN(sizeof(struct hwsim_ring_hdr) +
+                          setup.entries * sizeof(struct hwsim_ring_desc));
+    ring_len = desc_len + PAGE_ALIGN((unsigned long)setup.entries *
+                                     setup.frame_size);
+    if (2 * ring_len > HWSIM_RING_MAX_SIZE)
+        return -EINVAL;
+
+    ring->area = vmalloc_user(2 * ring_len);
+    if (!ring->area)
+        return -ENOMEM;
+
+    ring->size = 2 * ring_len;
+    ring->entries = setup.entries;
+    ring->frame_size = setup.frame_size;
+
+    ring->tx_hdr = ring->area;
+    ring->tx_desc = (void *)(ring->tx_hdr + 1);
+    ring->tx_frames = ring->area + desc_len;
+
+    ring->rx_hdr = ring->area + ring_len;
+    ring->rx_desc = (void *)(ring->rx_hdr + 1);
+    ring->rx_frames = ring->area + ring_len + desc_len;
+
+    setup.tx_off = 0;
+    setup.rx_off = ring_len;
+    setup.size = ring->size;
+
+    if (copy_to_user(arg, &setup, sizeof(setup)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static int hwsim_ring_set_eventfd(struct hwsim_ring *ring, int __user *arg)
+{
+    struct eventfd_ctx *ctx = NULL;
+    int fd;
+
+    if (get_user(fd, arg))
+        return -EFAULT;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    /* the TX path signals the context under tx_lock */
+    spin_lock_bh(&ring->tx_lock);
+    swap(ring->eventfd, ctx);
+    spin_unlock_bh(&ring->tx_lock);
+
+    if (ctx)
+        eventfd_ctx_put(ctx);
+
+    return 0;
+}
+
+/* radio @addr, if @ring is the medium responsible for it */
+static struct wifi_hwsim_data *hwsim_ring_radio(struct hwsim_ring *ring,
+                                                const u8 *addr)
+{
+    struct wifi_hwsim_data *data2;
+
+    data2 = get_hwsim_data_ref_from_addr(addr);
+    if (!data2 || rcu_access_pointer(data2->medium_ring) != ring)
+        return NULL;
+
+    return data2;
+}
+
+static void hwsim_ring_rx_desc(struct hwsim_ring *ring,
+                               const struct hwsim_ring_desc *desc,
+                               const u8 *frame)
+{
+    struct wifi_hwsim_data *data2;
+    struct sk_buff *skb;
+
+    switch (desc->type) {
+        case HWSIM_RING_FRAME:
+            if (desc->len > ring->frame_size)
+                return;
+
+            /* held until delivery, the ring is not serialized against
+             * radio deletion
+             */
+            rcu_read_lock();
+            data2 = hwsim_ring_radio(ring, desc->addr);
+            if (data2)
+                hwsim_medium_rx(data2, frame, desc->len, desc->freq,
+                                desc->rx_rate, desc->signal);
+            rcu_read_unlock();
+            break;
+        case HWSIM_RING_TX_INFO:
+            rcu_read_lock();
+            data2 = hwsim_ring_radio(ring, desc->addr);
+            skb = data2 ? hwsim_pending_take(data2, desc->cookie) : NULL;
+            if (skb) {
+                hwsim_tx_status_fill(skb, desc->flags, desc->signal,
+                                     desc->tx_attempts);
+                hwsim_tx_status_report(data2, skb);
+            }
+            rcu_read_unlock();
+            break;
+    }
+}
+
+/* consume everything the medium has put on the RX ring so far */
+static int hwsim_ring_rx(struct hwsim_ring *ring)
+{
+    struct hwsim_ring_desc desc;
+    u32 prod, idx;
+    int n = 0;
+
+    if (!ring->registered)
+        return -EINVAL;
+
+    prod = smp_load_acquire(&ring->rx_hdr->producer);
+    if (prod - ring->rx_cons > ring->entries)
+        return -EINVAL;
+
+    while (ring->rx_cons != prod) {
+        idx = ring->rx_cons & (ring->entries - 1);
+        /* the medium may still write to it, work on a stable copy */
+        memcpy(&desc, &ring->rx_desc[idx], sizeof(desc));
+        hwsim_ring_rx_desc(ring, &desc,
+                           ring->rx_frames + idx * ring->frame_size);
+
+        smp_store_release(&ring->rx_hdr->consumer, ++ring->rx_cons);
+        n++;
+        cond_resched();
+    }
+
+    return n;
+}
+
+static long hwsim_ring_ioctl(struct file *file, unsigned int cmd,
+                             unsigned long arg)
+{
+    struct hwsim_ring *ring = file->private_data;
+    long ret;
+
+    mutex_lock(&ring->mutex);
+    switch (cmd) {
+        case HWSIM_RING_SETUP:
+            ret = hwsim_ring_setup(ring, (void __user *)arg);
+            break;
+        case HWSIM_RING_REGISTER:
+            ret = hwsim_ring_register(ring);
+            break;
+        case HWSIM_RING_KICK:
+            ret = hwsim_ring_rx(ring);
+            break;
+        case HWSIM_RING_SET_EVENTFD:
+            ret = hwsim_ring_set_eventfd(ring, (int __user *)arg);
+            break;
+        default:
+            ret = -ENOTTY;
+            break;
+    }
+    mutex_unlock(&ring->mutex);
+
+    return ret;
+}
+
+static __poll_t hwsim_ring_poll(struct file *file, poll_table *wait)
+{
+    struct hwsim_ring *ring = file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &ring->wait, wait);
+
+    if (!READ_ONCE(ring->registered))
+        return 0;
+
+    if (READ_ONCE(ring->tx_prod) != READ_ONCE(ring->tx_hdr->consumer))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (READ_ONCE(ring->rx_hdr->producer) - READ_ONCE(ring->rx_cons) <
+        ring->entries)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+
+    return mask;
+}
+
+static int hwsim_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct hwsim_ring *ring = file->private_data;
+    int err;
+
+    mutex_lock(&ring->mutex);
+    if (ring->area)
+        err = remap_vmalloc_range(vma, ring->area, vma->vm_pgoff);
+    else
+        err = -EINVAL;
+    mutex_unlock(&ring->mutex);
+
+    return err;
+}
+
+static int hwsim_ring_open(struct inode *inode, struct file *file)
+{
+    struct hwsim_ring *ring;
+
+    ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    ring->net = get_net(current->nsproxy->net_ns);
+    mutex_init(&ring->mutex);
+    spin_lock_init(&ring->tx_lock);
+    init_waitqueue_head(&ring->wait);
+    file->private_data = ring;
+
+    return stream_open(inode, file);
+}
+
+static int hwsim_ring_release(struct inode *inode, struct file *file)
+{
+    struct hwsim_ring *ring = file->private_data;
+
+    if (ring->registered) {
+        hwsim_unregister_medium_ring(ring->net);
+        synchronize_rcu();
+        /* nothing will report the status of frames put on the ring */
+        hwsim_netgroup_pending_purge(hwsim_net_get_netgroup(ring->net),
+                                     false);
+        pr_debug("aprf_drv: shared memory medium released\n");
+    }
+
+    if (ring->eventfd)
+        eventfd_ctx_put(ring->eventfd);
+    vfree(ring->area);
+    put_net(ring->net);
+    kfree(ring);
+
+    return 0;
+}
+
+static const struct file_operations hwsim_ring_fops = {
+        .owner = THIS_MODULE,
+        .open = hwsim_ring_open,
+        .release = hwsim_ring_release,
+        .unlocked_ioctl = hwsim_ring_ioctl,
+        .compat_ioctl = compat_ptr_ioctl,
+        .poll = hwsim_ring_poll,
+        .mmap = hwsim_ring_mmap,
+        .llseek = no_llseek,
+};
 
-    return 0;
-}
+static struct miscdevice hwsim_ring_misc = {
+        .minor = MISC_DYNAMIC_MINOR,
+        .name = "aprf_medium",
+        .fops = &hwsim_ring_fops,
+        .mode = 0600,
+};
 
 /* ensures ciphers only include ciphers listed in 'hwsim_ciphers' array */
 static bool hwsim_known_ciphers(const u32 *ciphers, int n_ciphers)
@@ -4420,36 +6723,55 @@ static bool hwsim_known_ciphers(const u32 *ciphers, int n_ciphers)
     return true;
 }
 
-static int hwsim_new_radio_nl(struct sk_buff *msg, struct genl_info *info)
+/* fill @param from the attributes of a HWSIM_CMD_NEW_RADIO, except the name */
+static int hwsim_new_radio_parse(struct genl_info *info,
+                                 struct hwsim_new_radio_params *param)
 {
-    struct hwsim_new_radio_params param = { 0 };
-    const char *hwname = NULL;
-    int ret;
-
-    param.reg_strict = info->attrs[HWSIM_ATTR_REG_STRICT_REG];
-    param.p2p_device = info->attrs[HWSIM_ATTR_SUPPORT_P2P_DEVICE];
-    param.channels = channels;
-    param.destroy_on_close =
+    param->reg_strict = info->attrs[HWSIM_ATTR_REG_STRICT_REG];
+    param->p2p_device = info->attrs[HWSIM_ATTR_SUPPORT_P2P_DEVICE];
+    param->channels = channels;
+    param->destroy_on_close =
             info->attrs[HWSIM_ATTR_DESTROY_RADIO_ON_CLOSE];
 
     if (info->attrs[HWSIM_ATTR_CHANNELS])
-        param.channels = nla_get_u32(info->attrs[HWSIM_ATTR_CHANNELS]);
+        param->channels = nla_get_u32(info->attrs[HWSIM_ATTR_CHANNELS]);
 
-    if (param.channels < 1) {
+    if (param->channels < 1) {
         GENL_SET_ERR_MSG(info, "must have at least one channel");
         return -EINVAL;
     }
 
     if (info->attrs[HWSIM_ATTR_NO_VIF])
-        param.no_vif = true;
+        param->no_vif = true;
 
     if (info->attrs[HWSIM_ATTR_USE_CHANCTX])
-        param.use_chanctx = true;
+        param->use_chanctx = true;
     else
-        param.use_chanctx = (param.channels > 1);
+        param->use_chanctx = (param->channels > 1);
+
+    if (info->attrs[HWSIM_ATTR_USE_TXQ])
+        param->use_txq = true;
+
+    param->tx_queue_high = MAX_QUEUE;
+    if (info->attrs[HWSIM_ATTR_TX_QUEUE_HIGH])
+        param->tx_queue_high =
+                nla_get_u32(info->attrs[HWSIM_ATTR_TX_QUEUE_HIGH]);
+
+    param->tx_queue_low = min_t(u32, WARN_QUEUE, param->tx_queue_high / 2);
+    if (info->attrs[HWSIM_ATTR_TX_QUEUE_LOW])
+        param->tx_queue_low =
+                nla_get_u32(info->attrs[HWSIM_ATTR_TX_QUEUE_LOW]);
+
+    if (!param->tx_queue_high || param->tx_queue_low >= param->tx_queue_high) {
+        GENL_SET_ERR_MSG(info, "TX queue low watermark must be below the high one");
+        return -EINVAL;
+    }
+
+    if (info->attrs[HWSIM_ATTR_TX_BACKPRESSURE])
+        param->tx_backpressure = true;
 
     if (info->attrs[HWSIM_ATTR_REG_HINT_ALPHA2])
-        param.reg_alpha2 =
+        param->reg_alpha2 =
                 nla_data(info->attrs[HWSIM_ATTR_REG_HINT_ALPHA2]);
 
     if (info->attrs[HWSIM_ATTR_REG_CUSTOM_REG]) {
@@ -4460,7 +6782,7 @@ static int hwsim_new_radio_nl(struct sk_buff *msg, struct genl_info *info)
 
         idx = array_index_nospec(idx,
                                  ARRAY_SIZE(hwsim_world_regdom_custom));
-        param.regd = hwsim_world_regdom_custom[idx];
+        param->regd = hwsim_world_regdom_custom[idx];
     }
 
     if (info->attrs[HWSIM_ATTR_PERM_ADDR]) {
@@ -4472,34 +6794,34 @@ static int hwsim_new_radio_nl(struct sk_buff *msg, struct genl_info *info)
             return -EINVAL;
         }
 
-        param.perm_addr = nla_data(info->attrs[HWSIM_ATTR_PERM_ADDR]);
+        param->perm_addr = nla_data(info->attrs[HWSIM_ATTR_PERM_ADDR]);
     }
 
     if (info->attrs[HWSIM_ATTR_IFTYPE_SUPPORT]) {
-        param.iftypes =
+        param->iftypes =
                 nla_get_u32(info->attrs[HWSIM_ATTR_IFTYPE_SUPPORT]);
 
-        if (param.iftypes & ~HWSIM_IFTYPE_SUPPORT_MASK) {
+        if (param->iftypes & ~HWSIM_IFTYPE_SUPPORT_MASK) {
             NL_SET_ERR_MSG_ATTR(genl_info_extack(info),
                                 info->attrs[HWSIM_ATTR_IFTYPE_SUPPORT],
                                 "cannot support more iftypes than kernel");
             return -EINVAL;
         }
     } else {
-        param.iftypes = HWSIM_IFTYPE_SUPPORT_MASK;
+        param->iftypes = HWSIM_IFTYPE_SUPPORT_MASK;
     }
 
     /* ensure both flag and iftype support is honored */
-    if (param.p2p_device ||
-        param.iftypes & BIT(NL80211_IFTYPE_P2P_DEVICE)) {
-        param.iftypes |= BIT(NL80211_IFTYPE_P2P_DEVICE);
-        param.p2p_device = true;
+    if (param->p2p_device ||
+        param->iftypes & BIT(NL80211_IFTYPE_P2P_DEVICE)) {
+        param->iftypes |= BIT(NL80211_IFTYPE_P2P_DEVICE);
+        param->p2p_device = true;
     }
 
     if (info->attrs[HWSIM_ATTR_CIPHER_SUPPORT]) {
         u32 len = nla_len(info->attrs[HWSIM_ATTR_CIPHER_SUPPORT]);
 
-        param.ciphers =
+        param->ciphers =
                 nla_data(info->attrs[HWSIM_ATTR_CIPHER_SUPPORT]);
 
         if (len % sizeof(u32)) {
@@ -4509,16 +6831,16 @@ static int hwsim_new_radio_nl(struct sk_buff *msg, struct genl_info *info)
             return -EINVAL;
         }
 
-        param.n_ciphers = len / sizeof(u32);
+        param->n_ciphers = len / sizeof(u32);
 
-        if (param.n_ciphers > ARRAY_SIZE(hwsim_ciphers)) {
+        if (param->n_ciphers > ARRAY_SIZE(hwsim_ciphers)) {
             NL_SET_ERR_MSG_ATTR(genl_info_extack(info),
                                 info->attrs[HWSIM_ATTR_CIPHER_SUPPORT],
                                 "too many ciphers specified");
             return -EINVAL;
         }
 
-        if (!hwsim_known_ciphers(param.ciphers, param.n_ciphers)) {
+        if (!hwsim_known_ciphers(param->ciphers, param->n_ciphers)) {
             NL_SET_ERR_MSG_ATTR(genl_info_extack(info),
                                 info->attrs[HWSIM_ATTR_CIPHER_SUPPORT],
                                 "unsupported ciphers specified");
@@ -4526,6 +6848,27 @@ static int hwsim_new_radio_nl(struct sk_buff *msg, struct genl_info *info)
         }
     }
 
+    if (info->attrs[HWSIM_ATTR_GROUP]) {
+        param->group = nla_get_u64(info->attrs[HWSIM_ATTR_GROUP]);
+        if (!param->group) {
+            GENL_SET_ERR_MSG(info, "radio must be in at least one group");
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int hwsim_new_radio_nl(struct sk_buff *msg, struct genl_info *info)
+{
+    struct hwsim_new_radio_params param = { 0 };
+    const char *hwname = NULL;
+    int ret;
+
+    ret = hwsim_new_radio_parse(info, &param);
+    if (ret)
+        return ret;
+
     if (info->attrs[HWSIM_ATTR_RADIO_NAME]) {
         hwname = kstrndup((char *)nla_data(info->attrs[HWSIM_ATTR_RADIO_NAME]),
                           nla_len(info->attrs[HWSIM_ATTR_RADIO_NAME]),
@@ -4540,6 +6883,261 @@ static int hwsim_new_radio_nl(struct sk_buff *msg, struct genl_info *info)
     return ret;
 }
 
+/* registers the radios of a HWSIM_CMD_NEW_RADIO_BATCH in parallel */
+static struct workqueue_struct *hwsim_new_radio_wq;
+
+/* one radio of a HWSIM_CMD_NEW_RADIO_BATCH */
+struct hwsim_new_radio_job {
+    struct work_struct work;
+    /* the request's, but with an extack of the job's own */
+    struct genl_info info;
+    struct netlink_ext_ack extack;
+    struct hwsim_new_radio_params param;
+    char *hwname;
+    u8 perm_addr[ETH_ALEN];
+    /* ID of the radio or negative error */
+    int ret;
+};
+
+static void hwsim_new_radio_work(struct work_struct *work)
+{
+    struct hwsim_new_radio_job *job =
+            container_of(work, struct hwsim_new_radio_job, work);
+
+    job->ret = wifi_hwsim_new_radio(&job->info, &job->param);
+}
+
+/* apply one entry of HWSIM_ATTR_RADIOS to the radio of @job */
+static int hwsim_new_radio_override(struct genl_info *info,
+                                    const struct nlattr *nla,
+                                    struct hwsim_new_radio_job *job)
+{
+    struct nlattr *tb[HWSIM_ATTR_MAX + 1];
+    int err;
+
+    err = nla_parse_nested_deprecated(tb, HWSIM_ATTR_MAX, nla,
+                                      hwsim_genl_policy,
+                                      genl_info_extack(info));
+    if (err)
+        return err;
+
+    if (tb[HWSIM_ATTR_RADIO_NAME]) {
+        job->hwname = kstrndup((char *)nla_data(tb[HWSIM_ATTR_RADIO_NAME]),
+                               nla_len(tb[HWSIM_ATTR_RADIO_NAME]),
+                               GFP_KERNEL);
+        if (!job->hwname)
+            return -ENOMEM;
+        job->param.hwname = job->hwname;
+    }
+
+    if (tb[HWSIM_ATTR_PERM_ADDR]) {
+        if (!is_valid_ether_addr(nla_data(tb[HWSIM_ATTR_PERM_ADDR]))) {
+            NL_SET_ERR_MSG_ATTR(genl_info_extack(info),
+                                tb[HWSIM_ATTR_PERM_ADDR],
+                                "MAC is no valid source addr");
+            return -EINVAL;
+        }
+
+        ether_addr_copy(job->perm_addr, nla_data(tb[HWSIM_ATTR_PERM_ADDR]));
+        job->param.perm_addr = job->perm_addr;
+    }
+
+    if (tb[HWSIM_ATTR_GROUP]) {
+        job->param.group = nla_get_u64(tb[HWSIM_ATTR_GROUP]);
+        if (!job->param.group) {
+            NL_SET_ERR_MSG_ATTR(genl_info_extack(info),
+                                tb[HWSIM_ATTR_GROUP],
+                                "radio must be in at least one group");
+            return -EINVAL;
+        }
+    }
+
+    if (tb[HWSIM_ATTR_CHANNELS]) {
+        job->param.channels = nla_get_u32(tb[HWSIM_ATTR_CHANNELS]);
+        if (job->param.channels < 1) {
+            NL_SET_ERR_MSG_ATTR(genl_info_extack(info),
+                                tb[HWSIM_ATTR_CHANNELS],
+                                "must have at least one channel");
+            return -EINVAL;
+        }
+        if (job->param.channels > 1)
+            job->param.use_chanctx = true;
+    }
+
+    return 0;
+}
+
+/* delete the radios with IDs @first to @first + @count - 1 */
+static void hwsim_del_radio_range(int first, u32 count,
+                                  struct genl_info *info)
+{
+    struct wifi_hwsim_data *data, *tmp;
+    LIST_HEAD(list);
+
+    spin_lock_bh(&hwsim_radio_lock);
+    list_for_each_entry_safe(data, tmp, &hwsim_radios, list) {
+        if (data->idx < first || data->idx >= first + (int)count)
+            continue;
+
+        hwsim_radio_unlink(data);
+        list_add_tail(&data->destroy_list, &list);
+    }
+    spin_unlock_bh(&hwsim_radio_lock);
+
+    synchronize_rcu();
+
+    list_for_each_entry_safe(data, tmp, &list, destroy_list) {
+        list_del(&data->destroy_list);
+        wifi_hwsim_del_radio(data, wiphy_name(data->hw->wiphy), info);
+    }
+}
+
+static int hwsim_new_radio_batch_nl(struct sk_buff *msg,
+                                    struct genl_info *info)
+{
+    struct hwsim_new_radio_params param = { 0 };
+    struct hwsim_new_radio_job *jobs = NULL;
+    struct sk_buff *skb = NULL;
+    const char *prefix = NULL;
+    struct nlattr *nla;
+    u32 count, i, *ids;
+    int first, rem, ret;
+    u64 base = 0;
+    void *hdr;
+
+    if (!info->attrs[HWSIM_ATTR_RADIO_COUNT])
+        return -EINVAL;
+
+    count = nla_get_u32(info->attrs[HWSIM_ATTR_RADIO_COUNT]);
+    if (!count || count > HWSIM_NEW_RADIO_BATCH_MAX) {
+        NL_SET_ERR_MSG_ATTR(genl_info_extack(info),
+                            info->attrs[HWSIM_ATTR_RADIO_COUNT],
+                            "bad number of radios");
+        return -EINVAL;
+    }
+
+    ret = hwsim_new_radio_parse(info, &param);
+    if (ret)
+        return ret;
+
+    if (param.perm_addr) {
+        base = ether_addr_to_u64(param.perm_addr);
+        /* counting up must leave the multicast bit of the OUI alone */
+        if ((base & GENMASK_ULL(39, 0)) + count - 1 > GENMASK_ULL(39, 0)) {
+            NL_SET_ERR_MSG_ATTR(genl_info_extack(info),
+                                info->attrs[HWSIM_ATTR_PERM_ADDR],
+                                "MAC base too close to the end of the OUI");
+            return -EINVAL;
+        }
+    }
+
+    if (info->attrs[HWSIM_ATTR_RADIO_NAME]) {
+        prefix = kstrndup((char *)nla_data(info->attrs[HWSIM_ATTR_RADIO_NAME]),
+                          nla_len(info->attrs[HWSIM_ATTR_RADIO_NAME]),
+                          GFP_KERNEL);
+        if (!prefix)
+            return -ENOMEM;
+    }
+
+    /* built up front, radios once created must not lack a reply */
+    skb = genlmsg_new(nla_total_size(count * sizeof(u32)), GFP_KERNEL);
+    jobs = kvcalloc(count, sizeof(*jobs), GFP_KERNEL);
+    if (!skb || !jobs) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+
+    hdr = genlmsg_put(skb, info->snd_portid, info->snd_seq,
+                      &hwsim_genl_family, 0, HWSIM_CMD_NEW_RADIO_BATCH);
+    nla = hdr ? nla_reserve(skb, HWSIM_ATTR_RADIO_IDS,
+                            count * sizeof(u32)) : NULL;
+    if (!nla) {
+        ret = -EMSGSIZE;
+        goto out_free;
+    }
+    ids = nla_data(nla);
+
+    for (i = 0; i < count; i++) {
+        INIT_WORK(&jobs[i].work, hwsim_new_radio_work);
+        jobs[i].info = *info;
+        jobs[i].info.extack = &jobs[i].extack;
+        jobs[i].param = param;
+        jobs[i].param.perm_addr = NULL;
+    }
+
+    i = 0;
+    if (info->attrs[HWSIM_ATTR_RADIOS]) {
+        nla_for_each_nested(nla, info->attrs[HWSIM_ATTR_RADIOS], rem) {
+            if (i == count) {
+                NL_SET_ERR_MSG_ATTR(genl_info_extack(info), nla,
+                                    "more overrides than radios");
+                ret = -EINVAL;
+                goto out_free;
+            }
+
+            ret = hwsim_new_radio_override(info, nla, &jobs[i++]);
+            if (ret)
+                goto out_free;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        struct hwsim_new_radio_job *job = &jobs[i];
+
+        if (!job->hwname && prefix) {
+            job->hwname = kasprintf(GFP_KERNEL, "%s%u", prefix, i);
+            if (!job->hwname) {
+                ret = -ENOMEM;
+                goto out_free;
+            }
+            job->param.hwname = job->hwname;
+        }
+
+        if (!job->param.perm_addr && param.perm_addr) {
+            u64_to_ether_addr(base + i, job->perm_addr);
+            job->param.perm_addr = job->perm_addr;
+        }
+    }
+
+    /* consecutive IDs, in the order of the batch whatever the workers do */
+    spin_lock_bh(&hwsim_radio_lock);
+    first = hwsim_radio_idx;
+    hwsim_radio_idx += count;
+    spin_unlock_bh(&hwsim_radio_lock);
+
+    for (i = 0; i < count; i++) {
+        jobs[i].param.idx_reserved = true;
+        jobs[i].param.idx = first + i;
+        queue_work(hwsim_new_radio_wq, &jobs[i].work);
+    }
+
+    for (i = 0; i < count; i++)
+        flush_work(&jobs[i].work);
+
+    for (i = 0; i < count; i++) {
+        if (jobs[i].ret < 0) {
+            ret = jobs[i].ret;
+            if (info->extack && jobs[i].extack._msg)
+                info->extack->_msg = jobs[i].extack._msg;
+            hwsim_del_radio_range(first, count, info);
+            goto out_free;
+        }
+        ids[i] = jobs[i].ret;
+    }
+
+    genlmsg_end(skb, hdr);
+    ret = genlmsg_reply(skb, info);
+    skb = NULL;
+
+    out_free:
+    nlmsg_free(skb);
+    for (i = 0; jobs && i < count; i++)
+        kfree(jobs[i].hwname);
+    kvfree(jobs);
+    kfree(prefix);
+    return ret;
+}
+
 static int hwsim_del_radio_nl(struct sk_buff *msg, struct genl_info *info)
 {
     struct wifi_hwsim_data *data;
@@ -4571,11 +7169,9 @@ static int hwsim_del_radio_nl(struct sk_buff *msg, struct genl_info *info)
         if (!net_eq(wiphy_net(data->hw->wiphy), genl_info_net(info)))
             continue;
 
-        list_del(&data->list);
-        rhashtable_remove_fast(&hwsim_radios_rht, &data->rht,
-                               hwsim_rht_params);
-        hwsim_radios_generation++;
+        hwsim_radio_unlink(data);
         spin_unlock_bh(&hwsim_radio_lock);
+        synchronize_rcu();
         wifi_hwsim_del_radio(data, wiphy_name(data->hw->wiphy),
                                  info);
         kfree(hwname);
@@ -4597,8 +7193,8 @@ static int hwsim_get_radio_nl(struct sk_buff *msg, struct genl_info *info)
         return -EINVAL;
     idx = nla_get_u32(info->attrs[HWSIM_ATTR_RADIO_ID]);
 
-    spin_lock_bh(&hwsim_radio_lock);
-    list_for_each_entry(data, &hwsim_radios, list) {
+    rcu_read_lock();
+    list_for_each_entry_rcu(data, &hwsim_radios, list) {
         if (data->idx != idx)
             continue;
 
@@ -4623,7 +7219,7 @@ static int hwsim_get_radio_nl(struct sk_buff *msg, struct genl_info *info)
     }
 
     out_err:
-    spin_unlock_bh(&hwsim_radio_lock);
+    rcu_read_unlock();
 
     return res;
 }
@@ -4636,13 +7232,13 @@ static int hwsim_dump_radio_nl(struct sk_buff *skb,
     int res = 0;
     void *hdr;
 
-    spin_lock_bh(&hwsim_radio_lock);
-    cb->seq = hwsim_radios_generation;
+    rcu_read_lock();
+    cb->seq = READ_ONCE(hwsim_radios_generation);
 
-    if (last_idx >= hwsim_radio_idx-1)
+    if (last_idx >= READ_ONCE(hwsim_radio_idx) - 1)
         goto done;
 
-    list_for_each_entry(data, &hwsim_radios, list) {
+    list_for_each_entry_rcu(data, &hwsim_radios, list) {
         if (data->idx <= last_idx)
             continue;
 
@@ -4675,7 +7271,7 @@ static int hwsim_dump_radio_nl(struct sk_buff *skb,
     }
 
     done:
-    spin_unlock_bh(&hwsim_radio_lock);
+    rcu_read_unlock();
     return res ?: skb->len;
 }
 
@@ -4716,6 +7312,22 @@ static const struct genl_small_ops hwsim_ops[] = {
                 .doit = hwsim_get_radio_nl,
                 .dumpit = hwsim_dump_radio_nl,
         },
+        {
+                .cmd = HWSIM_CMD_FRAME_BATCH,
+                .validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+                .doit = hwsim_frame_batch_received_nl,
+        },
+        {
+                .cmd = HWSIM_CMD_TX_INFO_BATCH,
+                .validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+                .doit = hwsim_tx_info_batch_received_nl,
+        },
+        {
+                .cmd = HWSIM_CMD_NEW_RADIO_BATCH,
+                .validate = GENL_DONT_VALIDATE_STRICT | GENL_DONT_VALIDATE_DUMP,
+                .doit = hwsim_new_radio_batch_nl,
+                .flags = GENL_UNS_ADMIN_PERM,
+        },
 };
 
 static struct genl_family hwsim_genl_family __genl_ro_after_init = {
@@ -4739,16 +7351,19 @@ static void remove_user_radios(u32 portid)
     spin_lock_bh(&hwsim_radio_lock);
     list_for_each_entry_safe(entry, tmp, &hwsim_radios, list) {
         if (entry->destroy_on_close && entry->portid == portid) {
-            list_move(&entry->list, &list);
-            rhashtable_remove_fast(&hwsim_radios_rht, &entry->rht,
-                                   hwsim_rht_params);
-            hwsim_radios_generation++;
+            hwsim_radio_unlink(entry);
+            list_add_tail(&entry->destroy_list, &list);
         }
     }
     spin_unlock_bh(&hwsim_radio_lock);
 
-    list_for_each_entry_safe(entry, tmp, &list, list) {
-        list_del(&entry->list);
+    if (list_empty(&list))
+        return;
+
+    synchronize_rcu();
+
+    list_for_each_entry_safe(entry, tmp, &list, destroy_list) {
+        list_del(&entry->destroy_list);
         wifi_hwsim_del_radio(entry, wiphy_name(entry->hw->wiphy),
                                  NULL);
     }
@@ -4765,11 +7380,10 @@ static int wifi_hwsim_netlink_notify(struct notifier_block *nb,
 
     remove_user_radios(notify->portid);
 
-    if (notify->portid == hwsim_net_get_wmediumd(notify->net)) {
+    if (hwsim_unregister_wmediumd(notify->net, notify->portid))
         printk(KERN_INFO "aprf_drv: eltex_wmediumd released netlink"
-                         " socket, switching to perfect channel medium\n");
-        hwsim_register_wmediumd(notify->net, 0);
-    }
+                         " socket, switching its radios to perfect channel"
+                         " medium\n");
     return NOTIFY_DONE;
 
 }
@@ -4820,15 +7434,16 @@ static void __net_exit hwsim_exit_net(struct net *net)
         if (data->netgroup == hwsim_net_get_netgroup(&init_net))
             continue;
 
-        list_move(&data->list, &list);
-        rhashtable_remove_fast(&hwsim_radios_rht, &data->rht,
-                               hwsim_rht_params);
-        hwsim_radios_generation++;
+        hwsim_radio_unlink(data);
+        list_add_tail(&data->destroy_list, &list);
     }
     spin_unlock_bh(&hwsim_radio_lock);
 
-    list_for_each_entry_safe(data, tmp, &list, list) {
-        list_del(&data->list);
+    if (!list_empty(&list))
+        synchronize_rcu();
+
+    list_for_each_entry_safe(data, tmp, &list, destroy_list) {
+        list_del(&data->destroy_list);
         wifi_hwsim_del_radio(data,
                                  wiphy_name(data->hw->wiphy),
                                  NULL);
@@ -4853,32 +7468,40 @@ static void hwsim_exit_netlink(void)
 }
 
 #if IS_REACHABLE(CONFIG_VIRTIO)
+/* the pair @vq belongs to */
+static struct hwsim_virtio_queue *hwsim_virtio_vq_pair(struct virtqueue *vq)
+{
+    return &hwsim_virtio_queues[vq->index / HWSIM_NUM_VQS];
+}
+
 static void hwsim_virtio_tx_done(struct virtqueue *vq)
 {
-    unsigned int len;
-    struct sk_buff *skb;
+    struct hwsim_virtio_queue *q = hwsim_virtio_vq_pair(vq);
     unsigned long flags;
 
-    spin_lock_irqsave(&hwsim_virtio_lock, flags);
-    while ((skb = virtqueue_get_buf(vq, &len)))
-        nlmsg_free(skb);
-    spin_unlock_irqrestore(&hwsim_virtio_lock, flags);
+    spin_lock_irqsave(&q->tx_lock, flags);
+    hwsim_virtio_tx_reclaim(vq);
+    spin_unlock_irqrestore(&q->tx_lock, flags);
 }
 
-static int hwsim_virtio_handle_cmd(struct sk_buff *skb)
+/*
+ * Parse a message in place in its RX buffer. The handlers only look at @info
+ * for messages from the device, so they get no skb.
+ */
+static int hwsim_virtio_handle_cmd(void *buf, unsigned int len)
 {
-    struct nlmsghdr *nlh;
+    struct nlmsghdr *nlh = buf;
     struct genlmsghdr *gnlh;
     struct nlattr *tb[HWSIM_ATTR_MAX + 1];
     struct genl_info info = {};
     int err;
 
-    nlh = nlmsg_hdr(skb);
-    gnlh = nlmsg_data(nlh);
-
-    if (skb->len < nlh->nlmsg_len)
+    if (len < NLMSG_HDRLEN + GENL_HDRLEN || len < nlh->nlmsg_len ||
+        nlh->nlmsg_len < NLMSG_HDRLEN + GENL_HDRLEN)
         return -EINVAL;
 
+    gnlh = nlmsg_data(nlh);
+
     err = genlmsg_parse(nlh, &hwsim_genl_family, tb, HWSIM_ATTR_MAX,
                         hwsim_genl_policy, NULL);
     if (err) {
@@ -4890,10 +7513,16 @@ static int hwsim_virtio_handle_cmd(struct sk_buff *skb)
 
     switch (gnlh->cmd) {
         case HWSIM_CMD_FRAME:
-            hwsim_cloned_frame_received_nl(skb, &info);
+            hwsim_cloned_frame_received_nl(NULL, &info);
             break;
         case HWSIM_CMD_TX_INFO_FRAME:
-            hwsim_tx_info_frame_received_nl(skb, &info);
+            hwsim_tx_info_frame_received_nl(NULL, &info);
+            break;
+        case HWSIM_CMD_FRAME_BATCH:
+            hwsim_frame_batch_received_nl(NULL, &info);
+            break;
+        case HWSIM_CMD_TX_INFO_BATCH:
+            hwsim_tx_info_batch_received_nl(NULL, &info);
             break;
         default:
             pr_err_ratelimited("hwsim: invalid cmd: %d\n", gnlh->cmd);
@@ -4902,82 +7531,177 @@ static int hwsim_virtio_handle_cmd(struct sk_buff *skb)
     return 0;
 }
 
+/* RX buffers handled per run of the RX work before it yields */
+#define HWSIM_VIRTIO_RX_BUDGET NAPI_POLL_WEIGHT
+
+/* give an RX buffer back to the page pool it was carved from */
+static void hwsim_virtio_rx_buf_free(struct hwsim_virtio_queue *q, void *buf)
+{
+    page_pool_put_full_page(q->rx_pool, virt_to_head_page(buf), false);
+}
+
+/*
+ * Drain up to HWSIM_VIRTIO_RX_BUDGET buffers with callbacks off, hand them
+ * all back in one go with a single kick, then either run again or re-enable
+ * the callback, much like a NAPI poll.
+ */
 static void hwsim_virtio_rx_work(struct work_struct *work)
 {
+    struct hwsim_virtio_queue *q =
+            container_of(work, struct hwsim_virtio_queue, rx_work);
+    void *bufs[HWSIM_VIRTIO_RX_BUDGET];
+    unsigned int lens[HWSIM_VIRTIO_RX_BUDGET];
     struct virtqueue *vq;
-    unsigned int len;
-    struct sk_buff *skb;
+    unsigned int i, n = 0;
     struct scatterlist sg[1];
     int err;
     unsigned long flags;
 
-    spin_lock_irqsave(&hwsim_virtio_lock, flags);
+    spin_lock_irqsave(&q->rx_lock, flags);
     if (!hwsim_virtio_enabled)
         goto out_unlock;
 
-    skb = virtqueue_get_buf(hwsim_vqs[HWSIM_VQ_RX], &len);
-    if (!skb)
-        goto out_unlock;
-    spin_unlock_irqrestore(&hwsim_virtio_lock, flags);
-
-    skb->data = skb->head;
-    skb_reset_tail_pointer(skb);
-    skb_put(skb, len);
-    hwsim_virtio_handle_cmd(skb);
+    vq = q->vqs[HWSIM_VQ_RX];
+    virtqueue_disable_cb(vq);
+    while (n < HWSIM_VIRTIO_RX_BUDGET &&
+           (bufs[n] = virtqueue_get_buf(vq, &lens[n])))
+        n++;
+    spin_unlock_irqrestore(&q->rx_lock, flags);
+
+    for (i = 0; i < n; i++) {
+        if (lens[i] > HWSIM_VIRTIO_RX_BUF_LEN) {
+            pr_err_ratelimited("hwsim: device wrote %u bytes to a %u byte RX buffer\n",
+                               lens[i], (unsigned int)HWSIM_VIRTIO_RX_BUF_LEN);
+            continue;
+        }
+        hwsim_virtio_handle_cmd(bufs[i], lens[i]);
+    }
 
-    spin_lock_irqsave(&hwsim_virtio_lock, flags);
+    spin_lock_irqsave(&q->rx_lock, flags);
     if (!hwsim_virtio_enabled) {
-        nlmsg_free(skb);
+        for (i = 0; i < n; i++)
+            hwsim_virtio_rx_buf_free(q, bufs[i]);
         goto out_unlock;
     }
-    vq = hwsim_vqs[HWSIM_VQ_RX];
-    sg_init_one(sg, skb->head, skb_end_offset(skb));
-    err = virtqueue_add_inbuf(vq, sg, 1, skb, GFP_ATOMIC);
-    if (WARN(err, "virtqueue_add_inbuf returned %d\n", err))
-        nlmsg_free(skb);
-    else
+
+    /* the buffers are handled in place, so the same ones go back */
+    for (i = 0; i < n; i++) {
+        sg_init_one(sg, bufs[i], HWSIM_VIRTIO_RX_BUF_LEN);
+        err = virtqueue_add_inbuf(vq, sg, 1, bufs[i], GFP_ATOMIC);
+        if (WARN(err, "virtqueue_add_inbuf returned %d\n", err))
+            hwsim_virtio_rx_buf_free(q, bufs[i]);
+    }
+    if (n)
         virtqueue_kick(vq);
-    schedule_work(&hwsim_virtio_rx);
+
+    /* budget used up, or more buffers came in while callbacks were off */
+    if (n == HWSIM_VIRTIO_RX_BUDGET || !virtqueue_enable_cb_delayed(vq))
+        schedule_work(&q->rx_work);
 
     out_unlock:
-    spin_unlock_irqrestore(&hwsim_virtio_lock, flags);
+    spin_unlock_irqrestore(&q->rx_lock, flags);
 }
 
 static void hwsim_virtio_rx_done(struct virtqueue *vq)
 {
-    schedule_work(&hwsim_virtio_rx);
+    schedule_work(&hwsim_virtio_vq_pair(vq)->rx_work);
+}
+
+/* queue pairs to use: as many as offered, online CPUs and our limit allow */
+static unsigned int hwsim_virtio_nqueues_get(struct virtio_device *vdev)
+{
+    u16 max_pairs;
+
+    if (virtio_cread_le_feature(vdev, VIRTIO_HWSIM_F_MQ,
+                                struct virtio_hwsim_config, max_queue_pairs,
+                                &max_pairs) || !max_pairs)
+        return 1;
+
+    return min3((unsigned int)max_pairs, num_online_cpus(),
+                (unsigned int)HWSIM_VIRTIO_MAX_QUEUE_PAIRS);
 }
 
 static int init_vqs(struct virtio_device *vdev)
 {
-    vq_callback_t *callbacks[HWSIM_NUM_VQS] = {
-            [HWSIM_VQ_TX] = hwsim_virtio_tx_done,
-            [HWSIM_VQ_RX] = hwsim_virtio_rx_done,
-    };
-    const char *names[HWSIM_NUM_VQS] = {
-            [HWSIM_VQ_TX] = "tx",
-            [HWSIM_VQ_RX] = "rx",
-    };
+    unsigned int nvqs = hwsim_virtio_nqueues * HWSIM_NUM_VQS;
+    struct virtqueue *vqs[HWSIM_VIRTIO_MAX_QUEUE_PAIRS * HWSIM_NUM_VQS];
+    vq_callback_t *callbacks[HWSIM_VIRTIO_MAX_QUEUE_PAIRS * HWSIM_NUM_VQS];
+    const char *names[HWSIM_VIRTIO_MAX_QUEUE_PAIRS * HWSIM_NUM_VQS];
+    unsigned int i;
+    int err;
+
+    for (i = 0; i < hwsim_virtio_nqueues; i++) {
+        struct hwsim_virtio_queue *q = &hwsim_virtio_queues[i];
+
+        snprintf(q->names[HWSIM_VQ_TX], sizeof(q->names[0]), "tx%u", i);
+        snprintf(q->names[HWSIM_VQ_RX], sizeof(q->names[0]), "rx%u", i);
+        callbacks[i * HWSIM_NUM_VQS + HWSIM_VQ_TX] = hwsim_virtio_tx_done;
+        callbacks[i * HWSIM_NUM_VQS + HWSIM_VQ_RX] = hwsim_virtio_rx_done;
+        names[i * HWSIM_NUM_VQS + HWSIM_VQ_TX] = q->names[HWSIM_VQ_TX];
+        names[i * HWSIM_NUM_VQS + HWSIM_VQ_RX] = q->names[HWSIM_VQ_RX];
+    }
+
+    err = virtio_find_vqs(vdev, nvqs, vqs, callbacks, names, NULL);
+    if (err)
+        return err;
+
+    for (i = 0; i < nvqs; i++)
+        hwsim_virtio_queues[i / HWSIM_NUM_VQS].vqs[i % HWSIM_NUM_VQS] =
+                vqs[i];
+
+    for (i = 0; i < hwsim_virtio_nqueues; i++) {
+        struct hwsim_virtio_queue *q = &hwsim_virtio_queues[i];
+        /* order-2 pages hold several RX buffers, a ring's worth is plenty */
+        struct page_pool_params pp = {
+            /* page_pool_alloc_frag() needs it to split pages */
+            .flags = PP_FLAG_PAGE_FRAG,
+            .order = 2,
+            .pool_size = virtqueue_get_vring_size(q->vqs[HWSIM_VQ_RX]),
+            .nid = dev_to_node(&vdev->dev),
+            .dev = &vdev->dev,
+            .dma_dir = DMA_FROM_DEVICE,
+        };
+
+        q->rx_pool = page_pool_create(&pp);
+        if (IS_ERR(q->rx_pool)) {
+            err = PTR_ERR(q->rx_pool);
+            q->rx_pool = NULL;
+            goto out_destroy;
+        }
+    }
+
+    return 0;
 
-    return virtio_find_vqs(vdev, HWSIM_NUM_VQS,
-                           hwsim_vqs, callbacks, names, NULL);
+    out_destroy:
+    while (i--) {
+        page_pool_destroy(hwsim_virtio_queues[i].rx_pool);
+        hwsim_virtio_queues[i].rx_pool = NULL;
+    }
+    vdev->config->del_vqs(vdev);
+    return err;
 }
 
-static int fill_vq(struct virtqueue *vq)
+/* post a HWSIM_VIRTIO_RX_BUF_LEN buffer from the pool in every RX slot */
+static int fill_vq(struct hwsim_virtio_queue *q)
 {
-    int i, err;
-    struct sk_buff *skb;
+    struct virtqueue *vq = q->vqs[HWSIM_VQ_RX];
+    unsigned int i, offset;
     struct scatterlist sg[1];
+    struct page *page;
+    void *buf;
+    int err;
 
     for (i = 0; i < virtqueue_get_vring_size(vq); i++) {
-        skb = genlmsg_new(GENLMSG_DEFAULT_SIZE, GFP_KERNEL);
-        if (!skb)
+        page = page_pool_alloc_frag(q->rx_pool, &offset,
+                                    HWSIM_VIRTIO_RX_BUF_LEN, GFP_KERNEL);
+        if (!page)
             return -ENOMEM;
 
-        sg_init_one(sg, skb->head, skb_end_offset(skb));
-        err = virtqueue_add_inbuf(vq, sg, 1, skb, GFP_KERNEL);
+        buf = page_address(page) + offset;
+        sg_init_one(sg, buf, HWSIM_VIRTIO_RX_BUF_LEN);
+        err = virtqueue_add_inbuf(vq, sg, 1, buf, GFP_KERNEL);
         if (err) {
-            nlmsg_free(skb);
+            hwsim_virtio_rx_buf_free(q, buf);
             return err;
         }
     }
@@ -4987,16 +7711,31 @@ static int fill_vq(struct virtqueue *vq)
 
 static void remove_vqs(struct virtio_device *vdev)
 {
-    int i;
+    unsigned int i;
+    unsigned long flags;
 
     vdev->config->reset(vdev);
 
-    for (i = 0; i < ARRAY_SIZE(hwsim_vqs); i++) {
-        struct virtqueue *vq = hwsim_vqs[i];
+    for (i = 0; i < hwsim_virtio_nqueues; i++) {
+        struct hwsim_virtio_queue *q = &hwsim_virtio_queues[i];
+
         struct sk_buff *skb;
+        void *buf;
 
-        while ((skb = virtqueue_detach_unused_buf(vq)))
+        /* a late hwsim_tx_virtio() must not see them any more */
+        spin_lock_irqsave(&q->tx_lock, flags);
+        while ((skb = virtqueue_detach_unused_buf(q->vqs[HWSIM_VQ_TX])))
             nlmsg_free(skb);
+        while ((buf = virtqueue_detach_unused_buf(q->vqs[HWSIM_VQ_RX])))
+            hwsim_virtio_rx_buf_free(q, buf);
+        memset(q->vqs, 0, sizeof(q->vqs));
+        q->tx_unkicked = 0;
+        spin_unlock_irqrestore(&q->tx_lock, flags);
+        /* nothing schedules it any more with the queues cleared */
+        tasklet_kill(&q->tx_kick);
+
+        page_pool_destroy(q->rx_pool);
+        q->rx_pool = NULL;
     }
 
     vdev->config->del_vqs(vdev);
@@ -5004,29 +7743,36 @@ static void remove_vqs(struct virtio_device *vdev)
 
 static int hwsim_virtio_probe(struct virtio_device *vdev)
 {
+    unsigned int i;
     int err;
-    unsigned long flags;
 
-    spin_lock_irqsave(&hwsim_virtio_lock, flags);
-    if (hwsim_virtio_enabled) {
-        spin_unlock_irqrestore(&hwsim_virtio_lock, flags);
+    if (READ_ONCE(hwsim_virtio_enabled))
         return -EEXIST;
-    }
-    spin_unlock_irqrestore(&hwsim_virtio_lock, flags);
+
+    hwsim_virtio_nqueues = hwsim_virtio_nqueues_get(vdev);
 
     err = init_vqs(vdev);
     if (err)
         return err;
 
-    err = fill_vq(hwsim_vqs[HWSIM_VQ_RX]);
-    if (err)
-        goto out_remove;
+    if (virtio_has_feature(vdev, VIRTIO_HWSIM_F_RX_BUF_LEN)) {
+        u32 len = HWSIM_VIRTIO_RX_BUF_LEN;
+
+        virtio_cwrite_le(vdev, struct virtio_hwsim_config, rx_buf_len,
+                         &len);
+    }
+
+    for (i = 0; i < hwsim_virtio_nqueues; i++) {
+        err = fill_vq(&hwsim_virtio_queues[i]);
+        if (err)
+            goto out_remove;
+    }
 
-    spin_lock_irqsave(&hwsim_virtio_lock, flags);
-    hwsim_virtio_enabled = true;
-    spin_unlock_irqrestore(&hwsim_virtio_lock, flags);
+    /* publishes hwsim_virtio_nqueues to hwsim_tx_virtio() */
+    smp_store_release(&hwsim_virtio_enabled, true);
 
-    schedule_work(&hwsim_virtio_rx);
+    for (i = 0; i < hwsim_virtio_nqueues; i++)
+        schedule_work(&hwsim_virtio_queues[i].rx_work);
     return 0;
 
     out_remove:
@@ -5036,13 +7782,21 @@ static int hwsim_virtio_probe(struct virtio_device *vdev)
 
 static void hwsim_virtio_remove(struct virtio_device *vdev)
 {
-    hwsim_virtio_enabled = false;
+    unsigned int i;
+
+    WRITE_ONCE(hwsim_virtio_enabled, false);
 
-    cancel_work_sync(&hwsim_virtio_rx);
+    for (i = 0; i < hwsim_virtio_nqueues; i++)
+        cancel_work_sync(&hwsim_virtio_queues[i].rx_work);
 
     remove_vqs(vdev);
 }
 
+static unsigned int hwsim_virtio_features[] = {
+        VIRTIO_HWSIM_F_MQ,
+        VIRTIO_HWSIM_F_RX_BUF_LEN,
+};
+
 /* APRF_DRV virtio device id table */
 static const struct virtio_device_id id_table[] = {
         { VIRTIO_ID_MAC80211_HWSIM, VIRTIO_DEV_ANY_ID },
@@ -5053,6 +7807,8 @@ MODULE_DEVICE_TABLE(virtio, id_table);
 static struct virtio_driver virtio_hwsim = {
         .driver.name = KBUILD_MODNAME,
         .driver.owner = THIS_MODULE,
+        .feature_table = hwsim_virtio_features,
+        .feature_table_size = ARRAY_SIZE(hwsim_virtio_features),
         .id_table = id_table,
         .probe = hwsim_virtio_probe,
         .remove = hwsim_virtio_remove,
@@ -5060,6 +7816,15 @@ static struct virtio_driver virtio_hwsim = {
 
 static int hwsim_register_virtio_driver(void)
 {
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(hwsim_virtio_queues); i++) {
+        spin_lock_init(&hwsim_virtio_queues[i].tx_lock);
+        spin_lock_init(&hwsim_virtio_queues[i].rx_lock);
+        INIT_WORK(&hwsim_virtio_queues[i].rx_work, hwsim_virtio_rx_work);
+        tasklet_setup(&hwsim_virtio_queues[i].tx_kick, hwsim_virtio_tx_kick);
+    }
+
     return register_virtio_driver(&virtio_hwsim);
 }
 
@@ -5100,9 +7865,15 @@ static int __init init_wifi_hwsim(void)
     if (err)
         goto out_unregister_pernet;
 
+    hwsim_new_radio_wq = alloc_workqueue("aprf_new_radio", WQ_UNBOUND, 0);
+    if (!hwsim_new_radio_wq) {
+        err = -ENOMEM;
+        goto out_unregister_driver;
+    }
+
     err = hwsim_init_netlink();
     if (err)
-        goto out_unregister_driver;
+        goto out_destroy_wq;
 
     err = hwsim_register_virtio_driver();
     if (err)
@@ -5114,12 +7885,20 @@ static int __init init_wifi_hwsim(void)
         goto out_exit_virtio;
     }
 
+    if (medium_dev) {
+        err = misc_register(&hwsim_ring_misc);
+        if (err)
+            goto out_exit_virtio;
+    }
+
     hwsim_init_s1g_channels(hwsim_channels_s1g);
 
     for (i = 0; i < radios; i++) {
         struct hwsim_new_radio_params param = { 0 };
 
         param.channels = channels;
+        param.tx_queue_high = MAX_QUEUE;
+        param.tx_queue_low = WARN_QUEUE;
         param.mlo = mlo;
         param.p2p_device = support_p2p_device;
         param.use_chanctx = channels > 1 || mlo;
@@ -5159,10 +7938,14 @@ static int __init init_wifi_hwsim(void)
     free_netdev(hwsim_mon);
     out_free_radios:
     wifi_hwsim_free();
+    if (medium_dev)
+        misc_deregister(&hwsim_ring_misc);
     out_exit_virtio:
     hwsim_unregister_virtio_driver();
     out_exit_netlink:
     hwsim_exit_netlink();
+    out_destroy_wq:
+    destroy_workqueue(hwsim_new_radio_wq);
     out_unregister_driver:
     platform_driver_unregister(&wifi_hwsim_driver);
     out_unregister_pernet:
@@ -5179,6 +7962,9 @@ static void __exit exit_wifi_hwsim(void)
 
     hwsim_unregister_virtio_driver();
     hwsim_exit_netlink();
+    destroy_workqueue(hwsim_new_radio_wq);
+    if (medium_dev)
+        misc_deregister(&hwsim_ring_misc);
 
     wifi_hwsim_free();
 
@@ -18,10 +18,18 @@
 #include <net/net_namespace.h>
 #include <net/netns/generic.h>
 #include <linux/rhashtable.h>
+#include <linux/hashtable.h>
+#include <linux/xarray.h>
+#include <linux/miscdevice.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/nospec.h>
 #include <linux/virtio.h>
 #include <linux/virtio_ids.h>
 #include <linux/virtio_config.h>
+#include <net/page_pool.h>
 #include <linux/dynamic_debug.h>
 
 #define netdev_set_def_destructor(_dev) (_dev)->needs_free_netdev = true;
@@ -54,12 +62,15 @@
  * @HWSIM_TX_CTL_REQ_TX_STATUS: require TX status callback for this frame.
  * @HWSIM_TX_CTL_NO_ACK: tell the wmediumd not to wait for an ack
  * @HWSIM_TX_STAT_ACK: Frame was acknowledged
+ * @HWSIM_TX_DESC_CHANDEF: only in &struct hwsim_tx_desc, its width and
+ *	center frequencies are set; a width of 0 is then 20 MHz without HT
  *
  */
 enum hwsim_tx_control_flags {
     HWSIM_TX_CTL_REQ_TX_STATUS		= BIT(0),
     HWSIM_TX_CTL_NO_ACK			= BIT(1),
     HWSIM_TX_STAT_ACK			= BIT(2),
+    HWSIM_TX_DESC_CHANDEF		= BIT(3),
 };
 
 /**
@@ -89,7 +100,8 @@ enum hwsim_tx_control_flags {
  * @HWSIM_CMD_UNSPEC: unspecified command to catch errors
  *
  * @HWSIM_CMD_REGISTER: request to register and received all broadcasted
- *	frames by any aprf_drv radio device.
+ *	frames by any aprf_drv radio device. With %HWSIM_REGISTER_F_SHARD only
+ *	those of the radios of one shard, see %HWSIM_ATTR_SHARD_COUNT.
  * @HWSIM_CMD_FRAME: send/receive a broadcasted frame from/to kernel/user
  *	space, uses:
  *	%HWSIM_ATTR_ADDR_TRANSMITTER, %HWSIM_ATTR_ADDR_RECEIVER,
@@ -107,7 +119,7 @@ enum hwsim_tx_control_flags {
  *	%HWSIM_ATTR_DESTROY_RADIO_ON_CLOSE, %HWSIM_ATTR_CHANNELS,
  *	%HWSIM_ATTR_NO_VIF, %HWSIM_ATTR_RADIO_NAME, %HWSIM_ATTR_USE_CHANCTX,
  *	%HWSIM_ATTR_REG_HINT_ALPHA2, %HWSIM_ATTR_REG_CUSTOM_REG,
- *	%HWSIM_ATTR_PERM_ADDR
+ *	%HWSIM_ATTR_PERM_ADDR, %HWSIM_ATTR_USE_TXQ
  * @HWSIM_CMD_DEL_RADIO: destroy a radio, reply is multicasted
  * @HWSIM_CMD_GET_RADIO: fetch information about existing radios, uses:
  *	%HWSIM_ATTR_RADIO_ID
@@ -117,6 +129,25 @@ enum hwsim_tx_control_flags {
  *	to this receiver address for a given station.
  * @HWSIM_CMD_DEL_MAC_ADDR: remove the MAC address again, the attributes
  *	are the same as to @HWSIM_CMD_ADD_MAC_ADDR.
+ * @HWSIM_CMD_FRAME_BATCH: several frames in one message, in both directions.
+ *	%HWSIM_ATTR_FRAMES nests one attribute per frame, which in turn nests
+ *	the attributes of a single %HWSIM_CMD_FRAME. The kernel only sends it
+ *	to a medium registered with %HWSIM_REGISTER_F_FRAME_BATCH. Over virtio
+ *	a message from the device must fit in one RX buffer of
+ *	%HWSIM_VIRTIO_RX_BUF_LEN bytes, see %VIRTIO_HWSIM_F_RX_BUF_LEN.
+ * @HWSIM_CMD_TX_INFO_BATCH: transmission info of several frames, from user
+ *	space to kernel, uses %HWSIM_ATTR_TX_INFO_BATCH. Records of the same
+ *	transmitter should be adjacent, they are then resolved together. The
+ *	RX buffer limit of %HWSIM_CMD_FRAME_BATCH applies over virtio.
+ * @HWSIM_CMD_NEW_RADIO_BATCH: create %HWSIM_ATTR_RADIO_COUNT radios at once.
+ *	The attributes of %HWSIM_CMD_NEW_RADIO are the template of all of
+ *	them, except that %HWSIM_ATTR_RADIO_NAME is a prefix the position of
+ *	the radio in the batch is appended to and %HWSIM_ATTR_PERM_ADDR is the
+ *	address of the first radio, the others count up from it. Entry n of
+ *	%HWSIM_ATTR_RADIOS overrides the name, address, group or channels of
+ *	radio n. The radios are registered in parallel and get consecutive IDs,
+ *	the reply carries them in %HWSIM_ATTR_RADIO_IDS. If one of them cannot
+ *	be created, none is.
  * @__HWSIM_CMD_MAX: enum limit
  */
 enum {
@@ -132,6 +163,9 @@ enum {
     HWSIM_CMD_START_PMSR,
 	HWSIM_CMD_ABORT_PMSR,
 	HWSIM_CMD_REPORT_PMSR,
+    HWSIM_CMD_FRAME_BATCH,
+    HWSIM_CMD_TX_INFO_BATCH,
+    HWSIM_CMD_NEW_RADIO_BATCH,
     __HWSIM_CMD_MAX,
 };
 #define HWSIM_CMD_MAX (_HWSIM_CMD_MAX - 1)
@@ -179,6 +213,52 @@ enum {
  * @HWSIM_ATTR_PERM_ADDR: permanent mac address of new radio
  * @HWSIM_ATTR_IFTYPE_SUPPORT: u32 attribute of supported interface types bits
  * @HWSIM_ATTR_CIPHER_SUPPORT: u32 array of supported cipher types
+ * @HWSIM_ATTR_USE_TXQ: used with the %HWSIM_CMD_CREATE_RADIO command to
+ *	make the radio pull frames from the mac80211 TXQs (wake_tx_queue)
+ *	instead of having them pushed through the .tx op (flag)
+ * @HWSIM_ATTR_REGISTER_FLAGS: u32 attribute used with %HWSIM_CMD_REGISTER
+ *	declaring the optional protocol features the medium handles, see
+ *	&enum hwsim_register_flags
+ * @HWSIM_ATTR_FRAMES: frames of a %HWSIM_CMD_FRAME_BATCH message (nested)
+ * @HWSIM_ATTR_TX_INFO_BATCH: array of &struct hwsim_tx_info_record
+ * @HWSIM_ATTR_TX_QUEUE_HIGH: u32 attribute used with %HWSIM_CMD_NEW_RADIO,
+ *	number of frames waiting for TX status from the medium at which the
+ *	radio drops frames or, with %HWSIM_ATTR_TX_BACKPRESSURE, stops its
+ *	queues
+ * @HWSIM_ATTR_TX_QUEUE_LOW: u32 attribute used with %HWSIM_CMD_NEW_RADIO,
+ *	number of waiting frames dropping stops at or the queues are woken at
+ * @HWSIM_ATTR_TX_BACKPRESSURE: used with %HWSIM_CMD_NEW_RADIO to stop the
+ *	mac80211 queues instead of dropping frames when the medium falls
+ *	behind (flag). Frames mac80211 sends on its own still pile up, the
+ *	oldest are dropped past twice %HWSIM_ATTR_TX_QUEUE_HIGH.
+ * @HWSIM_ATTR_SHARD_ID: u32 attribute used with %HWSIM_CMD_REGISTER and
+ *	%HWSIM_REGISTER_F_SHARD, the shard the medium is in charge of
+ * @HWSIM_ATTR_SHARD_COUNT: u32 attribute used with %HWSIM_CMD_REGISTER and
+ *	%HWSIM_REGISTER_F_SHARD, the number of shards the radios of the
+ *	network namespace are split into. Radio index modulo this count is
+ *	the shard of a radio, all media of a namespace must agree on it.
+ * @HWSIM_ATTR_CHANNEL_WIDTH: u32 attribute of %HWSIM_CMD_FRAME sent to a
+ *	medium registered with %HWSIM_REGISTER_F_MULTI_CHANNEL, the
+ *	&enum nl80211_chan_width of the channel the frame is sent on.
+ *	%HWSIM_ATTR_FREQ is its control channel.
+ * @HWSIM_ATTR_CENTER_FREQ1: u32 attribute, center frequency of the first
+ *	segment of that channel in MHz
+ * @HWSIM_ATTR_CENTER_FREQ2: u32 attribute, center frequency of the second
+ *	segment of an 80+80 MHz channel in MHz, 0 otherwise
+ * @HWSIM_ATTR_TX_DESC: &struct hwsim_tx_desc, sent in %HWSIM_CMD_FRAME to a
+ *	medium registered with %HWSIM_REGISTER_F_TX_DESC instead of the
+ *	separate transmitter, flags, frequency, rate and cookie attributes.
+ *	Its payload is 64-bit aligned.
+ * @HWSIM_ATTR_GROUP: u64 attribute used with %HWSIM_CMD_NEW_RADIO, the
+ *	non-zero bitmap of the groups of the radio. Radios only hear each
+ *	other when they share a group, all are in the first one by default.
+ * @HWSIM_ATTR_RADIO_COUNT: u32 attribute used with
+ *	%HWSIM_CMD_NEW_RADIO_BATCH, the number of radios to create
+ * @HWSIM_ATTR_RADIOS: per-radio overrides of a %HWSIM_CMD_NEW_RADIO_BATCH
+ *	(nested), each entry may carry %HWSIM_ATTR_RADIO_NAME,
+ *	%HWSIM_ATTR_PERM_ADDR, %HWSIM_ATTR_GROUP and %HWSIM_ATTR_CHANNELS
+ * @HWSIM_ATTR_RADIO_IDS: u32 array of the IDs of the radios created by a
+ *	%HWSIM_CMD_NEW_RADIO_BATCH, in the order of the batch
  * @__HWSIM_ATTR_MAX: enum limit
  */
 
@@ -213,10 +293,63 @@ enum {
 	HWSIM_ATTR_PMSR_SUPPORT,
 	HWSIM_ATTR_PMSR_REQUEST,
 	HWSIM_ATTR_PMSR_RESULT,
+    HWSIM_ATTR_USE_TXQ,
+    HWSIM_ATTR_REGISTER_FLAGS,
+    HWSIM_ATTR_FRAMES,
+    HWSIM_ATTR_TX_INFO_BATCH,
+    HWSIM_ATTR_TX_QUEUE_HIGH,
+    HWSIM_ATTR_TX_QUEUE_LOW,
+    HWSIM_ATTR_TX_BACKPRESSURE,
+    HWSIM_ATTR_SHARD_ID,
+    HWSIM_ATTR_SHARD_COUNT,
+    HWSIM_ATTR_CHANNEL_WIDTH,
+    HWSIM_ATTR_CENTER_FREQ1,
+    HWSIM_ATTR_CENTER_FREQ2,
+    HWSIM_ATTR_TX_DESC,
+    HWSIM_ATTR_GROUP,
+    HWSIM_ATTR_RADIO_COUNT,
+    HWSIM_ATTR_RADIOS,
+    HWSIM_ATTR_RADIO_IDS,
     __HWSIM_ATTR_MAX,
 };
 #define HWSIM_ATTR_MAX (__HWSIM_ATTR_MAX - 1)
 
+/**
+ * enum hwsim_register_flags - medium features declared at registration
+ *
+ * @HWSIM_REGISTER_F_FRAME_BATCH: the medium accepts %HWSIM_CMD_FRAME_BATCH,
+ *	transmitted frames are coalesced into such messages
+ * @HWSIM_REGISTER_F_SHARD: the medium only simulates one shard of the
+ *	radios, see %HWSIM_ATTR_SHARD_COUNT. It gets the frames transmitted
+ *	by its radios and may still hand frames to any radio of the network
+ *	namespace, the kernel delivers them across shards.
+ * @HWSIM_REGISTER_F_MULTI_CHANNEL: the medium handles radios with several
+ *	concurrent channels. Transmitted frames carry the whole channel
+ *	definition, see %HWSIM_ATTR_CHANNEL_WIDTH, and a frame handed to a
+ *	radio is received on whichever of its channels %HWSIM_ATTR_FREQ is.
+ * @HWSIM_REGISTER_F_TX_DESC: the medium takes the description of a
+ *	transmitted frame as one %HWSIM_ATTR_TX_DESC
+ */
+enum hwsim_register_flags {
+    HWSIM_REGISTER_F_FRAME_BATCH		= BIT(0),
+    HWSIM_REGISTER_F_SHARD			= BIT(1),
+    HWSIM_REGISTER_F_MULTI_CHANNEL		= BIT(2),
+    HWSIM_REGISTER_F_TX_DESC		= BIT(3),
+};
+#define HWSIM_REGISTER_F_ALL (HWSIM_REGISTER_F_FRAME_BATCH | \
+                              HWSIM_REGISTER_F_SHARD | \
+                              HWSIM_REGISTER_F_MULTI_CHANNEL | \
+                              HWSIM_REGISTER_F_TX_DESC)
+
+/* most media that may share the radios of a network namespace */
+#define HWSIM_MAX_SHARDS 64
+
+/*
+ * most radios one HWSIM_CMD_NEW_RADIO_BATCH creates; the command holds the
+ * genl mutex, and with it the media's frames, until all are registered
+ */
+#define HWSIM_NEW_RADIO_BATCH_MAX 128
+
 /**
  * struct hwsim_tx_rate - rate selection/status
  *
@@ -298,6 +431,160 @@ struct hwsim_tx_rate_flag {
     u16 flags;
 } __packed;
 
+/**
+ * struct hwsim_tx_info_record - transmission info of one frame
+ *
+ * Carries what %HWSIM_CMD_TX_INFO_FRAME carries in attributes, for use in
+ * %HWSIM_CMD_TX_INFO_BATCH.
+ *
+ * @transmitter: address of the radio that sent the frame
+ * @tx_attempts: rates and retries used, as %HWSIM_ATTR_TX_INFO
+ * @pad: reserved
+ * @cookie: cookie of the frame, as %HWSIM_ATTR_COOKIE
+ * @flags: &enum hwsim_tx_control_flags, as %HWSIM_ATTR_FLAGS
+ * @signal: ack signal, as %HWSIM_ATTR_SIGNAL
+ */
+struct hwsim_tx_info_record {
+    u8 transmitter[ETH_ALEN];
+    struct hwsim_tx_rate tx_attempts[IEEE80211_TX_MAX_RATES];
+    u16 pad;
+    u64 cookie;
+    u32 flags;
+    s32 signal;
+} __packed;
+
+/**
+ * struct hwsim_tx_desc - description of one transmitted frame
+ *
+ * Carries what %HWSIM_CMD_FRAME otherwise carries in separate attributes,
+ * see %HWSIM_ATTR_TX_DESC. The frame itself stays in %HWSIM_ATTR_FRAME.
+ *
+ * @transmitter: address of the radio that sent the frame
+ * @tx_attempts: rates and retries to use, as %HWSIM_ATTR_TX_INFO
+ * @pad: reserved
+ * @cookie: cookie of the frame, as %HWSIM_ATTR_COOKIE
+ * @flags: &enum hwsim_tx_control_flags, as %HWSIM_ATTR_FLAGS
+ * @freq: control channel, as %HWSIM_ATTR_FREQ
+ * @width: as %HWSIM_ATTR_CHANNEL_WIDTH, only valid with
+ *	%HWSIM_TX_DESC_CHANDEF in @flags, which the driver sets for a medium
+ *	registered with %HWSIM_REGISTER_F_MULTI_CHANNEL
+ * @center_freq1: as %HWSIM_ATTR_CENTER_FREQ1, likewise
+ * @center_freq2: as %HWSIM_ATTR_CENTER_FREQ2, likewise
+ * @tx_attempts_flags: as %HWSIM_ATTR_TX_INFO_FLAGS
+ * @pad2: reserved
+ */
+struct hwsim_tx_desc {
+    u8 transmitter[ETH_ALEN];
+    struct hwsim_tx_rate tx_attempts[IEEE80211_TX_MAX_RATES];
+    u16 pad;
+    u64 cookie;
+    u32 flags;
+    u32 freq;
+    u32 width;
+    u32 center_freq1;
+    u32 center_freq2;
+    struct hwsim_tx_rate_flag tx_attempts_flags[IEEE80211_TX_MAX_RATES];
+    u8 pad2[8];
+} __packed;
+
+/**
+ * DOC: Shared memory medium transport
+ *
+ * With the medium_dev module parameter the driver offers /dev/aprf_medium,
+ * an alternative to the netlink frame exchange. The medium sizes two rings
+ * with %HWSIM_RING_SETUP and maps them. The TX ring carries frames from the
+ * radios to the medium, the RX ring carries frames for the radios and TX
+ * status back. %HWSIM_RING_REGISTER then makes the medium the one of its
+ * netns, as %HWSIM_CMD_REGISTER would.
+ *
+ * Each ring starts with a &struct hwsim_ring_hdr, followed by its
+ * descriptors and, from the next page on, one buffer of frame_size bytes
+ * per descriptor. The producer fills descriptor and buffer at
+ * producer & (entries - 1) before advancing producer; the consumer advances
+ * consumer once it is done with them. poll() reports the TX ring readable,
+ * an eventfd set with %HWSIM_RING_SET_EVENTFD is signalled for new frames,
+ * and %HWSIM_RING_KICK makes the driver consume the RX ring.
+ *
+ * Netlink stays in use for radio management and the other commands.
+ */
+
+/**
+ * struct hwsim_ring_setup - argument of %HWSIM_RING_SETUP
+ *
+ * @entries: descriptors per ring, a power of two
+ * @frame_size: size of the buffer of each descriptor
+ * @tx_off: set by the driver, offset of the TX ring in the mapping
+ * @rx_off: set by the driver, offset of the RX ring in the mapping
+ * @size: set by the driver, length of the mapping
+ */
+struct hwsim_ring_setup {
+    u32 entries;
+    u32 frame_size;
+    u32 tx_off;
+    u32 rx_off;
+    u32 size;
+};
+
+/**
+ * struct hwsim_ring_hdr - indices of a ring, each in its own cache line
+ *
+ * @producer: number of descriptors ever produced
+ * @consumer: number of descriptors ever consumed
+ */
+struct hwsim_ring_hdr {
+    u32 producer;
+    u32 pad0[15];
+    u32 consumer;
+    u32 pad1[15];
+};
+
+/**
+ * enum hwsim_ring_desc_type - meaning of a ring descriptor
+ *
+ * @HWSIM_RING_FRAME: a frame, as %HWSIM_CMD_FRAME, in the descriptor buffer
+ * @HWSIM_RING_TX_INFO: transmission info, as %HWSIM_CMD_TX_INFO_FRAME
+ */
+enum hwsim_ring_desc_type {
+    HWSIM_RING_FRAME		= 1,
+    HWSIM_RING_TX_INFO		= 2,
+};
+
+/**
+ * struct hwsim_ring_desc - ring descriptor
+ *
+ * @type: &enum hwsim_ring_desc_type
+ * @len: length of the frame in the buffer
+ * @addr: transmitter, or receiver for frames sent to the radios
+ * @pad: reserved
+ * @cookie: cookie of the transmitted frame
+ * @flags: &enum hwsim_tx_control_flags
+ * @freq: frequency the frame is sent on, 0 if unknown
+ * @rx_rate: rate index the frame is received with
+ * @signal: received or ack signal
+ * @tx_attempts: rates and retries, as %HWSIM_ATTR_TX_INFO
+ * @tx_attempts_flags: rate flags, as %HWSIM_ATTR_TX_INFO_FLAGS
+ * @pad2: reserved
+ */
+struct hwsim_ring_desc {
+    u16 type;
+    u16 len;
+    u8 addr[ETH_ALEN];
+    u8 pad[6];
+    u64 cookie;
+    u32 flags;
+    u32 freq;
+    u32 rx_rate;
+    s32 signal;
+    struct hwsim_tx_rate tx_attempts[IEEE80211_TX_MAX_RATES];
+    struct hwsim_tx_rate_flag tx_attempts_flags[IEEE80211_TX_MAX_RATES];
+    u8 pad2[4];
+} __packed;
+
+#define HWSIM_RING_SETUP	_IOWR('h', 1, struct hwsim_ring_setup)
+#define HWSIM_RING_REGISTER	_IO('h', 2)
+#define HWSIM_RING_KICK		_IO('h', 3)
+#define HWSIM_RING_SET_EVENTFD	_IOW('h', 4, int)
+
 /**
  * DOC: Frame transmission support over virtio
  *
@@ -311,6 +598,9 @@ struct hwsim_tx_rate_flag {
  * @HWSIM_VQ_TX: send frames to external entity
  * @HWSIM_VQ_RX: receive frames and transmission info reports
  * @HWSIM_NUM_VQS: enum limit
+ *
+ * With %VIRTIO_HWSIM_F_MQ these are the queues of one pair, pair n uses
+ * virtqueues 2n and 2n + 1.
  */
 enum {
     HWSIM_VQ_TX,
@@ -318,6 +608,41 @@ enum {
     HWSIM_NUM_VQS,
 };
 
+/*
+ * The device offers &struct virtio_hwsim_config.max_queue_pairs TX/RX queue
+ * pairs instead of a single one. A radio always transmits on the same pair,
+ * picked by its index, so its frames stay in order; every RX queue is
+ * drained on its own.
+ */
+#define VIRTIO_HWSIM_F_MQ	0
+
+/*
+ * The driver writes the size of its RX buffers to &struct
+ * virtio_hwsim_config.rx_buf_len before it posts them. Every message the
+ * device sends, batches included, must fit in one; longer ones are dropped.
+ */
+#define VIRTIO_HWSIM_F_RX_BUF_LEN	1
+
+struct virtio_hwsim_config {
+    __le16 max_queue_pairs;
+    /* keeps the fields below naturally aligned */
+    __le16 reserved;
+    /* written by the driver, see VIRTIO_HWSIM_F_RX_BUF_LEN */
+    __le32 rx_buf_len;
+} __packed;
+
+/* most queue pairs the driver uses, never more than online CPUs either */
+#define HWSIM_VIRTIO_MAX_QUEUE_PAIRS 16
+
+/*
+ * Size of every RX buffer the driver posts: room for one message carrying the
+ * largest frame plus its other attributes. Messages the device sends, batches
+ * included, must fit in one buffer.
+ */
+#define HWSIM_VIRTIO_RX_BUF_LEN \
+    ALIGN(NLMSG_HDRLEN + GENL_HDRLEN + \
+          NLA_ALIGN(NLA_HDRLEN + IEEE80211_MAX_DATA_LEN) + 512, SMP_CACHE_BYTES)
+
 
 /**
  * enum hwsim_regtest - the type of regulatory tests we offer
@@ -552,6 +877,92 @@ static const struct ieee80211_channel hwsim_channels_6ghz[] = {
         CHAN6G(7115), /* Channel 233 */
 };
 
+/* datapath counters of a radio, kept per CPU and summed up for ethtool */
+enum hwsim_stat {
+    HWSIM_STAT_TX_PKTS,
+    HWSIM_STAT_TX_BYTES,
+    HWSIM_STAT_RX_PKTS,
+    HWSIM_STAT_RX_BYTES,
+    HWSIM_STAT_TX_DROPPED,
+    HWSIM_STAT_TX_FAILED,
+    HWSIM_STAT_FANOUT_COPIES_AVOIDED,
+    HWSIM_STAT_RX_QUEUE_DROPPED,
+    HWSIM_STAT_RX_COPY_FAILED,
+    HWSIM_STAT_RX_OFFCHAN_DROPPED,
+    HWSIM_STAT_RX_PS_DROPPED,
+    HWSIM_STAT_TX_BATCHES,
+    HWSIM_STAT_TX_QUEUE_STOPS,
+    HWSIM_STAT_TX_QUEUE_WAKES,
+    HWSIM_STAT_NUM,
+};
+
+struct hwsim_pcpu_stats {
+    u64_stats_t cnt[HWSIM_STAT_NUM];
+    struct u64_stats_sync syncp;
+};
+
+/* all channels of a radio, indexed in the order of the tables above */
+#define HWSIM_NUM_CHANNELS (ARRAY_SIZE(hwsim_channels_2ghz) + \
+                            ARRAY_SIZE(hwsim_channels_5ghz) + \
+                            ARRAY_SIZE(hwsim_channels_6ghz) + \
+                            ARRAY_SIZE(hwsim_channels_s1g))
+
+/* an open /dev/aprf_medium, see the shared memory medium transport */
+struct hwsim_ring {
+    struct net *net;
+    /* serializes setup, registration and RX ring processing */
+    struct mutex mutex;
+    bool registered;
+
+    void *area;
+    unsigned long size;
+    u32 entries;
+    u32 frame_size;
+
+    /* kernel -> medium */
+    spinlock_t tx_lock;
+    u32 tx_prod;
+    struct hwsim_ring_hdr *tx_hdr;
+    struct hwsim_ring_desc *tx_desc;
+    u8 *tx_frames;
+
+    /* medium -> kernel */
+    u32 rx_cons;
+    struct hwsim_ring_hdr *rx_hdr;
+    struct hwsim_ring_desc *rx_desc;
+    u8 *rx_frames;
+
+    wait_queue_head_t wait;
+    struct eventfd_ctx *eventfd;
+};
+
+/* addresses a radio acknowledges frames for, replaced as a whole under RCU */
+struct hwsim_vif_addrs {
+    struct rcu_head rcu;
+    unsigned int n;
+    struct mac_address addrs[];
+};
+
+/*
+ * RF configuration of a radio as the datapath sees it. Rebuilt under the
+ * radio's mutex whenever one of the fields it mirrors changes and replaced as
+ * a whole under RCU, so that RX and TX never take the mutex.
+ */
+struct hwsim_rf_state {
+    struct rcu_head rcu;
+    /* operating channel without channel contexts */
+    struct ieee80211_channel *channel;
+    /* scan or remain-on-channel channel */
+    struct ieee80211_channel *tmp_chan;
+    /* channel of the most recent channel context */
+    struct ieee80211_channel *chanctx_chan;
+    /* copy of the radio's active_chans */
+    DECLARE_BITMAP(active_chans, HWSIM_NUM_CHANNELS);
+    bool idle, started;
+    u8 ps;	/* enum ps_mode */
+    u64 group;
+};
+
 struct wifi_hwsim_link_data {
 	u32 link_id;
 	u64 beacon_int	/* beacon interval in us */;
@@ -579,6 +990,22 @@ struct wifi_hwsim_data {
     struct ieee80211_chanctx_conf *chanctx;
     int channels, idx;
     bool use_chanctx;
+    bool use_txq;
+    /*
+     * Channels with at least one vif assigned to a channel context on them.
+     * Tested locklessly by the fanout, maintained under mutex together with
+     * the number of contexts on each channel.
+     */
+    DECLARE_BITMAP(active_chans, HWSIM_NUM_CHANNELS);
+    u16 active_chan_refs[HWSIM_NUM_CHANNELS];
+    /* addresses of the interfaces in the driver plus the sw scan address */
+    struct hwsim_vif_addrs __rcu *vif_addrs;
+    /* what RX and TX read of the channels, idle, started, ps and group */
+    struct hwsim_rf_state __rcu *rf;
+    /* next snapshot to publish, so that updating rf never fails */
+    struct hwsim_rf_state *rf_spare;
+    /* drains the mac80211 TXQs when use_txq is set */
+    struct work_struct txq_work;
     bool destroy_on_close;
     u32 portid;
     char alpha2[2];
@@ -613,9 +1040,25 @@ struct wifi_hwsim_data {
     } ps;
     bool ps_poll_pending;
     struct dentry *debugfs;
+    /* monitor netdev capturing only this radio's frames, see radio_mon */
+    struct net_device *mon;
 
     atomic_t pending_cookie;
-    struct sk_buff_head pending;	/* packets pending */
+    struct sk_buff_head pending;	/* packets pending, oldest first */
+    /* the same packets indexed by cookie, updated under pending.lock */
+    struct xarray pending_cookies;
+    /* watermarks of the pending queue, see HWSIM_ATTR_TX_QUEUE_HIGH */
+    u32 tx_queue_high;
+    u32 tx_queue_low;
+    bool tx_backpressure;
+    /* queues stopped at tx_queue_high, under pending.lock */
+    bool tx_stopped;
+
+    /* frames received from the medium, delivered in batches from NAPI */
+    struct sk_buff_head rx_queue;
+    struct napi_struct napi;
+    struct net_device napi_dev;
+
     /*
 	 * Only radios in the same group can communicate together (the
 	 * channel has to match too). Each bit represents a group. A
@@ -625,8 +1068,27 @@ struct wifi_hwsim_data {
 
     /* group shared by radios created in the same netns */
     int netgroup;
+    /* entries of this radio in the per-channel receiver index */
+    struct list_head rx_index;
+    /* set once the radio is unlinked and waiting for a grace period */
+    bool unlinked;
+    /* link on a local list of radios being destroyed together */
+    struct list_head destroy_list;
     /* wmediumd portid responsible for netgroup of this radio */
     u32 wmediumd;
+    /* hwsim_register_flags the wmediumd registered with */
+    u32 wmediumd_flags;
+    /* shared memory medium used instead of the wmediumd, if any */
+    struct hwsim_ring __rcu *medium_ring;
+
+    /* HWSIM_CMD_FRAME_BATCH message being filled for the wmediumd */
+    spinlock_t tx_batch_lock;
+    struct sk_buff *tx_batch;
+    void *tx_batch_hdr;
+    struct nlattr *tx_batch_nest;	/* HWSIM_ATTR_FRAMES */
+    unsigned int tx_batch_count;
+    bool tx_batch_held;	/* a TXQ burst is being collected */
+    struct hrtimer tx_batch_timer;
 
     /* difference between this hw's clock and the real clock, in usecs */
     s64 tsf_offset;
@@ -635,12 +1097,7 @@ struct wifi_hwsim_data {
     u64 abs_bcn_ts;
 
     /* Stats */
-    u64 tx_pkts;
-    u64 rx_pkts;
-    u64 tx_bytes;
-    u64 rx_bytes;
-    u64 tx_dropped;
-    u64 tx_failed;
+    struct hwsim_pcpu_stats __percpu *stats;
 
 /* RSSI in rx status of the receiver */
 	int rx_rssi;
@@ -19,6 +19,12 @@ static struct argp_option options[] = {
         {"chanctx",   't', 0,      0, "Use chantx (flag)",                         2},
         {"alphareg",  'a', "STR",  0, "reg_alpha2 hint",                           2},
         {"customreg", 'r', "REG",  0, "reg_domain ID int",                         2},
+        {"txq",       'q', 0,      0, "Pull frames from mac80211 TXQs (flag)",     2},
+        {"qhigh",     'H', "NUM",  0, "Frames awaiting medium TX status at most",  2},
+        {"qlow",      'L', "NUM",  0, "Frames awaiting TX status to resume at",    2},
+        {"backpress", 'b', 0,      0, "Stop queues instead of dropping (flag)",    2},
+        {"group",     'g', "MASK", 0, "Bitmap of the groups the radio is in",      2},
+        {"count",     'N', "NUM",  0, "Create NUM radios, -n is a name prefix",    2},
         {0,           0,   0,      0, "General:",                                  -1},
         {0,           0,   0,      0, 0,                                           0}
 };
@@ -44,6 +50,19 @@ uint32_t cli_get_uint32(const char opt, const char *arg) {
     return (uint32_t) ul;
 }
 
+/* group masks are easier to give in hex, so any base strtoull knows is taken */
+uint64_t cli_get_uint64(const char opt, const char *arg) {
+    char *endptr = NULL;
+    unsigned long long ull;
+
+    errno = 0;
+    ull = strtoull(arg, &endptr, 0);
+    if (!*arg || *endptr || errno == ERANGE || *arg == '-') {
+        argp_err_and_usage("-%c requires a positive integer attribute (max 64 bit)\n", opt);
+    }
+    return (uint64_t) ull;
+}
+
 error_t hwsim_parse_argp(int key, char *arg, struct argp_state *state) {
     hwsim_args *arguments = state->input;
     switch (key) {
@@ -92,6 +111,28 @@ error_t hwsim_parse_argp(int key, char *arg, struct argp_state *state) {
         case 'r':
             arguments->c_reg_custom_reg = cli_get_uint32('r', arg);
             break;
+        case 'q':
+            arguments->c_use_txq = true;
+            break;
+        case 'H':
+            arguments->c_txq_high = cli_get_uint32('H', arg);
+            break;
+        case 'L':
+            arguments->c_txq_low = cli_get_uint32('L', arg);
+            arguments->c_txq_low_set = true;
+            break;
+        case 'b':
+            arguments->c_backpressure = true;
+            break;
+        case 'g':
+            arguments->c_group = cli_get_uint64('g', arg);
+            break;
+        case 'N':
+            arguments->c_count = cli_get_uint32('N', arg);
+            if (!arguments->c_count || arguments->c_count > HWSIM_NEW_RADIO_BATCH_MAX) {
+                argp_err_and_usage("-N must be between 1 and %d\n", HWSIM_NEW_RADIO_BATCH_MAX);
+            }
+            break;
         case 'h':
             argp_help(&ctx.hwsim_argp, stdout, ARGP_HELP_STD_HELP, program_executable);
             exit(EXIT_SUCCESS);
@@ -122,10 +163,13 @@ int handleCreate(const hwsim_args *args) {
     };
     if ((ret = create_radio(&ctx.nl_ctx, args->c_channels, args->c_no_vif, args->c_hwname, args->c_use_chanctx,
                             args->c_reg_alpha2,
-                            args->c_reg_custom_reg))) {
+                            args->c_reg_custom_reg, args->c_use_txq,
+                            args->c_txq_high, args->c_txq_low_set, args->c_txq_low, args->c_backpressure,
+                            args->c_group, args->c_count))) {
         return ret;
     }
-    return wait_for_event();
+    /* the radios of a batch are registered before the reply is sent */
+    return wait_for_event(2 + args->c_count / 8);
 }
 
 int handleDeleteById(const hwsim_args *args) {
@@ -137,7 +181,7 @@ int handleDeleteById(const hwsim_args *args) {
     if ((ret = delete_radio_by_id(&ctx.nl_ctx, args->del_radio_id))) {
         return ret;
     }
-    return wait_for_event();
+    return wait_for_event(2);
 }
 
 int handleDeleteByName(const hwsim_args *args) {
@@ -149,7 +193,7 @@ int handleDeleteByName(const hwsim_args *args) {
     if ((ret = delete_radio_by_name(&ctx.nl_ctx, args->del_radio_name))) {
         return ret;
     }
-    return wait_for_event();
+    return wait_for_event(2);
 }
 
 int handleSetRSSI(const hwsim_args *args, char *rssi) {
@@ -161,7 +205,7 @@ int handleSetRSSI(const hwsim_args *args, char *rssi) {
     if ((ret = set_rssi(&ctx.nl_ctx, args->rssi_radio, cli_get_uint32('d', rssi)))) {
         return ret;
     }
-    return wait_for_event();
+    return wait_for_event(2);
 }
 
 void notify_device_creation(int id) {
@@ -169,6 +213,13 @@ void notify_device_creation(int id) {
     exit(EXIT_SUCCESS);
 }
 
+void notify_batch_creation(const uint32_t *ids, uint32_t n_ids) {
+    for (uint32_t i = 0; i < n_ids; i++) {
+        printf("Created device with ID %u\n", ids[i]);
+    }
+    exit(EXIT_SUCCESS);
+}
+
 void notify_device_deletion() {
     if (ctx.args.mode == HWSIM_OP_DELETE_BY_ID) {
         printf("Successfully deleted device with ID %d\n", ctx.args.del_radio_id);
@@ -194,6 +245,13 @@ int main(int argc, char **argv) {
             .c_use_chanctx = false,
             .c_reg_alpha2 = NULL,
             .c_reg_custom_reg = 0,
+            .c_use_txq = false,
+            .c_txq_high = 0,
+            .c_txq_low_set = false,
+            .c_txq_low = 0,
+            .c_backpressure = false,
+            .c_group = 0,
+            .c_count = 0,
             .del_radio_id = 0,
             .del_radio_name = NULL,
             .rssi_radio = 0
@@ -21,6 +21,13 @@ typedef struct {
     bool c_use_chanctx;
     char *c_reg_alpha2;
     uint32_t c_reg_custom_reg;
+    bool c_use_txq;
+    uint32_t c_txq_high;
+    bool c_txq_low_set;
+    uint32_t c_txq_low;
+    bool c_backpressure;
+    uint64_t c_group;
+    uint32_t c_count;
     uint32_t del_radio_id;
     char *del_radio_name;
     uint32_t rssi_radio;
@@ -42,6 +49,8 @@ int handleSetRSSI(const hwsim_args *args, char *rssi);
 
 void notify_device_creation(int id);
 
+void notify_batch_creation(const uint32_t *ids, uint32_t n_ids);
+
 void notify_device_deletion();
 
 void notify_device_setRSSI();
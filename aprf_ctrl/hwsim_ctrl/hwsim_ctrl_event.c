@@ -13,6 +13,15 @@ static int nl_msg_cb(struct nl_msg *msg, void *rctx) {
     struct nlmsghdr *nlh = nlmsg_hdr(msg);
     struct genlmsghdr *gnlh = nlmsg_data(nlh);
     int retcode = gnlh->cmd;
+    if (nlh->nlmsg_type != NLMSG_ERROR && retcode == HWSIM_CMD_NEW_RADIO_BATCH) {
+        struct nlattr *attrs[__HWSIM_ATTR_MAX];
+        if (genlmsg_parse(nlh, 0, attrs, __HWSIM_ATTR_MAX - 1, NULL) || !attrs[HWSIM_ATTR_RADIO_IDS]) {
+            fprintf(stderr, "Malformed reply on device creation\n");
+            exit(EXIT_FAILURE);
+        }
+        notify_batch_creation(nla_data(attrs[HWSIM_ATTR_RADIO_IDS]),
+                              nla_len(attrs[HWSIM_ATTR_RADIO_IDS]) / sizeof(uint32_t));
+    }
     if (retcode == 0) {
         if (!pthread_mutex_trylock(&nl_cb_mutex)) {
             if (ctx->args.mode == HWSIM_OP_CREATE) {
@@ -96,8 +105,8 @@ int register_event(hwsim_cli_ctx *ctx) {
     return pthread_create(&libe_thread, NULL, run_nl_event_dispatcher, ctx);
 }
 
-int wait_for_event() {
-    sleep(2);
-    fprintf(stderr, "Did not receive netlink event after 2 sec\n");
+int wait_for_event(unsigned int secs) {
+    sleep(secs);
+    fprintf(stderr, "Did not receive netlink event after %u sec\n", secs);
     return EXIT_FAILURE;
 }
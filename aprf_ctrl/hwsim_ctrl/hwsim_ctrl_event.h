@@ -7,6 +7,6 @@
 
 int register_event(hwsim_cli_ctx *ctx);
 
-int wait_for_event();
+int wait_for_event(unsigned int secs);
 
 #endif //WEMU_CTRL_HWSIM_CTRL_EVENT_H
@@ -44,7 +44,10 @@ int init_netlink(netlink_ctx *ctx) {
 
 int create_radio(const netlink_ctx *ctx, const uint32_t channels, const bool no_vif, const char *hwname,
                  const bool use_chanctx, const char *reg_alpha2,
-                 const uint32_t reg_custom_reg) {
+                 const uint32_t reg_custom_reg, const bool use_txq,
+                 const uint32_t txq_high, const bool txq_low_set, const uint32_t txq_low,
+                 const bool backpressure,
+                 const uint64_t group, const uint32_t count) {
     struct nl_msg *msg;
     msg = nlmsg_alloc();
 
@@ -55,12 +58,15 @@ int create_radio(const netlink_ctx *ctx, const uint32_t channels, const bool no_
     int fam_id = genl_family_get_id(ctx->family);
     if (genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ,
                     fam_id, 0,
-                    NLM_F_REQUEST, HWSIM_CMD_NEW_RADIO,
+                    NLM_F_REQUEST, count ? HWSIM_CMD_NEW_RADIO_BATCH : HWSIM_CMD_NEW_RADIO,
                     1) == NULL) {
         fprintf(stderr, "Error in genlmsg_put!\n");
         nlmsg_free(msg);
         return EXIT_FAILURE;
     }
+    if (count != 0) {
+        nla_put_u32(msg, HWSIM_ATTR_RADIO_COUNT, count);
+    }
     if (channels != 0) {
         nla_put_u32(msg, HWSIM_ATTR_CHANNELS, channels);
     }
@@ -79,6 +85,22 @@ int create_radio(const netlink_ctx *ctx, const uint32_t channels, const bool no_
     if (reg_custom_reg != 0) {
         nla_put_u32(msg, HWSIM_ATTR_REG_CUSTOM_REG, reg_custom_reg);
     }
+    if (use_txq) {
+        nla_put_flag(msg, HWSIM_ATTR_USE_TXQ);
+    }
+    if (txq_high != 0) {
+        nla_put_u32(msg, HWSIM_ATTR_TX_QUEUE_HIGH, txq_high);
+    }
+    /* 0 is a valid low watermark, so it is sent whenever it was given */
+    if (txq_low_set) {
+        nla_put_u32(msg, HWSIM_ATTR_TX_QUEUE_LOW, txq_low);
+    }
+    if (backpressure) {
+        nla_put_flag(msg, HWSIM_ATTR_TX_BACKPRESSURE);
+    }
+    if (group != 0) {
+        nla_put_u64(msg, HWSIM_ATTR_GROUP, group);
+    }
     if (nl_send_auto(ctx->sock, msg) < 0) {
         fprintf(stderr, "Error sending message!\n");
         nlmsg_free(msg);
@@ -10,7 +10,15 @@
 #define HWSIM_CMD_NEW_RADIO 4
 #define HWSIM_CMD_DEL_RADIO 5
 #define HWSIM_CMD_GET_RADIO 6
-#define __HWSIM_CMD_MAX 7
+#define HWSIM_CMD_ADD_MAC_ADDR 7
+#define HWSIM_CMD_DEL_MAC_ADDR 8
+#define HWSIM_CMD_START_PMSR 9
+#define HWSIM_CMD_ABORT_PMSR 10
+#define HWSIM_CMD_REPORT_PMSR 11
+#define HWSIM_CMD_FRAME_BATCH 12
+#define HWSIM_CMD_TX_INFO_BATCH 13
+#define HWSIM_CMD_NEW_RADIO_BATCH 14
+#define __HWSIM_CMD_MAX 15
 
 #define HWSIM_ATTR_UNSPEC 0
 #define HWSIM_ATTR_ADDR_RECEIVER 1
@@ -33,7 +41,35 @@
 #define HWSIM_ATTR_NO_VIF 18
 #define HWSIM_ATTR_FREQ 19
 #define HWSIM_ATTR_PAD 20
-#define __HWSIM_ATTR_MAX 21
+#define HWSIM_ATTR_TX_INFO_FLAGS 21
+#define HWSIM_ATTR_PERM_ADDR 22
+#define HWSIM_ATTR_IFTYPE_SUPPORT 23
+#define HWSIM_ATTR_CIPHER_SUPPORT 24
+#define HWSIM_ATTR_MLO_SUPPORT 25
+#define HWSIM_ATTR_PMSR_SUPPORT 26
+#define HWSIM_ATTR_PMSR_REQUEST 27
+#define HWSIM_ATTR_PMSR_RESULT 28
+#define HWSIM_ATTR_USE_TXQ 29
+#define HWSIM_ATTR_REGISTER_FLAGS 30
+#define HWSIM_ATTR_FRAMES 31
+#define HWSIM_ATTR_TX_INFO_BATCH 32
+#define HWSIM_ATTR_TX_QUEUE_HIGH 33
+#define HWSIM_ATTR_TX_QUEUE_LOW 34
+#define HWSIM_ATTR_TX_BACKPRESSURE 35
+#define HWSIM_ATTR_SHARD_ID 36
+#define HWSIM_ATTR_SHARD_COUNT 37
+#define HWSIM_ATTR_CHANNEL_WIDTH 38
+#define HWSIM_ATTR_CENTER_FREQ1 39
+#define HWSIM_ATTR_CENTER_FREQ2 40
+#define HWSIM_ATTR_TX_DESC 41
+#define HWSIM_ATTR_GROUP 42
+#define HWSIM_ATTR_RADIO_COUNT 43
+#define HWSIM_ATTR_RADIOS 44
+#define HWSIM_ATTR_RADIO_IDS 45
+#define __HWSIM_ATTR_MAX 46
+
+/* most radios one HWSIM_CMD_NEW_RADIO_BATCH creates */
+#define HWSIM_NEW_RADIO_BATCH_MAX 128
 
 typedef struct {
     struct nl_cb *cb;
@@ -46,7 +82,10 @@ int init_netlink(netlink_ctx *ctx);
 
 int create_radio(const netlink_ctx *ctx, const uint32_t channels, const bool no_vif, const char *hwname,
                  const bool use_chanctx, const char *reg_alpha2,
-                 const uint32_t reg_custom_reg);
+                 const uint32_t reg_custom_reg, const bool use_txq,
+                 const uint32_t txq_high, const bool txq_low_set, const uint32_t txq_low,
+                 const bool backpressure,
+                 const uint64_t group, const uint32_t count);
 
 int delete_radio_by_id(const netlink_ctx *ctx, const uint32_t radio_id);
 
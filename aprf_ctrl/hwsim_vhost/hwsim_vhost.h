@@ -0,0 +1,279 @@
+#ifndef WEMU_CTRL_HWSIM_VHOST_H
+#define WEMU_CTRL_HWSIM_VHOST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <event.h>
+#include <linux/virtio_ring.h>
+
+#define UNUSED(x) (void)(x)
+
+/* the device as the driver sees it, see include/aprf_drv.h */
+#define VIRTIO_ID_MAC80211_HWSIM 29
+#define VIRTIO_HWSIM_F_MQ 0
+#define VIRTIO_HWSIM_F_RX_BUF_LEN 1
+#define HWSIM_VQ_TX 0
+#define HWSIM_VQ_RX 1
+#define HWSIM_NUM_VQS 2
+#define HWSIM_VHOST_MAX_QUEUE_PAIRS 16
+#define HWSIM_VHOST_MAX_VQS (HWSIM_VHOST_MAX_QUEUE_PAIRS * HWSIM_NUM_VQS)
+/* largest split virtqueue the virtio spec allows */
+#define HWSIM_VHOST_MAX_VRING_NUM 32768
+
+#define HWSIM_TX_CTL_REQ_TX_STATUS (1 << 0)
+#define HWSIM_TX_CTL_NO_ACK (1 << 1)
+#define HWSIM_TX_STAT_ACK (1 << 2)
+#define IEEE80211_TX_MAX_RATES 4
+#define ETH_ALEN 6
+
+/* vhost-user protocol, see docs/interop/vhost-user.rst in QEMU */
+#define VIRTIO_F_VERSION_1 32
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ 0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK 3
+#define VHOST_USER_PROTOCOL_F_CONFIG 9
+
+#define VHOST_USER_GET_FEATURES 1
+#define VHOST_USER_SET_FEATURES 2
+#define VHOST_USER_SET_OWNER 3
+#define VHOST_USER_RESET_OWNER 4
+#define VHOST_USER_SET_MEM_TABLE 5
+#define VHOST_USER_SET_LOG_BASE 6
+#define VHOST_USER_SET_LOG_FD 7
+#define VHOST_USER_SET_VRING_NUM 8
+#define VHOST_USER_SET_VRING_ADDR 9
+#define VHOST_USER_SET_VRING_BASE 10
+#define VHOST_USER_GET_VRING_BASE 11
+#define VHOST_USER_SET_VRING_KICK 12
+#define VHOST_USER_SET_VRING_CALL 13
+#define VHOST_USER_SET_VRING_ERR 14
+#define VHOST_USER_GET_PROTOCOL_FEATURES 15
+#define VHOST_USER_SET_PROTOCOL_FEATURES 16
+#define VHOST_USER_GET_QUEUE_NUM 17
+#define VHOST_USER_SET_VRING_ENABLE 18
+#define VHOST_USER_GET_CONFIG 24
+#define VHOST_USER_SET_CONFIG 25
+
+#define VHOST_USER_VERSION 0x1
+#define VHOST_USER_VERSION_MASK 0x3
+#define VHOST_USER_REPLY_MASK (1 << 2)
+#define VHOST_USER_NEED_REPLY_MASK (1 << 3)
+#define VHOST_USER_VRING_IDX_MASK 0xff
+#define VHOST_USER_VRING_NOFD_MASK (1 << 8)
+
+#define VHOST_MEMORY_MAX_NREGIONS 8
+#define VHOST_USER_CONFIG_MAX 256
+
+typedef struct {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;
+} vhost_user_mem_region;
+
+typedef struct {
+    uint32_t nregions;
+    uint32_t padding;
+    vhost_user_mem_region regions[VHOST_MEMORY_MAX_NREGIONS];
+} vhost_user_memory;
+
+typedef struct {
+    uint32_t index;
+    uint32_t num;
+} vhost_user_vring_state;
+
+typedef struct {
+    uint32_t index;
+    uint32_t flags;
+    uint64_t desc_user_addr;
+    uint64_t used_user_addr;
+    uint64_t avail_user_addr;
+    uint64_t log_guest_addr;
+} vhost_user_vring_addr;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_CONFIG_MAX];
+} vhost_user_config;
+
+typedef struct {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+    union {
+        uint64_t u64;
+        vhost_user_vring_state state;
+        vhost_user_vring_addr addr;
+        vhost_user_memory memory;
+        vhost_user_config config;
+    } payload;
+} __attribute__((packed)) vhost_user_msg;
+
+#define VHOST_USER_HDR_SIZE (3 * sizeof(uint32_t))
+
+/* one guest memory region mapped into this process */
+typedef struct {
+    uint64_t gpa;
+    uint64_t uva;
+    uint64_t size;
+    void *mmap_addr;
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+} hwsim_mem_region;
+
+typedef struct hwsim_vhost_dev hwsim_vhost_dev;
+
+/* one split virtqueue */
+typedef struct {
+    hwsim_vhost_dev *dev;
+    unsigned int index;
+    uint32_t num;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    bool enabled;
+    int kick_fd;
+    int call_fd;
+    struct event *kick_ev;
+    /* used entries added since the driver was last notified */
+    bool need_call;
+} hwsim_vring;
+
+/* counters of the bench mode, reset at every report */
+typedef struct {
+    uint64_t tx_frames;
+    uint64_t tx_bytes;
+    uint64_t rx_frames;
+    uint64_t rx_bytes;
+    uint64_t rx_no_buf;
+    uint64_t rx_lost;
+    uint64_t tx_info;
+    uint64_t tx_info_dropped;
+    uint64_t kicks;
+    /* kick to driver notified, per TX kick */
+    uint64_t kick_lat_sum_ns;
+    uint64_t kick_lat_max_ns;
+    /* RX buffer handed to the driver to the driver posting it again */
+    uint64_t rx_lat_sum_ns;
+    uint64_t rx_lat_max_ns;
+    uint64_t rx_lat_count;
+    uint64_t rx_lat_hist[32];
+} hwsim_vhost_stats;
+
+typedef struct {
+    int8_t idx;
+    uint8_t count;
+} __attribute__((packed)) hwsim_tx_rate;
+
+/* a TX status waiting for an RX buffer */
+typedef struct {
+    unsigned int pair;
+    uint8_t transmitter[ETH_ALEN];
+    uint32_t flags;
+    hwsim_tx_rate rates[IEEE80211_TX_MAX_RATES];
+    uint64_t cookie;
+} hwsim_tx_status;
+
+/* TX statuses kept while the driver has no RX buffers posted */
+#define HWSIM_VHOST_STATUS_BACKLOG 4096
+
+typedef struct {
+    uint8_t perm_addr[ETH_ALEN];
+    /* addresses of the radio's interfaces, from HWSIM_CMD_ADD_MAC_ADDR */
+    uint8_t (*vif_addrs)[ETH_ALEN];
+    unsigned int n_vif_addrs;
+    /* last channel the radio transmitted on, 0 before that */
+    uint32_t freq;
+} hwsim_vhost_radio;
+
+typedef struct {
+    hwsim_vhost_radio *radios;
+    unsigned int n_radios;
+    /* per delivery attempt, in percent */
+    uint32_t loss;
+    int32_t signal;
+    hwsim_tx_status *backlog;
+    uint32_t backlog_head;
+    uint32_t backlog_count;
+    /* bench mode */
+    bool bench;
+    uint32_t bench_secs;
+    uint32_t inject_pps;
+    uint32_t inject_len;
+    uint32_t inject_next;
+    double inject_credit;
+    struct timespec inject_last;
+    uint32_t bench_reports;
+    struct event *bench_ev;
+    struct event *inject_ev;
+    struct timespec bench_start;
+    struct timespec bench_last;
+    hwsim_vhost_stats stats;
+} hwsim_medium;
+
+struct hwsim_vhost_dev {
+    struct event_base *base;
+    const char *socket_path;
+    int listen_fd;
+    int conn_fd;
+    struct event *listen_ev;
+    struct event *conn_ev;
+    uint64_t features;
+    uint64_t protocol_features;
+    uint16_t queue_pairs;
+    /* size of the driver's RX buffers, 0 until it writes it to the config */
+    uint32_t rx_buf_len;
+    unsigned int n_regions;
+    hwsim_mem_region regions[VHOST_MEMORY_MAX_NREGIONS];
+    hwsim_vring vrings[HWSIM_VHOST_MAX_VQS];
+    /* when the RX buffers the driver has not posted again yet were filled */
+    struct timespec *rx_posted[HWSIM_VHOST_MAX_QUEUE_PAIRS];
+    uint32_t rx_posted_head[HWSIM_VHOST_MAX_QUEUE_PAIRS];
+    uint32_t rx_posted_count[HWSIM_VHOST_MAX_QUEUE_PAIRS];
+    uint16_t rx_avail_seen[HWSIM_VHOST_MAX_QUEUE_PAIRS];
+    hwsim_medium medium;
+};
+
+/* hwsim_vhost_user.c */
+void vhost_dev_init(hwsim_vhost_dev *dev);
+
+int vhost_dev_listen(hwsim_vhost_dev *dev);
+
+void vhost_dev_close(hwsim_vhost_dev *dev);
+
+bool vring_ready(const hwsim_vring *vr);
+
+uint16_t vring_avail_idx(const hwsim_vring *vr);
+
+/* copy the next TX message of @vr into @buf, 0 if there is none */
+int vring_pop_tx(hwsim_vring *vr, void *buf, uint32_t cap, uint32_t *len);
+
+/* post @len bytes of @buf in the next RX buffer of @vr, -ENOBUFS if none */
+int vring_push_rx(hwsim_vring *vr, const void *buf, uint32_t len);
+
+void vring_notify(hwsim_vring *vr);
+
+/* hwsim_vhost_medium.c */
+void medium_handle_msg(hwsim_vhost_dev *dev, unsigned int pair, const void *buf, uint32_t len);
+
+void medium_rx_reposted(hwsim_vhost_dev *dev, unsigned int pair);
+
+int medium_init(hwsim_vhost_dev *dev);
+
+/* the bench mode measures from when a front-end connects */
+void medium_bench_restart(hwsim_vhost_dev *dev);
+
+/* forget the radios and statuses of a front-end that went away */
+void medium_reset(hwsim_medium *medium);
+
+void medium_free(hwsim_medium *medium);
+
+uint64_t ts_diff_ns(const struct timespec *a, const struct timespec *b);
+
+#endif //WEMU_CTRL_HWSIM_VHOST_H
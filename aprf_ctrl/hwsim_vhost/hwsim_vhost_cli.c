@@ -0,0 +1,167 @@
+#include <argp.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hwsim_vhost.h"
+
+static char *program_executable = "aprf_vhost";
+static const char doc[] = "vhost-user backend acting as the medium of aprf-driver in virtio mode";
+static struct argp_option options[] = {
+        {0,        0,   0,         0, "Device:",                                            1},
+        {"socket", 's', "PATH",    0, "vhost-user socket to listen on (required)",          1},
+        {"queues", 'q', "NUM",     0, "Queue pairs to offer, 1-16 (default 1)",              1},
+        {0,        0,   0,         0, "Medium:",                                            2},
+        {"loss",   'l', "PERCENT", 0, "Chance for every delivery attempt to fail",          2},
+        {"signal", 'g', "DBM",     0, "Signal of delivered frames (default -50)",            2},
+        {0,        0,   0,         0, "Benchmark:",                                         3},
+        {"bench",  'B', 0,         0, "Print throughput and latency every second (flag)",   3},
+        {"time",   't', "SECS",    0, "Exit that many seconds after a front-end connects",  3},
+        {"inject", 'i', "PPS",     0, "Inject that many frames per second into the radios", 3},
+        {"size",   'z', "BYTES",   0, "Size of injected frames (default 1000)",             3},
+        {0,        0,   0,         0, "General:",                                           -1},
+        {0,        0,   0,         0, 0,                                                    0}
+};
+
+static struct argp vhost_argp;
+static hwsim_vhost_dev dev;
+
+static void argp_err_and_usage(const char *err_msg, ...) {
+    va_list(args);
+    va_start(args, err_msg);
+    vfprintf(stderr, err_msg, args);
+    va_end(args);
+    argp_help(&vhost_argp, stdout, ARGP_HELP_STD_USAGE, program_executable);
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t cli_get_uint32(const char opt, const char *arg) {
+    char *endptr = NULL;
+    errno = 0;
+    unsigned long ul = strtoul(arg, &endptr, 10);
+    if (!*arg || *endptr || (ul == ULONG_MAX && errno == ERANGE) || ul > UINT32_MAX) {
+        argp_err_and_usage("-%c requires a positive integer attribute (max 32 bit)\n", opt);
+    }
+    return (uint32_t) ul;
+}
+
+static int32_t cli_get_int32(const char opt, const char *arg) {
+    char *endptr = NULL;
+    errno = 0;
+    long l = strtol(arg, &endptr, 10);
+    if (!*arg || *endptr || errno == ERANGE || l < INT32_MIN || l > INT32_MAX) {
+        argp_err_and_usage("-%c requires an integer attribute (32 bit)\n", opt);
+    }
+    return (int32_t) l;
+}
+
+static error_t vhost_parse_argp(int key, char *arg, struct argp_state *state) {
+    hwsim_vhost_dev *d = state->input;
+    switch (key) {
+        case 's':
+            d->socket_path = arg;
+            break;
+        case 'q':
+            d->queue_pairs = (uint16_t) cli_get_uint32('q', arg);
+            if (!d->queue_pairs || d->queue_pairs > HWSIM_VHOST_MAX_QUEUE_PAIRS) {
+                argp_err_and_usage("-q must be between 1 and %d\n", HWSIM_VHOST_MAX_QUEUE_PAIRS);
+            }
+            break;
+        case 'l':
+            d->medium.loss = cli_get_uint32('l', arg);
+            if (d->medium.loss > 100) {
+                argp_err_and_usage("-l is a percentage\n");
+            }
+            break;
+        case 'g':
+            d->medium.signal = cli_get_int32('g', arg);
+            break;
+        case 'B':
+            d->medium.bench = true;
+            break;
+        case 't':
+            d->medium.bench_secs = cli_get_uint32('t', arg);
+            break;
+        case 'i':
+            d->medium.inject_pps = cli_get_uint32('i', arg);
+            break;
+        case 'z':
+            d->medium.inject_len = cli_get_uint32('z', arg);
+            break;
+        case ARGP_KEY_ARG:
+            return 0;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static void signal_cb(int fd, short what, void *rctx) {
+    UNUSED(fd);
+    UNUSED(what);
+    event_base_loopexit(rctx, NULL);
+}
+
+int main(int argc, char **argv) {
+    struct event *ev_int, *ev_term;
+    int ret = EXIT_FAILURE;
+
+    dev.queue_pairs = 1;
+    dev.medium.signal = -50;
+    dev.medium.inject_len = 1000;
+
+    struct argp argp = {options, vhost_parse_argp, 0, doc, 0, 0, 0};
+    vhost_argp = argp;
+    argp_parse(&vhost_argp, argc, argv, 0, 0, &dev);
+    if (!dev.socket_path) {
+        argp_err_and_usage("-s is required\n");
+    }
+    if ((dev.medium.bench_secs || dev.medium.inject_pps) && !dev.medium.bench) {
+        argp_err_and_usage("-t and -i only apply to the bench mode (-B)\n");
+    }
+
+    srand((unsigned int) time(NULL));
+    vhost_dev_init(&dev);
+    dev.base = event_base_new();
+    if (!dev.base) {
+        fprintf(stderr, "Error creating event base\n");
+        return EXIT_FAILURE;
+    }
+    ev_int = evsignal_new(dev.base, SIGINT, signal_cb, dev.base);
+    ev_term = evsignal_new(dev.base, SIGTERM, signal_cb, dev.base);
+    if (!ev_int || !ev_term || event_add(ev_int, NULL) || event_add(ev_term, NULL)) {
+        fprintf(stderr, "Error adding signal events\n");
+        goto out;
+    }
+
+    if (vhost_dev_listen(&dev) || medium_init(&dev)) {
+        goto out;
+    }
+    event_base_dispatch(dev.base);
+    ret = EXIT_SUCCESS;
+
+    out:
+    vhost_dev_close(&dev);
+    medium_free(&dev.medium);
+    if (dev.listen_ev) {
+        event_free(dev.listen_ev);
+    }
+    if (dev.listen_fd >= 0) {
+        close(dev.listen_fd);
+        unlink(dev.socket_path);
+    }
+    if (ev_int) {
+        event_free(ev_int);
+    }
+    if (ev_term) {
+        event_free(ev_term);
+    }
+    event_base_free(dev.base);
+    return ret;
+}
@@ -0,0 +1,567 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/genetlink.h>
+#include <netlink/netlink.h>
+#include <netlink/msg.h>
+#include <netlink/attr.h>
+
+#include "hwsim_vhost.h"
+#include "../hwsim_ctrl/hwsim_ctrl_func.h"
+
+/* more than the largest message the driver takes, HWSIM_VIRTIO_RX_BUF_LEN */
+#define HWSIM_VHOST_RX_MSG_SIZE 4096
+/* what a frame message needs besides the frame */
+#define HWSIM_VHOST_RX_MSG_OVERHEAD 128
+
+static uint8_t rx_msg[HWSIM_VHOST_RX_MSG_SIZE] __attribute__((aligned(8)));
+
+/* address the bench mode injects frames from */
+static const uint8_t inject_src[ETH_ALEN] = {0x02, 0x00, 0x00, 0x00, 0xff, 0xff};
+static const uint8_t bcast_addr[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+uint64_t ts_diff_ns(const struct timespec *a, const struct timespec *b) {
+    return (uint64_t) (a->tv_sec - b->tv_sec) * 1000000000ULL + a->tv_nsec - b->tv_nsec;
+}
+
+static uint32_t msg_begin(uint8_t cmd) {
+    struct nlmsghdr *nlh = (struct nlmsghdr *) rx_msg;
+    struct genlmsghdr *gnlh = (struct genlmsghdr *) (rx_msg + NLMSG_HDRLEN);
+
+    memset(nlh, 0, NLMSG_HDRLEN);
+    memset(gnlh, 0, GENL_HDRLEN);
+    gnlh->cmd = cmd;
+    gnlh->version = 1;
+    return NLMSG_HDRLEN + GENL_HDRLEN;
+}
+
+static uint32_t msg_put(uint32_t off, uint16_t type, const void *data, uint16_t len) {
+    struct nlattr *nla = (struct nlattr *) (rx_msg + off);
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    memcpy(rx_msg + off + NLA_HDRLEN, data, len);
+    memset(rx_msg + off + nla->nla_len, 0, NLA_ALIGN(nla->nla_len) - nla->nla_len);
+    return off + NLA_ALIGN(nla->nla_len);
+}
+
+static uint32_t msg_put_u32(uint32_t off, uint16_t type, uint32_t value) {
+    return msg_put(off, type, &value, sizeof(value));
+}
+
+static uint32_t msg_end(uint32_t off) {
+    ((struct nlmsghdr *) rx_msg)->nlmsg_len = off;
+    return off;
+}
+
+static void record_rx_posted(hwsim_vhost_dev *dev, unsigned int pair) {
+    hwsim_vring *vr = &dev->vrings[pair * HWSIM_NUM_VQS + HWSIM_VQ_RX];
+    uint32_t count = dev->rx_posted_count[pair];
+
+    if (!dev->medium.bench) {
+        return;
+    }
+    if (!dev->rx_posted[pair]) {
+        dev->rx_posted[pair] = calloc(vr->num, sizeof(struct timespec));
+        if (!dev->rx_posted[pair]) {
+            return;
+        }
+    }
+    /* all earlier buffers are back, whatever the driver posted since is not ours */
+    if (!count) {
+        dev->rx_avail_seen[pair] = vring_avail_idx(vr);
+    }
+    if (count < vr->num) {
+        clock_gettime(CLOCK_MONOTONIC, &dev->rx_posted[pair][(dev->rx_posted_head[pair] + count) % vr->num]);
+        dev->rx_posted_count[pair]++;
+    }
+}
+
+/* hand one message to the driver, it goes out with the next notification */
+static int medium_push(hwsim_vhost_dev *dev, unsigned int pair, uint32_t len) {
+    hwsim_vring *vr = &dev->vrings[pair * HWSIM_NUM_VQS + HWSIM_VQ_RX];
+    int ret;
+
+    /* the driver drops what does not fit in its RX buffers */
+    if (dev->rx_buf_len && len > dev->rx_buf_len) {
+        return -EMSGSIZE;
+    }
+    ret = vring_push_rx(vr, rx_msg, len);
+    if (ret) {
+        return ret;
+    }
+    record_rx_posted(dev, pair);
+    return 0;
+}
+
+static hwsim_vhost_radio *radio_find(hwsim_medium *medium, const uint8_t *addr) {
+    for (unsigned int i = 0; i < medium->n_radios; i++) {
+        hwsim_vhost_radio *radio = &medium->radios[i];
+        if (!memcmp(radio->perm_addr, addr, ETH_ALEN)) {
+            return radio;
+        }
+        for (unsigned int j = 0; j < radio->n_vif_addrs; j++) {
+            if (!memcmp(radio->vif_addrs[j], addr, ETH_ALEN)) {
+                return radio;
+            }
+        }
+    }
+    return NULL;
+}
+
+static hwsim_vhost_radio *radio_get(hwsim_medium *medium, const uint8_t *perm_addr) {
+    hwsim_vhost_radio *radios;
+
+    for (unsigned int i = 0; i < medium->n_radios; i++) {
+        if (!memcmp(medium->radios[i].perm_addr, perm_addr, ETH_ALEN)) {
+            return &medium->radios[i];
+        }
+    }
+    radios = realloc(medium->radios, (medium->n_radios + 1) * sizeof(*radios));
+    if (!radios) {
+        return NULL;
+    }
+    medium->radios = radios;
+    memset(&radios[medium->n_radios], 0, sizeof(*radios));
+    memcpy(radios[medium->n_radios].perm_addr, perm_addr, ETH_ALEN);
+    return &radios[medium->n_radios++];
+}
+
+static void radio_vif_addr(hwsim_medium *medium, const uint8_t *perm_addr, const uint8_t *addr, bool add) {
+    hwsim_vhost_radio *radio = radio_get(medium, perm_addr);
+    uint8_t (*vif_addrs)[ETH_ALEN];
+
+    if (!radio) {
+        return;
+    }
+    for (unsigned int i = 0; i < radio->n_vif_addrs; i++) {
+        if (!memcmp(radio->vif_addrs[i], addr, ETH_ALEN)) {
+            if (!add) {
+                memmove(radio->vif_addrs[i], radio->vif_addrs[i + 1], (radio->n_vif_addrs - i - 1) * ETH_ALEN);
+                radio->n_vif_addrs--;
+            }
+            return;
+        }
+    }
+    if (!add) {
+        return;
+    }
+    vif_addrs = realloc(radio->vif_addrs, (radio->n_vif_addrs + 1) * ETH_ALEN);
+    if (!vif_addrs) {
+        return;
+    }
+    radio->vif_addrs = vif_addrs;
+    memcpy(radio->vif_addrs[radio->n_vif_addrs++], addr, ETH_ALEN);
+}
+
+static bool lost(const hwsim_medium *medium) {
+    return medium->loss && (uint32_t) (rand() % 100) < medium->loss;
+}
+
+static int push_tx_status(hwsim_vhost_dev *dev, const hwsim_tx_status *st) {
+    uint32_t off = msg_begin(HWSIM_CMD_TX_INFO_FRAME);
+
+    off = msg_put(off, HWSIM_ATTR_ADDR_TRANSMITTER, st->transmitter, ETH_ALEN);
+    off = msg_put_u32(off, HWSIM_ATTR_FLAGS, st->flags);
+    off = msg_put_u32(off, HWSIM_ATTR_SIGNAL, (uint32_t) dev->medium.signal);
+    off = msg_put(off, HWSIM_ATTR_TX_INFO, st->rates, sizeof(st->rates));
+    off = msg_put(off, HWSIM_ATTR_COOKIE, &st->cookie, sizeof(st->cookie));
+    if (medium_push(dev, st->pair, msg_end(off))) {
+        return -ENOBUFS;
+    }
+    dev->medium.stats.tx_info++;
+    return 0;
+}
+
+/* statuses go out in order, the ones that found no RX buffer wait here */
+static void flush_tx_status(hwsim_vhost_dev *dev) {
+    hwsim_medium *medium = &dev->medium;
+
+    while (medium->backlog_count) {
+        if (push_tx_status(dev, &medium->backlog[medium->backlog_head])) {
+            return;
+        }
+        medium->backlog_head = (medium->backlog_head + 1) % HWSIM_VHOST_STATUS_BACKLOG;
+        medium->backlog_count--;
+    }
+}
+
+static void queue_tx_status(hwsim_vhost_dev *dev, const hwsim_tx_status *st) {
+    hwsim_medium *medium = &dev->medium;
+
+    flush_tx_status(dev);
+    if (!medium->backlog_count && !push_tx_status(dev, st)) {
+        return;
+    }
+    if (medium->backlog_count == HWSIM_VHOST_STATUS_BACKLOG) {
+        /* the driver never learns how this frame went */
+        medium->stats.tx_info_dropped++;
+        return;
+    }
+    medium->backlog[(medium->backlog_head + medium->backlog_count) % HWSIM_VHOST_STATUS_BACKLOG] = *st;
+    medium->backlog_count++;
+}
+
+static void deliver(hwsim_vhost_dev *dev, unsigned int pair, const hwsim_vhost_radio *radio,
+                    const struct nlattr *frame, uint32_t freq, uint32_t rate_idx) {
+    uint32_t off;
+
+    if (nla_len(frame) > HWSIM_VHOST_RX_MSG_SIZE - HWSIM_VHOST_RX_MSG_OVERHEAD) {
+        return;
+    }
+    off = msg_begin(HWSIM_CMD_FRAME);
+    off = msg_put(off, HWSIM_ATTR_ADDR_RECEIVER, radio->perm_addr, ETH_ALEN);
+    off = msg_put(off, HWSIM_ATTR_FRAME, nla_data(frame), nla_len(frame));
+    off = msg_put_u32(off, HWSIM_ATTR_RX_RATE, rate_idx);
+    off = msg_put_u32(off, HWSIM_ATTR_SIGNAL, (uint32_t) dev->medium.signal);
+    if (freq) {
+        off = msg_put_u32(off, HWSIM_ATTR_FREQ, freq);
+    }
+    if (medium_push(dev, pair, msg_end(off))) {
+        dev->medium.stats.rx_no_buf++;
+        return;
+    }
+    dev->medium.stats.rx_frames++;
+    dev->medium.stats.rx_bytes += nla_len(frame);
+}
+
+/*
+ * Every other radio hears the frame, each losing it with the configured
+ * probability. A unicast frame is retried along its rate table until its
+ * receiver gets it, the TX status reports the attempts that took.
+ */
+static void medium_tx(hwsim_vhost_dev *dev, unsigned int pair, struct nlattr **tb) {
+    hwsim_medium *medium = &dev->medium;
+    const uint8_t *frame, *transmitter;
+    hwsim_vhost_radio *radio, *dst = NULL;
+    hwsim_tx_status st = {.pair = pair};
+    uint32_t freq = 0, rate_idx = 0;
+    bool unicast, acked = false;
+    unsigned int i;
+
+    if (!tb[HWSIM_ATTR_ADDR_TRANSMITTER] || nla_len(tb[HWSIM_ATTR_ADDR_TRANSMITTER]) != ETH_ALEN ||
+        !tb[HWSIM_ATTR_FRAME] || nla_len(tb[HWSIM_ATTR_FRAME]) < 10 ||
+        !tb[HWSIM_ATTR_FLAGS] || !tb[HWSIM_ATTR_COOKIE] ||
+        !tb[HWSIM_ATTR_TX_INFO] || nla_len(tb[HWSIM_ATTR_TX_INFO]) < (int) sizeof(st.rates)) {
+        return;
+    }
+    transmitter = nla_data(tb[HWSIM_ATTR_ADDR_TRANSMITTER]);
+    frame = nla_data(tb[HWSIM_ATTR_FRAME]);
+    if (tb[HWSIM_ATTR_FREQ]) {
+        freq = nla_get_u32(tb[HWSIM_ATTR_FREQ]);
+    }
+
+    radio = radio_get(medium, transmitter);
+    if (!radio) {
+        return;
+    }
+    radio->freq = freq;
+    medium->stats.tx_frames++;
+    medium->stats.tx_bytes += nla_len(tb[HWSIM_ATTR_FRAME]);
+
+    memcpy(st.transmitter, transmitter, ETH_ALEN);
+    memcpy(st.rates, nla_data(tb[HWSIM_ATTR_TX_INFO]), sizeof(st.rates));
+    st.flags = nla_get_u32(tb[HWSIM_ATTR_FLAGS]);
+    st.cookie = nla_get_u64(tb[HWSIM_ATTR_COOKIE]);
+
+    /* addr1 of the 802.11 header */
+    unicast = !(frame[4] & 0x01) && !(st.flags & HWSIM_TX_CTL_NO_ACK);
+    if (unicast) {
+        dst = radio_find(medium, frame + 4);
+        if (dst == radio) {
+            dst = NULL;
+        }
+    }
+
+    if (unicast && dst) {
+        for (i = 0; i < IEEE80211_TX_MAX_RATES && !acked && st.rates[i].idx >= 0; i++) {
+            for (uint8_t n = 1; n <= st.rates[i].count; n++) {
+                if (!lost(medium)) {
+                    st.rates[i].count = n;
+                    rate_idx = st.rates[i].idx;
+                    acked = true;
+                    break;
+                }
+            }
+        }
+        /* rates after the one that got through were not tried */
+        for (; acked && i < IEEE80211_TX_MAX_RATES; i++) {
+            st.rates[i].idx = -1;
+            st.rates[i].count = 0;
+        }
+    } else {
+        /* sent once at the first rate, nobody acknowledges it */
+        if (st.rates[0].idx >= 0) {
+            st.rates[0].count = 1;
+            rate_idx = st.rates[0].idx;
+        }
+        for (i = 1; i < IEEE80211_TX_MAX_RATES; i++) {
+            st.rates[i].idx = -1;
+            st.rates[i].count = 0;
+        }
+    }
+    if (acked) {
+        st.flags |= HWSIM_TX_STAT_ACK;
+    }
+
+    /* the status first, the driver is waiting on it to free the frame */
+    queue_tx_status(dev, &st);
+
+    for (i = 0; i < medium->n_radios; i++) {
+        hwsim_vhost_radio *rx = &medium->radios[i];
+        if (rx == radio) {
+            continue;
+        }
+        if (rx == dst ? !acked : lost(medium)) {
+            medium->stats.rx_lost++;
+            continue;
+        }
+        deliver(dev, pair, rx, tb[HWSIM_ATTR_FRAME], freq, rate_idx);
+    }
+}
+
+void medium_handle_msg(hwsim_vhost_dev *dev, unsigned int pair, const void *buf, uint32_t len) {
+    struct nlmsghdr *nlh = (struct nlmsghdr *) buf;
+    struct nlattr *tb[__HWSIM_ATTR_MAX];
+    struct genlmsghdr *gnlh;
+
+    if (len < NLMSG_HDRLEN + GENL_HDRLEN || nlh->nlmsg_len > len || nlh->nlmsg_len < NLMSG_HDRLEN + GENL_HDRLEN) {
+        return;
+    }
+    if (nlmsg_parse(nlh, GENL_HDRLEN, tb, __HWSIM_ATTR_MAX - 1, NULL) < 0) {
+        return;
+    }
+    gnlh = nlmsg_data(nlh);
+
+    switch (gnlh->cmd) {
+        case HWSIM_CMD_FRAME:
+            medium_tx(dev, pair, tb);
+            break;
+        case HWSIM_CMD_ADD_MAC_ADDR:
+        case HWSIM_CMD_DEL_MAC_ADDR:
+            if (!tb[HWSIM_ATTR_ADDR_TRANSMITTER] || nla_len(tb[HWSIM_ATTR_ADDR_TRANSMITTER]) != ETH_ALEN ||
+                !tb[HWSIM_ATTR_ADDR_RECEIVER] || nla_len(tb[HWSIM_ATTR_ADDR_RECEIVER]) != ETH_ALEN) {
+                break;
+            }
+            radio_vif_addr(&dev->medium, nla_data(tb[HWSIM_ATTR_ADDR_TRANSMITTER]),
+                           nla_data(tb[HWSIM_ATTR_ADDR_RECEIVER]), gnlh->cmd == HWSIM_CMD_ADD_MAC_ADDR);
+            break;
+        default:
+            break;
+    }
+}
+
+void medium_rx_reposted(hwsim_vhost_dev *dev, unsigned int pair) {
+    hwsim_vring *vr = &dev->vrings[pair * HWSIM_NUM_VQS + HWSIM_VQ_RX];
+    hwsim_vhost_stats *stats = &dev->medium.stats;
+    struct timespec now;
+    uint16_t avail, n;
+
+    if (!vring_ready(vr)) {
+        return;
+    }
+
+    if (dev->rx_posted[pair] && dev->rx_posted_count[pair]) {
+        avail = vring_avail_idx(vr);
+        n = avail - dev->rx_avail_seen[pair];
+        dev->rx_avail_seen[pair] = avail;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        /* the driver hands buffers back in the order it got them */
+        while (n-- && dev->rx_posted_count[pair]) {
+            uint64_t lat = ts_diff_ns(&now, &dev->rx_posted[pair][dev->rx_posted_head[pair]]);
+            unsigned int bucket = 0;
+
+            dev->rx_posted_head[pair] = (dev->rx_posted_head[pair] + 1) % vr->num;
+            dev->rx_posted_count[pair]--;
+            stats->rx_lat_sum_ns += lat;
+            stats->rx_lat_count++;
+            if (lat > stats->rx_lat_max_ns) {
+                stats->rx_lat_max_ns = lat;
+            }
+            while (lat >>= 1) {
+                bucket++;
+            }
+            stats->rx_lat_hist[bucket < 32 ? bucket : 31]++;
+        }
+    }
+
+    flush_tx_status(dev);
+    vring_notify(vr);
+}
+
+static void inject_cb(int fd, short what, void *rctx) {
+    UNUSED(fd);
+    UNUSED(what);
+    hwsim_vhost_dev *dev = rctx;
+    hwsim_medium *medium = &dev->medium;
+    static uint8_t frame[HWSIM_VHOST_RX_MSG_SIZE / 2];
+    bool pushed[HWSIM_VHOST_MAX_QUEUE_PAIRS] = {false};
+    unsigned int i, tries;
+    struct timespec now;
+
+    /* timer ticks come late under load, go by the time that passed */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    medium->inject_credit += medium->inject_pps * (ts_diff_ns(&now, &medium->inject_last) / 1e9);
+    medium->inject_last = now;
+    while (medium->inject_credit >= 1 && medium->n_radios) {
+        hwsim_vhost_radio *radio = NULL;
+        unsigned int pair;
+        uint32_t off;
+
+        /* radios that have not transmitted yet have no known channel */
+        for (tries = 0; tries < medium->n_radios && !radio; tries++) {
+            i = medium->inject_next++ % medium->n_radios;
+            if (medium->radios[i].freq) {
+                radio = &medium->radios[i];
+            }
+        }
+        if (!radio) {
+            break;
+        }
+        pair = i % dev->queue_pairs;
+
+        /* a data frame from a station nobody knows, to the radio */
+        memset(frame, 0, medium->inject_len);
+        frame[0] = 0x08;
+        memcpy(frame + 4, radio->n_vif_addrs ? radio->vif_addrs[0] : bcast_addr, ETH_ALEN);
+        memcpy(frame + 10, inject_src, ETH_ALEN);
+        memcpy(frame + 16, inject_src, ETH_ALEN);
+
+        off = msg_begin(HWSIM_CMD_FRAME);
+        off = msg_put(off, HWSIM_ATTR_ADDR_RECEIVER, radio->perm_addr, ETH_ALEN);
+        off = msg_put(off, HWSIM_ATTR_FRAME, frame, medium->inject_len);
+        off = msg_put_u32(off, HWSIM_ATTR_RX_RATE, 0);
+        off = msg_put_u32(off, HWSIM_ATTR_SIGNAL, (uint32_t) medium->signal);
+        off = msg_put_u32(off, HWSIM_ATTR_FREQ, radio->freq);
+        if (medium_push(dev, pair, msg_end(off))) {
+            /* the driver is behind, do not make up for it with a burst */
+            medium->stats.rx_no_buf++;
+            medium->inject_credit = 0;
+            break;
+        }
+        medium->stats.rx_frames++;
+        medium->stats.rx_bytes += medium->inject_len;
+        medium->inject_credit--;
+        pushed[pair] = true;
+    }
+
+    for (i = 0; i < dev->queue_pairs; i++) {
+        if (pushed[i]) {
+            vring_notify(&dev->vrings[i * HWSIM_NUM_VQS + HWSIM_VQ_RX]);
+        }
+    }
+}
+
+/* upper bound of the log2 bucket the @pct percentile falls into, in us */
+static double lat_percentile(const hwsim_vhost_stats *stats, unsigned int pct) {
+    uint64_t seen = 0, want = (stats->rx_lat_count * pct + 99) / 100;
+
+    for (unsigned int i = 0; i < 32; i++) {
+        seen += stats->rx_lat_hist[i];
+        if (seen >= want) {
+            return (double) (2ULL << i) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+static void bench_cb(int fd, short what, void *rctx) {
+    UNUSED(fd);
+    UNUSED(what);
+    hwsim_vhost_dev *dev = rctx;
+    hwsim_medium *medium = &dev->medium;
+    hwsim_vhost_stats *s = &medium->stats;
+    struct timespec now;
+    double secs;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = ts_diff_ns(&now, &medium->bench_last) / 1e9;
+    medium->bench_last = now;
+
+    printf("[%5.1fs] tx %8.0f fps %8.2f Mbit/s | rx %8.0f fps %8.2f Mbit/s no-buf %llu lost %llu"
+           " | status %llu dropped %llu | kick avg %.1f max %.1f us"
+           " | rx-repost avg %.1f p50 %.1f p99 %.1f max %.1f us\n",
+           ts_diff_ns(&now, &medium->bench_start) / 1e9,
+           s->tx_frames / secs, s->tx_bytes * 8 / secs / 1e6,
+           s->rx_frames / secs, s->rx_bytes * 8 / secs / 1e6,
+           (unsigned long long) s->rx_no_buf, (unsigned long long) s->rx_lost,
+           (unsigned long long) s->tx_info, (unsigned long long) s->tx_info_dropped,
+           s->kicks ? s->kick_lat_sum_ns / (double) s->kicks / 1000.0 : 0, s->kick_lat_max_ns / 1000.0,
+           s->rx_lat_count ? s->rx_lat_sum_ns / (double) s->rx_lat_count / 1000.0 : 0,
+           lat_percentile(s, 50), lat_percentile(s, 99), s->rx_lat_max_ns / 1000.0);
+    fflush(stdout);
+    memset(s, 0, sizeof(*s));
+
+    if (medium->bench_secs && ++medium->bench_reports >= medium->bench_secs) {
+        event_base_loopexit(dev->base, NULL);
+    }
+}
+
+void medium_bench_restart(hwsim_vhost_dev *dev) {
+    hwsim_medium *medium = &dev->medium;
+
+    clock_gettime(CLOCK_MONOTONIC, &medium->bench_start);
+    medium->bench_last = medium->bench_start;
+    medium->inject_last = medium->bench_start;
+    medium->inject_credit = 0;
+    medium->bench_reports = 0;
+    memset(&medium->stats, 0, sizeof(medium->stats));
+}
+
+int medium_init(hwsim_vhost_dev *dev) {
+    hwsim_medium *medium = &dev->medium;
+    struct timeval second = {.tv_sec = 1, .tv_usec = 0};
+    struct timeval tick = {.tv_sec = 0, .tv_usec = 1000};
+
+    medium->backlog = calloc(HWSIM_VHOST_STATUS_BACKLOG, sizeof(*medium->backlog));
+    if (!medium->backlog) {
+        fprintf(stderr, "Error allocating the TX status backlog\n");
+        return -1;
+    }
+    if (medium->inject_len < 24) {
+        medium->inject_len = 24;
+    } else if (medium->inject_len > sizeof(rx_msg) / 2) {
+        medium->inject_len = sizeof(rx_msg) / 2;
+    }
+
+    if (!medium->bench) {
+        return 0;
+    }
+    medium_bench_restart(dev);
+    medium->bench_ev = event_new(dev->base, -1, EV_PERSIST, bench_cb, dev);
+    if (!medium->bench_ev || event_add(medium->bench_ev, &second)) {
+        fprintf(stderr, "Error adding bench event\n");
+        return -1;
+    }
+    if (medium->inject_pps) {
+        medium->inject_ev = event_new(dev->base, -1, EV_PERSIST, inject_cb, dev);
+        if (!medium->inject_ev || event_add(medium->inject_ev, &tick)) {
+            fprintf(stderr, "Error adding inject event\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void medium_reset(hwsim_medium *medium) {
+    for (unsigned int i = 0; i < medium->n_radios; i++) {
+        free(medium->radios[i].vif_addrs);
+    }
+    free(medium->radios);
+    medium->radios = NULL;
+    medium->n_radios = 0;
+    medium->backlog_head = 0;
+    medium->backlog_count = 0;
+}
+
+void medium_free(hwsim_medium *medium) {
+    if (medium->inject_ev) {
+        event_free(medium->inject_ev);
+    }
+    if (medium->bench_ev) {
+        event_free(medium->bench_ev);
+    }
+    medium_reset(medium);
+    free(medium->backlog);
+}
@@ -0,0 +1,695 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <endian.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hwsim_vhost.h"
+
+/* TX messages are gathered in here before the medium looks at them */
+#define HWSIM_VHOST_TX_BUF_SIZE 65536
+
+static uint8_t tx_buf[HWSIM_VHOST_TX_BUF_SIZE];
+
+static void *gpa_to_va(hwsim_vhost_dev *dev, uint64_t gpa, uint64_t len) {
+    for (unsigned int i = 0; i < dev->n_regions; i++) {
+        hwsim_mem_region *r = &dev->regions[i];
+        if (gpa >= r->gpa && gpa - r->gpa < r->size && len <= r->size - (gpa - r->gpa)) {
+            return (uint8_t *) r->mmap_addr + r->mmap_offset + (gpa - r->gpa);
+        }
+    }
+    return NULL;
+}
+
+static void *uva_to_va(hwsim_vhost_dev *dev, uint64_t uva, uint64_t len) {
+    for (unsigned int i = 0; i < dev->n_regions; i++) {
+        hwsim_mem_region *r = &dev->regions[i];
+        if (uva >= r->uva && uva - r->uva < r->size && len <= r->size - (uva - r->uva)) {
+            return (uint8_t *) r->mmap_addr + r->mmap_offset + (uva - r->uva);
+        }
+    }
+    return NULL;
+}
+
+static void close_fd(int *fd) {
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static void unmap_regions(hwsim_vhost_dev *dev) {
+    for (unsigned int i = 0; i < dev->n_regions; i++) {
+        munmap(dev->regions[i].mmap_addr, dev->regions[i].mmap_size);
+    }
+    dev->n_regions = 0;
+}
+
+static void vring_stop(hwsim_vring *vr) {
+    if (vr->kick_ev) {
+        event_free(vr->kick_ev);
+        vr->kick_ev = NULL;
+    }
+    close_fd(&vr->kick_fd);
+    vr->enabled = false;
+}
+
+static void vring_reset(hwsim_vring *vr) {
+    vring_stop(vr);
+    close_fd(&vr->call_fd);
+    vr->num = 0;
+    vr->desc = NULL;
+    vr->avail = NULL;
+    vr->used = NULL;
+    vr->last_avail_idx = 0;
+    vr->used_idx = 0;
+    vr->need_call = false;
+}
+
+bool vring_ready(const hwsim_vring *vr) {
+    return vr->enabled && vr->num && vr->desc && vr->avail && vr->used;
+}
+
+uint16_t vring_avail_idx(const hwsim_vring *vr) {
+    return le16toh(__atomic_load_n(&vr->avail->idx, __ATOMIC_ACQUIRE));
+}
+
+static void vring_put_used(hwsim_vring *vr, uint16_t head, uint32_t len) {
+    struct vring_used_elem *elem = &vr->used->ring[vr->used_idx % vr->num];
+    elem->id = htole32(head);
+    elem->len = htole32(len);
+    vr->used_idx++;
+    /* the element has to be visible before the index that covers it */
+    __atomic_store_n(&vr->used->idx, htole16(vr->used_idx), __ATOMIC_RELEASE);
+    vr->need_call = true;
+}
+
+/*
+ * Walk the chain starting at @head and hand each descriptor with the
+ * requested direction to @fn. Returns the bytes covered or a negative errno.
+ */
+static int64_t vring_walk(hwsim_vring *vr, uint16_t head, bool writable,
+                          int (*fn)(void *ctx, void *va, uint32_t len), void *ctx) {
+    uint16_t idx = head;
+    int64_t total = 0;
+
+    for (uint32_t n = 0; n < vr->num; n++) {
+        struct vring_desc *d = &vr->desc[idx % vr->num];
+        uint16_t flags = le16toh(d->flags);
+        uint32_t len = le32toh(d->len);
+
+        if (!!(flags & VRING_DESC_F_WRITE) == writable) {
+            void *va = gpa_to_va(vr->dev, le64toh(d->addr), len);
+            if (!va) {
+                return -EFAULT;
+            }
+            if (fn) {
+                int ret = fn(ctx, va, len);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+            total += len;
+        }
+        if (!(flags & VRING_DESC_F_NEXT)) {
+            return total;
+        }
+        idx = le16toh(d->next);
+    }
+    /* looped over more descriptors than the ring holds */
+    return -ELOOP;
+}
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t off;
+    uint32_t len;
+} copy_ctx;
+
+static int copy_from_desc(void *rctx, void *va, uint32_t len) {
+    copy_ctx *c = rctx;
+    if (len > c->len - c->off) {
+        return -EMSGSIZE;
+    }
+    memcpy(c->buf + c->off, va, len);
+    c->off += len;
+    return 0;
+}
+
+static int copy_to_desc(void *rctx, void *va, uint32_t len) {
+    copy_ctx *c = rctx;
+    uint32_t n = c->len - c->off < len ? c->len - c->off : len;
+    memcpy(va, c->buf + c->off, n);
+    c->off += n;
+    return 0;
+}
+
+int vring_pop_tx(hwsim_vring *vr, void *buf, uint32_t cap, uint32_t *len) {
+    copy_ctx c = {.buf = buf, .off = 0, .len = cap};
+    uint16_t head;
+    int64_t ret;
+
+    if (!vring_ready(vr) || vr->last_avail_idx == vring_avail_idx(vr)) {
+        return 0;
+    }
+    head = le16toh(vr->avail->ring[vr->last_avail_idx % vr->num]);
+    vr->last_avail_idx++;
+
+    ret = vring_walk(vr, head, false, copy_from_desc, &c);
+    /* the buffer goes back to the driver either way */
+    vring_put_used(vr, head, 0);
+    if (ret < 0) {
+        return (int) ret;
+    }
+    *len = c.off;
+    return 1;
+}
+
+int vring_push_rx(hwsim_vring *vr, const void *buf, uint32_t len) {
+    copy_ctx c = {.buf = (uint8_t *) buf, .off = 0, .len = len};
+    uint16_t head;
+    int64_t room;
+
+    if (!vring_ready(vr) || vr->last_avail_idx == vring_avail_idx(vr)) {
+        return -ENOBUFS;
+    }
+    head = le16toh(vr->avail->ring[vr->last_avail_idx % vr->num]);
+
+    /* leave a buffer that is too small for the message to the next one */
+    room = vring_walk(vr, head, true, NULL, NULL);
+    if (room < 0) {
+        return (int) room;
+    }
+    if (room < len) {
+        return -EMSGSIZE;
+    }
+    vr->last_avail_idx++;
+    vring_walk(vr, head, true, copy_to_desc, &c);
+    vring_put_used(vr, head, len);
+    return 0;
+}
+
+void vring_notify(hwsim_vring *vr) {
+    uint64_t one = 1;
+
+    if (!vr->need_call || vr->call_fd < 0) {
+        return;
+    }
+    vr->need_call = false;
+    if (le16toh(__atomic_load_n(&vr->avail->flags, __ATOMIC_ACQUIRE)) & VRING_AVAIL_F_NO_INTERRUPT) {
+        return;
+    }
+    if (write(vr->call_fd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Error notifying queue %u: %s\n", vr->index, strerror(errno));
+    }
+}
+
+static void vring_kick_cb(int fd, short what, void *rctx) {
+    UNUSED(what);
+    hwsim_vring *vr = rctx;
+    hwsim_vhost_dev *dev = vr->dev;
+    unsigned int pair = vr->index / HWSIM_NUM_VQS;
+    struct timespec start, end;
+    uint64_t kicks, lat;
+    uint32_t len;
+    int ret;
+
+    if (read(fd, &kicks, sizeof(kicks)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "Error reading kick of queue %u: %s\n", vr->index, strerror(errno));
+        return;
+    }
+
+    if (vr->index % HWSIM_NUM_VQS == HWSIM_VQ_RX) {
+        medium_rx_reposted(dev, pair);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((ret = vring_pop_tx(vr, tx_buf, sizeof(tx_buf), &len))) {
+        if (ret < 0) {
+            fprintf(stderr, "Dropping malformed TX buffer on queue %u: %s\n", vr->index, strerror(-ret));
+            continue;
+        }
+        medium_handle_msg(dev, pair, tx_buf, len);
+    }
+
+    /* one notification per queue for everything this kick produced */
+    for (unsigned int i = 0; i < dev->queue_pairs * HWSIM_NUM_VQS; i++) {
+        vring_notify(&dev->vrings[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    lat = ts_diff_ns(&end, &start);
+    dev->medium.stats.kicks++;
+    dev->medium.stats.kick_lat_sum_ns += lat;
+    if (lat > dev->medium.stats.kick_lat_max_ns) {
+        dev->medium.stats.kick_lat_max_ns = lat;
+    }
+}
+
+static int vring_set_kick(hwsim_vhost_dev *dev, hwsim_vring *vr, int fd) {
+    vring_stop(vr);
+    vr->kick_fd = fd;
+    /* without protocol features a ring starts once it has a kick */
+    if (!(dev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        vr->enabled = true;
+    }
+    if (fd < 0) {
+        return 0;
+    }
+    /* kicks are also faked below, reading must not block then */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    vr->kick_ev = event_new(dev->base, fd, EV_READ | EV_PERSIST, vring_kick_cb, vr);
+    if (!vr->kick_ev || event_add(vr->kick_ev, NULL)) {
+        fprintf(stderr, "Error adding kick event of queue %u\n", vr->index);
+        return -1;
+    }
+    return 0;
+}
+
+/* buffers may have been added while the ring was not running yet */
+static void vring_start(hwsim_vring *vr) {
+    if (vring_ready(vr) && vr->kick_ev) {
+        event_active(vr->kick_ev, EV_READ, 0);
+    }
+}
+
+static int set_mem_table(hwsim_vhost_dev *dev, const vhost_user_memory *mem, int *fds, int nfds) {
+    if (mem->nregions > VHOST_MEMORY_MAX_NREGIONS || (int) mem->nregions != nfds) {
+        fprintf(stderr, "Memory table with %u regions and %d fds\n", mem->nregions, nfds);
+        return -1;
+    }
+
+    unmap_regions(dev);
+    for (unsigned int i = 0; i < mem->nregions; i++) {
+        const vhost_user_mem_region *src = &mem->regions[i];
+        hwsim_mem_region *r = &dev->regions[i];
+
+        r->gpa = src->guest_phys_addr;
+        r->uva = src->userspace_addr;
+        r->size = src->memory_size;
+        r->mmap_offset = src->mmap_offset;
+        r->mmap_size = src->memory_size + src->mmap_offset;
+        r->mmap_addr = mmap(NULL, r->mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[i], 0);
+        close(fds[i]);
+        fds[i] = -1;
+        if (r->mmap_addr == MAP_FAILED) {
+            fprintf(stderr, "Error mapping guest memory region %u: %s\n", i, strerror(errno));
+            for (unsigned int j = i + 1; j < mem->nregions; j++) {
+                close_fd(&fds[j]);
+            }
+            return -1;
+        }
+        dev->n_regions = i + 1;
+    }
+    return 0;
+}
+
+static int set_vring_num(hwsim_vhost_dev *dev, const vhost_user_vring_state *state) {
+    hwsim_vring *vr = &dev->vrings[state->index];
+
+    if (!state->num || state->num > HWSIM_VHOST_MAX_VRING_NUM || (state->num & (state->num - 1))) {
+        fprintf(stderr, "Queue %u with %u entries\n", state->index, state->num);
+        return -1;
+    }
+    /* the addresses were checked against the old size */
+    vr->num = state->num;
+    vr->desc = NULL;
+    vr->avail = NULL;
+    vr->used = NULL;
+    return 0;
+}
+
+static int set_vring_addr(hwsim_vhost_dev *dev, const vhost_user_vring_addr *addr) {
+    hwsim_vring *vr = &dev->vrings[addr->index];
+    uint64_t num = vr->num;
+
+    if (!num) {
+        fprintf(stderr, "Queue %u addresses before its size\n", addr->index);
+        return -1;
+    }
+    /* each part of the ring, with the event index fields, in one region */
+    vr->desc = uva_to_va(dev, addr->desc_user_addr, num * sizeof(struct vring_desc));
+    vr->avail = uva_to_va(dev, addr->avail_user_addr, sizeof(struct vring_avail) + (num + 1) * sizeof(uint16_t));
+    vr->used = uva_to_va(dev, addr->used_user_addr,
+                         sizeof(struct vring_used) + num * sizeof(struct vring_used_elem) + sizeof(uint16_t));
+    if (!vr->desc || !vr->avail || !vr->used) {
+        fprintf(stderr, "Queue %u addresses outside of guest memory\n", addr->index);
+        vr->desc = NULL;
+        vr->avail = NULL;
+        vr->used = NULL;
+        return -1;
+    }
+    /* the driver may have started before a reconnect */
+    vr->used_idx = le16toh(vr->used->idx);
+    return 0;
+}
+
+/* struct virtio_hwsim_config of the driver */
+typedef struct {
+    uint16_t max_queue_pairs;
+    uint16_t reserved;
+    uint32_t rx_buf_len;
+} __attribute__((packed)) hwsim_vhost_config;
+
+static int get_config(hwsim_vhost_dev *dev, vhost_user_config *config) {
+    hwsim_vhost_config space = {
+            .max_queue_pairs = htole16(dev->queue_pairs),
+            .rx_buf_len = htole32(dev->rx_buf_len)
+    };
+
+    if (config->size > sizeof(config->region)) {
+        return -1;
+    }
+    memset(config->region, 0, config->size);
+    if (config->offset < sizeof(space)) {
+        uint32_t n = sizeof(space) - config->offset;
+        memcpy(config->region, (uint8_t *) &space + config->offset, n < config->size ? n : config->size);
+    }
+    return 0;
+}
+
+/* only rx_buf_len is writable, the rest of a write is ignored */
+static int set_config(hwsim_vhost_dev *dev, const vhost_user_config *config) {
+    hwsim_vhost_config space = {.rx_buf_len = htole32(dev->rx_buf_len)};
+
+    if (config->size > sizeof(config->region)) {
+        return -1;
+    }
+    if (config->offset < sizeof(space)) {
+        uint32_t n = sizeof(space) - config->offset;
+        memcpy((uint8_t *) &space + config->offset, config->region, n < config->size ? n : config->size);
+    }
+    dev->rx_buf_len = le32toh(space.rx_buf_len);
+    return 0;
+}
+
+static int send_reply(hwsim_vhost_dev *dev, vhost_user_msg *msg, uint32_t size) {
+    ssize_t len = VHOST_USER_HDR_SIZE + size;
+
+    msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY_MASK;
+    msg->size = size;
+    if (send(dev->conn_fd, msg, len, MSG_NOSIGNAL) != len) {
+        fprintf(stderr, "Error replying to request %u: %s\n", msg->request, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int recv_msg(hwsim_vhost_dev *dev, vhost_user_msg *msg, int *fds, int *nfds) {
+    char control[CMSG_SPACE(VHOST_MEMORY_MAX_NREGIONS * sizeof(int))];
+    struct iovec iov = {.iov_base = msg, .iov_len = VHOST_USER_HDR_SIZE};
+    struct msghdr mh = {
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof(control)
+    };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    *nfds = 0;
+    ret = recvmsg(dev->conn_fd, &mh, MSG_CMSG_CLOEXEC);
+    if (ret <= 0) {
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+        }
+    }
+    if (ret != VHOST_USER_HDR_SIZE || (msg->flags & VHOST_USER_VERSION_MASK) != VHOST_USER_VERSION ||
+        msg->size > sizeof(msg->payload)) {
+        fprintf(stderr, "Malformed vhost-user message\n");
+        goto out_close;
+    }
+    if (msg->size && recv(dev->conn_fd, &msg->payload, msg->size, MSG_WAITALL) != (ssize_t) msg->size) {
+        goto out_close;
+    }
+    return 0;
+
+    out_close:
+    for (int i = 0; i < *nfds; i++) {
+        close(fds[i]);
+    }
+    *nfds = 0;
+    return -1;
+}
+
+static bool vring_index_valid(hwsim_vhost_dev *dev, uint32_t index) {
+    if (index >= (uint32_t) dev->queue_pairs * HWSIM_NUM_VQS) {
+        fprintf(stderr, "Request for queue %u, only %u are offered\n", index, dev->queue_pairs * HWSIM_NUM_VQS);
+        return false;
+    }
+    return true;
+}
+
+/* the queue a per queue request is about, -1 for other requests */
+static int64_t vring_request_index(const vhost_user_msg *msg) {
+    switch (msg->request) {
+        case VHOST_USER_SET_VRING_NUM:
+        case VHOST_USER_SET_VRING_BASE:
+        case VHOST_USER_GET_VRING_BASE:
+        case VHOST_USER_SET_VRING_ENABLE:
+            return msg->payload.state.index;
+        case VHOST_USER_SET_VRING_ADDR:
+            return msg->payload.addr.index;
+        case VHOST_USER_SET_VRING_KICK:
+        case VHOST_USER_SET_VRING_CALL:
+        case VHOST_USER_SET_VRING_ERR:
+            return msg->payload.u64 & VHOST_USER_VRING_IDX_MASK;
+        default:
+            return -1;
+    }
+}
+
+/* returns -1 to drop the connection */
+static int handle_msg(hwsim_vhost_dev *dev, vhost_user_msg *msg, int *fds, int nfds) {
+    bool need_reply = msg->flags & VHOST_USER_NEED_REPLY_MASK;
+    int64_t vring = vring_request_index(msg);
+    vhost_user_vring_state state;
+    vhost_user_vring_addr addr;
+    vhost_user_config config;
+    vhost_user_memory mem;
+    uint32_t index;
+    int fd, ret = 0;
+
+    if (vring >= 0 && !vring_index_valid(dev, (uint32_t) vring)) {
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+
+    switch (msg->request) {
+        case VHOST_USER_GET_FEATURES:
+            msg->payload.u64 = (1ULL << VIRTIO_F_VERSION_1) | (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+            msg->payload.u64 |= 1ULL << VIRTIO_HWSIM_F_RX_BUF_LEN;
+            if (dev->queue_pairs > 1) {
+                msg->payload.u64 |= 1ULL << VIRTIO_HWSIM_F_MQ;
+            }
+            return send_reply(dev, msg, sizeof(msg->payload.u64));
+        case VHOST_USER_SET_FEATURES:
+            dev->features = msg->payload.u64;
+            break;
+        case VHOST_USER_GET_PROTOCOL_FEATURES:
+            msg->payload.u64 = (1ULL << VHOST_USER_PROTOCOL_F_MQ) | (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |
+                               (1ULL << VHOST_USER_PROTOCOL_F_CONFIG);
+            return send_reply(dev, msg, sizeof(msg->payload.u64));
+        case VHOST_USER_SET_PROTOCOL_FEATURES:
+            dev->protocol_features = msg->payload.u64;
+            break;
+        case VHOST_USER_GET_QUEUE_NUM:
+            msg->payload.u64 = (uint64_t) dev->queue_pairs * HWSIM_NUM_VQS;
+            return send_reply(dev, msg, sizeof(msg->payload.u64));
+        case VHOST_USER_SET_OWNER:
+        case VHOST_USER_RESET_OWNER:
+            break;
+        case VHOST_USER_SET_CONFIG:
+            memcpy(&config, &msg->payload.config, sizeof(config));
+            ret = set_config(dev, &config);
+            break;
+        case VHOST_USER_SET_MEM_TABLE:
+            /* the payload is not naturally aligned in the packed message */
+            memcpy(&mem, &msg->payload.memory, sizeof(mem));
+            ret = set_mem_table(dev, &mem, fds, nfds);
+            nfds = 0;
+            break;
+        case VHOST_USER_SET_LOG_BASE:
+        case VHOST_USER_SET_LOG_FD:
+            /* no live migration, the fds are not needed */
+            break;
+        case VHOST_USER_SET_VRING_NUM:
+            memcpy(&state, &msg->payload.state, sizeof(state));
+            ret = set_vring_num(dev, &state);
+            break;
+        case VHOST_USER_SET_VRING_ADDR:
+            memcpy(&addr, &msg->payload.addr, sizeof(addr));
+            ret = set_vring_addr(dev, &addr);
+            break;
+        case VHOST_USER_SET_VRING_BASE:
+            dev->vrings[msg->payload.state.index].last_avail_idx = msg->payload.state.num;
+            break;
+        case VHOST_USER_GET_VRING_BASE:
+            vring_stop(&dev->vrings[msg->payload.state.index]);
+            msg->payload.state.num = dev->vrings[msg->payload.state.index].last_avail_idx;
+            return send_reply(dev, msg, sizeof(msg->payload.state));
+        case VHOST_USER_SET_VRING_KICK:
+        case VHOST_USER_SET_VRING_CALL:
+        case VHOST_USER_SET_VRING_ERR:
+            index = msg->payload.u64 & VHOST_USER_VRING_IDX_MASK;
+            fd = -1;
+            if (!(msg->payload.u64 & VHOST_USER_VRING_NOFD_MASK) && nfds == 1) {
+                fd = fds[0];
+                nfds = 0;
+            }
+            if (msg->request == VHOST_USER_SET_VRING_KICK) {
+                ret = vring_set_kick(dev, &dev->vrings[index], fd);
+                vring_start(&dev->vrings[index]);
+            } else if (msg->request == VHOST_USER_SET_VRING_CALL) {
+                close_fd(&dev->vrings[index].call_fd);
+                dev->vrings[index].call_fd = fd;
+            } else {
+                close_fd(&fd);
+            }
+            break;
+        case VHOST_USER_SET_VRING_ENABLE:
+            dev->vrings[msg->payload.state.index].enabled = msg->payload.state.num;
+            vring_start(&dev->vrings[msg->payload.state.index]);
+            break;
+        case VHOST_USER_GET_CONFIG:
+            memcpy(&config, &msg->payload.config, sizeof(config));
+            if (get_config(dev, &config)) {
+                return -1;
+            }
+            memcpy(&msg->payload.config, &config, sizeof(config));
+            return send_reply(dev, msg, offsetof(vhost_user_config, region) + config.size);
+        default:
+            fprintf(stderr, "Unsupported vhost-user request %u\n", msg->request);
+            ret = -1;
+            /* only fatal if the front-end cannot be told */
+            if (!need_reply || !(dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))) {
+                return -1;
+            }
+            break;
+    }
+
+    for (int i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+    if (need_reply && (dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))) {
+        msg->payload.u64 = ret ? 1 : 0;
+        return send_reply(dev, msg, sizeof(msg->payload.u64));
+    }
+    return ret;
+}
+
+void vhost_dev_close(hwsim_vhost_dev *dev) {
+    for (unsigned int i = 0; i < HWSIM_VHOST_MAX_VQS; i++) {
+        vring_reset(&dev->vrings[i]);
+    }
+    for (unsigned int i = 0; i < HWSIM_VHOST_MAX_QUEUE_PAIRS; i++) {
+        free(dev->rx_posted[i]);
+        dev->rx_posted[i] = NULL;
+        dev->rx_posted_count[i] = 0;
+    }
+    unmap_regions(dev);
+    medium_reset(&dev->medium);
+    if (dev->conn_ev) {
+        event_free(dev->conn_ev);
+        dev->conn_ev = NULL;
+    }
+    close_fd(&dev->conn_fd);
+    dev->features = 0;
+    dev->protocol_features = 0;
+    dev->rx_buf_len = 0;
+}
+
+static void conn_cb(int fd, short what, void *rctx) {
+    UNUSED(fd);
+    UNUSED(what);
+    hwsim_vhost_dev *dev = rctx;
+    int fds[VHOST_MEMORY_MAX_NREGIONS];
+    vhost_user_msg msg;
+    int nfds;
+
+    if (recv_msg(dev, &msg, fds, &nfds) || handle_msg(dev, &msg, fds, nfds)) {
+        printf("Front-end disconnected, waiting for the next one on %s\n", dev->socket_path);
+        vhost_dev_close(dev);
+        event_add(dev->listen_ev, NULL);
+    }
+}
+
+static void listen_cb(int fd, short what, void *rctx) {
+    UNUSED(what);
+    hwsim_vhost_dev *dev = rctx;
+
+    dev->conn_fd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (dev->conn_fd < 0) {
+        fprintf(stderr, "Error accepting front-end: %s\n", strerror(errno));
+        return;
+    }
+    /* one front-end at a time, the next is accepted once it is gone */
+    event_del(dev->listen_ev);
+    dev->conn_ev = event_new(dev->base, dev->conn_fd, EV_READ | EV_PERSIST, conn_cb, dev);
+    if (!dev->conn_ev || event_add(dev->conn_ev, NULL)) {
+        fprintf(stderr, "Error adding front-end event\n");
+        vhost_dev_close(dev);
+        event_add(dev->listen_ev, NULL);
+        return;
+    }
+    printf("Front-end connected\n");
+    if (dev->medium.bench) {
+        medium_bench_restart(dev);
+    }
+}
+
+void vhost_dev_init(hwsim_vhost_dev *dev) {
+    dev->listen_fd = -1;
+    dev->conn_fd = -1;
+    for (unsigned int i = 0; i < HWSIM_VHOST_MAX_VQS; i++) {
+        dev->vrings[i].dev = dev;
+        dev->vrings[i].index = i;
+        dev->vrings[i].kick_fd = -1;
+        dev->vrings[i].call_fd = -1;
+    }
+}
+
+int vhost_dev_listen(hwsim_vhost_dev *dev) {
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+
+    if (strlen(dev->socket_path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+    strcpy(sun.sun_path, dev->socket_path);
+
+    dev->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (dev->listen_fd < 0) {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        return -1;
+    }
+    unlink(dev->socket_path);
+    if (bind(dev->listen_fd, (struct sockaddr *) &sun, sizeof(sun)) || listen(dev->listen_fd, 1)) {
+        fprintf(stderr, "Error listening on %s: %s\n", dev->socket_path, strerror(errno));
+        close_fd(&dev->listen_fd);
+        return -1;
+    }
+
+    dev->listen_ev = event_new(dev->base, dev->listen_fd, EV_READ | EV_PERSIST, listen_cb, dev);
+    if (!dev->listen_ev || event_add(dev->listen_ev, NULL)) {
+        fprintf(stderr, "Error adding listen event\n");
+        close_fd(&dev->listen_fd);
+        return -1;
+    }
+    printf("Waiting for a front-end on %s\n", dev->socket_path);
+    return 0;
+}